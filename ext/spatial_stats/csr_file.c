@@ -0,0 +1,577 @@
+#include <ruby.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "extconf.h"
+#include "csr_matrix.h"
+#include "csr_file.h"
+#include "dvec.h"
+
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
+
+#define CSR_FILE_MAGIC "SSCSRMAT"
+#define CSR_FILE_VERSION 2
+#define CSR_FILE_BYTE_ORDER 0x01020304
+
+void csr_file_unmap(csr_matrix *csr)
+{
+    char *base = csr->map;
+    char *row_index = (char *)csr->row_index;
+
+    // row_index of a version 1 file is widened into memory
+    if (row_index < base || row_index >= base + csr->map_size)
+    {
+        free(csr->row_index);
+    }
+#ifdef HAVE_SYS_MMAN_H
+    munmap(csr->map, csr->map_size);
+#endif
+    csr->map = NULL;
+    csr->map_size = 0;
+}
+
+// Bytes of the values section for nnz values of type, float values are
+// padded so row_index stays 8 byte aligned.
+static int64_t csr_file_values_size(int64_t type, int64_t nnz)
+{
+    switch (type)
+    {
+    case CSR_VALUES_FLOAT64:
+        return (int64_t)sizeof(double) * nnz;
+    case CSR_VALUES_FLOAT32:
+        return ((int64_t)sizeof(float) * nnz + 7) / 8 * 8;
+    default:
+        return 0;
+    }
+}
+
+// Drop the whole pages inside [ptr, ptr + size) from the mapping. They
+// are read back from the file if they are used again.
+static void csr_file_release_range(const void *ptr, size_t size)
+{
+#if defined(HAVE_SYS_MMAN_H) && defined(HAVE_UNISTD_H) && defined(MADV_DONTNEED)
+    uintptr_t page = (uintptr_t)sysconf(_SC_PAGESIZE);
+    uintptr_t begin = ((uintptr_t)ptr + page - 1) / page * page;
+    uintptr_t end = ((uintptr_t)ptr + size) / page * page;
+
+    if (begin < end)
+    {
+        madvise((void *)begin, end - begin, MADV_DONTNEED);
+    }
+#endif
+}
+
+/**
+ *  Release the mapped pages holding the values and columns of rows
+ *  start...stop, for streaming a mapped matrix in blocks of rows.
+ */
+void csr_file_release(const csr_matrix *csr, int start, int stop)
+{
+    int64_t offset = csr->row_index[start];
+    size_t nnz = (size_t)(csr->row_index[stop] - offset);
+
+    if (csr->values)
+    {
+        csr_file_release_range(csr->values + offset, sizeof(double) * nnz);
+    }
+    if (csr->values32)
+    {
+        csr_file_release_range(csr->values32 + offset, sizeof(float) * nnz);
+    }
+    csr_file_release_range(csr->col_index + offset, sizeof(int) * nnz);
+}
+
+static int csr_file_write(FILE *f, const void *ptr, size_t size)
+{
+    return size == 0 || fwrite(ptr, 1, size, f) == size;
+}
+
+// every row must start where the previous ended and every column must
+// be in the matrix, otherwise the kernels would read out of bounds.
+static int csr_file_valid(const int *col_index, const int64_t *row_index, int n, int64_t nnz)
+{
+    int i;
+    int64_t jj;
+
+    if (row_index[0] != 0 || row_index[n] != nnz)
+    {
+        return 0;
+    }
+    for (i = 0; i < n; i++)
+    {
+        if (row_index[i + 1] < row_index[i])
+        {
+            return 0;
+        }
+    }
+    for (jj = 0; jj < nnz; jj++)
+    {
+        if (col_index[jj] < 0 || col_index[jj] >= n)
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/**
+ *  Write the matrix to a binary file that can be read with
+ *  +CSRMatrix.load+. The file holds the raw CSR arrays in native byte
+ *  order and, optionally, the keys of each row. It is written to a
+ *  temporary file and renamed into place, so processes that have the
+ *  previous version mapped keep a consistent copy.
+ *
+ *  @example
+ *      csr.dump('tmp/weights.csr', weights.keys)
+ *
+ *  @param [String] path to write to.
+ *  @param [Array] keys optional key of each row, stored with Marshal.
+ *
+ *  @return [CSRMatrix] self
+ */
+VALUE csr_matrix_dump(int argc, VALUE *argv, VALUE self)
+{
+    VALUE path;
+    VALUE keys;
+    VALUE keys_str = Qnil;
+    VALUE tmp_path;
+    csr_matrix *csr;
+    csr_file_header header;
+    FILE *f;
+    int ok;
+    static const char padding[8] = {0};
+    size_t values_size;
+    size_t padding_size = 0;
+
+    rb_scan_args(argc, argv, "11", &path, &keys);
+    FilePathValue(path);
+
+    TypedData_Get_Struct(self, csr_matrix, &csr_matrix_type, csr);
+    csr_matrix_check_square(csr);
+
+    if (!NIL_P(keys))
+    {
+        keys_str = rb_marshal_dump(keys, Qnil);
+    }
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, CSR_FILE_MAGIC, sizeof(header.magic));
+    header.version = CSR_FILE_VERSION;
+    header.byte_order = CSR_FILE_BYTE_ORDER;
+    header.n = csr->n;
+    header.nnz = csr->nnz;
+    header.keys_size = NIL_P(keys_str) ? 0 : RSTRING_LEN(keys_str);
+    header.values_type = csr->values_type;
+
+    values_size = (size_t)csr_file_values_size(csr->values_type, csr->nnz);
+    if (csr->values_type == CSR_VALUES_FLOAT32)
+    {
+        padding_size = values_size - sizeof(float) * (size_t)csr->nnz;
+        values_size -= padding_size;
+    }
+
+    tmp_path = rb_str_dup(path);
+    rb_str_catf(tmp_path, ".%ld.tmp", (long)getpid());
+
+    f = fopen(StringValueCStr(tmp_path), "wb");
+    if (!f)
+    {
+        rb_sys_fail_str(tmp_path);
+    }
+
+    ok = csr_file_write(f, &header, sizeof(header)) &&
+         csr_file_write(f, csr->values ? (const void *)csr->values : (const void *)csr->values32, values_size) &&
+         csr_file_write(f, padding, padding_size) &&
+         csr_file_write(f, csr->row_index, sizeof(int64_t) * (csr->n + 1)) &&
+         csr_file_write(f, csr->col_index, sizeof(int) * csr->nnz) &&
+         (NIL_P(keys_str) ||
+          csr_file_write(f, RSTRING_PTR(keys_str), RSTRING_LEN(keys_str)));
+    ok = (fclose(f) == 0) && ok;
+
+    if (!ok || rename(StringValueCStr(tmp_path), StringValueCStr(path)) != 0)
+    {
+        remove(StringValueCStr(tmp_path));
+        rb_sys_fail_str(path);
+    }
+
+    RB_GC_GUARD(keys_str);
+    return self;
+}
+
+// Widen the int32 row_index of a version 1 file.
+static void csr_file_widen(int64_t *dest, const int32_t *src, int n)
+{
+    int i;
+
+    for (i = 0; i <= n; i++)
+    {
+        dest[i] = src[i];
+    }
+}
+
+/**
+ *  Read a matrix written by +CSRMatrix#dump+. With +mmap: true+ (the
+ *  default where mmap is available) the arrays are used in place from
+ *  a read only shared mapping, so processes that load the same file,
+ *  like forked workers, share one copy of the pages. Otherwise the
+ *  arrays are read into memory.
+ *
+ *  Files written before row offsets were 64 bit are also read. Their
+ *  row_index is widened into memory, and the values and col_index are
+ *  still mapped. Values keep the type they were dumped with.
+ *
+ *  If keys were dumped with the matrix they are available from +keys+.
+ *  Keys are stored with Marshal, so only load files you wrote.
+ *
+ *  @example
+ *      csr = CSRMatrix.load('tmp/weights.csr')
+ *      csr.keys
+ *      # => [1, 2, 3, ...]
+ *
+ *  @param [String] path to read from.
+ *  @param [Boolean] mmap map the file instead of reading it.
+ *
+ *  @return [CSRMatrix]
+ */
+VALUE csr_matrix_load(int argc, VALUE *argv, VALUE klass)
+{
+    VALUE path;
+    VALUE opts;
+    VALUE mmap_opt = Qundef;
+    VALUE self;
+    VALUE keys_str = Qnil;
+    ID kwargs[1];
+    csr_matrix *csr;
+    csr_file_header header;
+    FILE *f;
+    long file_size;
+    long expected;
+    long row_size;
+    long values_size;
+    int use_mmap = 1;
+    int v1;
+
+    char *base = NULL;
+    const char *keys_ptr;
+    char *values = NULL;
+    int *col_index = NULL;
+    int64_t *row_index = NULL;
+    const int32_t *v1_row_index;
+    int32_t *v1_buf;
+    VALUE v1_buf_v;
+    int n;
+    int64_t nnz;
+    int ok;
+
+    rb_scan_args(argc, argv, "1:", &path, &opts);
+    FilePathValue(path);
+
+    if (!NIL_P(opts))
+    {
+        kwargs[0] = rb_intern("mmap");
+        rb_get_kwargs(opts, kwargs, 0, 1, &mmap_opt);
+        if (mmap_opt != Qundef)
+        {
+            use_mmap = RTEST(mmap_opt);
+        }
+    }
+
+    f = fopen(StringValueCStr(path), "rb");
+    if (!f)
+    {
+        rb_sys_fail_str(path);
+    }
+
+    // the bounds on nnz and keys_size keep the expected size from overflowing
+    ok = fread(&header, sizeof(header), 1, f) == 1 &&
+         memcmp(header.magic, CSR_FILE_MAGIC, sizeof(header.magic)) == 0 &&
+         (header.version == 1 || header.version == CSR_FILE_VERSION) &&
+         header.byte_order == CSR_FILE_BYTE_ORDER &&
+         header.n >= 0 && header.n < INT_MAX &&
+         header.nnz >= 0 && header.nnz <= INT64_MAX / 32 &&
+         header.keys_size >= 0 && header.keys_size <= INT64_MAX / 4 &&
+         header.values_type >= CSR_VALUES_FLOAT64 &&
+         header.values_type <= CSR_VALUES_BINARY_STANDARDIZED &&
+         (header.version != 1 || header.values_type == CSR_VALUES_FLOAT64) &&
+         fseek(f, 0, SEEK_END) == 0;
+
+    v1 = header.version == 1;
+    row_size = v1 ? (long)sizeof(int32_t) : (long)sizeof(int64_t);
+    file_size = ok ? ftell(f) : -1;
+    values_size = ok ? (long)csr_file_values_size(header.values_type, header.nnz) : 0;
+    expected = (long)sizeof(header) + values_size + (long)sizeof(int) * header.nnz +
+               row_size * (header.n + 1) + header.keys_size;
+
+    if (!ok || file_size != expected)
+    {
+        fclose(f);
+        rb_raise(rb_eArgError, "Invalid CSRMatrix file %" PRIsVALUE, path);
+    }
+
+    n = (int)header.n;
+    nnz = header.nnz;
+
+#ifdef HAVE_SYS_MMAN_H
+    if (use_mmap)
+    {
+        base = mmap(NULL, (size_t)file_size, PROT_READ, MAP_SHARED, fileno(f), 0);
+        fclose(f);
+        if (base == MAP_FAILED)
+        {
+            rb_sys_fail_str(path);
+        }
+
+        values = base + sizeof(header);
+        if (v1)
+        {
+            col_index = (int *)(values + values_size);
+            v1_row_index = (const int32_t *)(col_index + nnz);
+            row_index = malloc(sizeof(int64_t) * (n + 1));
+            if (!row_index)
+            {
+                munmap(base, (size_t)file_size);
+                rb_memerror();
+            }
+            csr_file_widen(row_index, v1_row_index, n);
+            keys_ptr = (const char *)(v1_row_index + n + 1);
+        }
+        else
+        {
+            row_index = (int64_t *)(values + values_size);
+            col_index = (int *)(row_index + n + 1);
+            keys_ptr = (const char *)(col_index + nnz);
+        }
+        if (header.keys_size > 0)
+        {
+            keys_str = rb_str_new(keys_ptr, header.keys_size);
+        }
+    }
+#else
+    use_mmap = 0;
+#endif
+
+    if (!use_mmap)
+    {
+        // the arena is laid out like the file, so version 2 files are
+        // read into it at once
+        self = csr_matrix_new(klass, n, n, nnz, (csr_values_type)header.values_type);
+        TypedData_Get_Struct(self, csr_matrix, &csr_matrix_type, csr);
+        col_index = csr->col_index;
+        row_index = csr->row_index;
+
+        ok = fseek(f, sizeof(header), SEEK_SET) == 0;
+        if (v1)
+        {
+            v1_buf = ALLOCV_N(int32_t, v1_buf_v, n + 1);
+            ok = ok &&
+                 (values_size == 0 || fread(csr->arena, 1, (size_t)values_size, f) == (size_t)values_size) &&
+                 fread(col_index, sizeof(int), (size_t)nnz, f) == (size_t)nnz &&
+                 fread(v1_buf, sizeof(int32_t), n + 1, f) == (size_t)(n + 1);
+            csr_file_widen(row_index, v1_buf, n);
+            ALLOCV_END(v1_buf_v);
+        }
+        else
+        {
+            ok = ok && fread(csr->arena, 1, csr->arena_size, f) == csr->arena_size;
+        }
+
+        if (ok && header.keys_size > 0)
+        {
+            keys_str = rb_str_new(NULL, header.keys_size);
+            ok = fread(RSTRING_PTR(keys_str), 1, header.keys_size, f) == (size_t)header.keys_size;
+        }
+        fclose(f);
+
+        // the matrix frees the arena when it is collected
+        if (!ok)
+        {
+            rb_sys_fail_str(path);
+        }
+        if (!csr_file_valid(col_index, row_index, n, nnz))
+        {
+            rb_raise(rb_eArgError, "Invalid CSRMatrix file %" PRIsVALUE, path);
+        }
+    }
+    else
+    {
+        if (!csr_file_valid(col_index, row_index, n, nnz))
+        {
+            if (v1)
+            {
+                free(row_index);
+            }
+#ifdef HAVE_SYS_MMAN_H
+            munmap(base, (size_t)file_size);
+#endif
+            rb_raise(rb_eArgError, "Invalid CSRMatrix file %" PRIsVALUE, path);
+        }
+
+        if (header.values_type == CSR_VALUES_FLOAT64)
+        {
+            self = csr_matrix_wrap(klass, n, n, nnz, (double *)values, col_index, row_index);
+        }
+        else
+        {
+            self = csr_matrix_wrap(klass, n, n, nnz, NULL, col_index, row_index);
+            csr_matrix_set_values_type(self, (csr_values_type)header.values_type, (float *)values);
+        }
+        TypedData_Get_Struct(self, csr_matrix, &csr_matrix_type, csr);
+        csr->map = base;
+        csr->map_size = (size_t)file_size;
+        csr_matrix_account(csr);
+    }
+
+    if (!NIL_P(keys_str))
+    {
+        rb_iv_set(self, "@keys", rb_marshal_load(keys_str));
+    }
+
+    return self;
+}
+
+// PostgreSQL binary COPY values are big endian
+static char *copy_put_int16(char *p, int16_t v)
+{
+    uint16_t u = (uint16_t)v;
+    p[0] = (char)(u >> 8);
+    p[1] = (char)u;
+    return p + 2;
+}
+
+static char *copy_put_int32(char *p, int32_t v)
+{
+    uint32_t u = (uint32_t)v;
+    p[0] = (char)(u >> 24);
+    p[1] = (char)(u >> 16);
+    p[2] = (char)(u >> 8);
+    p[3] = (char)u;
+    return p + 4;
+}
+
+static char *copy_put_float8(char *p, double v)
+{
+    uint64_t u;
+    int b;
+
+    memcpy(&u, &v, sizeof(u));
+    for (b = 0; b < 8; b++)
+    {
+        p[b] = (char)(u >> (56 - 8 * b));
+    }
+    return p + 8;
+}
+
+/**
+ *  Entries of rows start...stop as PostgreSQL binary COPY data, one
+ *  (i_idx integer, j_idx integer, weight double precision) tuple per
+ *  entry. The header is included when start is 0 and the trailer when
+ *  stop is n, so the chunks of consecutive row ranges concatenate into
+ *  one COPY stream.
+ *
+ *  With labels, row and column i are written as labels[i], so the
+ *  weights of a permuted matrix keep the indices of the observations.
+ *
+ *  @see https://www.postgresql.org/docs/current/sql-copy.html
+ *
+ *  @example
+ *      raw = connection.raw_connection
+ *      raw.copy_data('COPY weights FROM STDIN (FORMAT binary)') do
+ *        raw.put_copy_data(csr.copy_binary)
+ *      end
+ *
+ *  @param [Integer] start first row, 0 by default.
+ *  @param [Integer] stop row after the last, n by default.
+ *  @param [Array, String, Numo::Int32] labels optional index written for each row and column.
+ *
+ *  @return [String] binary COPY data
+ */
+VALUE csr_matrix_copy_binary(int argc, VALUE *argv, VALUE self)
+{
+    static const char signature[11] = "PGCOPY\n\377\r\n\0";
+    VALUE start_v, stop_v, labels_v;
+    VALUE result;
+    csr_matrix *csr;
+    ivec labels;
+    int start = 0;
+    int stop;
+    int i;
+    int64_t jj;
+    long size;
+    char *p;
+
+    rb_scan_args(argc, argv, "03", &start_v, &stop_v, &labels_v);
+    TypedData_Get_Struct(self, csr_matrix, &csr_matrix_type, csr);
+    csr_matrix_check_square(csr);
+    stop = csr->n;
+    if (!NIL_P(start_v))
+    {
+        start = NUM2INT(start_v);
+    }
+    if (!NIL_P(stop_v))
+    {
+        stop = NUM2INT(stop_v);
+    }
+    if (start < 0 || stop > csr->n || start > stop)
+    {
+        rb_raise(rb_eArgError, "Index Error rows must be in 0..n");
+    }
+    if (!NIL_P(labels_v))
+    {
+        ivec_read(&labels, labels_v);
+        if (labels.len != csr->n)
+        {
+            rb_raise(rb_eArgError, "Dimension Mismatch labels.size != n");
+        }
+    }
+
+    // 2 byte field count, then a 4 byte length before each field
+    size = (long)(csr->row_index[stop] - csr->row_index[start]) * (2 + 4 + 4 + 4 + 4 + 4 + 8);
+    if (start == 0)
+    {
+        size += sizeof(signature) + 8;
+    }
+    if (stop == csr->n)
+    {
+        size += 2;
+    }
+
+    result = rb_str_new(NULL, size);
+    p = RSTRING_PTR(result);
+    if (start == 0)
+    {
+        memcpy(p, signature, sizeof(signature));
+        p += sizeof(signature);
+        p = copy_put_int32(p, 0);
+        p = copy_put_int32(p, 0);
+    }
+    for (i = start; i < stop; i++)
+    {
+        for (jj = csr->row_index[i]; jj < csr->row_index[i + 1]; jj++)
+        {
+            p = copy_put_int16(p, 3);
+            p = copy_put_int32(p, 4);
+            p = copy_put_int32(p, NIL_P(labels_v) ? i : labels.ptr[i]);
+            p = copy_put_int32(p, 4);
+            p = copy_put_int32(p, NIL_P(labels_v) ? csr->col_index[jj] : labels.ptr[csr->col_index[jj]]);
+            p = copy_put_int32(p, 8);
+            p = copy_put_float8(p, csr_matrix_value(csr, i, jj));
+        }
+    }
+    if (stop == csr->n)
+    {
+        copy_put_int16(p, -1);
+    }
+    if (!NIL_P(labels_v))
+    {
+        ivec_release(&labels);
+    }
+
+    return result;
+}
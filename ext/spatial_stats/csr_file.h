@@ -0,0 +1,38 @@
+#ifndef CSR_FILE
+#define CSR_FILE
+
+#include <stdint.h>
+
+// On disk layout written by CSRMatrix#dump, all values in native
+// byte order:
+//
+//   header (64 bytes)
+//   values     double[nnz], float[nnz] padded to 8 bytes, or nothing
+//              for binary weights, see values_type
+//   row_index  int64[n + 1]
+//   col_index  int32[nnz]
+//   keys       Marshal.dump(keys), keys_size bytes
+//
+// The header size keeps values and row_index 8 byte aligned so the
+// arrays can be used in place from a memory mapping. Version 1 files
+// store col_index and then row_index as int32[n + 1]. They still load,
+// with row_index widened into memory.
+typedef struct csr_file_header
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    int64_t n;
+    int64_t nnz;
+    int64_t keys_size;
+    // csr_values_type, 0 (float64) in files written before it was stored
+    int64_t values_type;
+    int64_t reserved[2];
+} csr_file_header;
+
+void csr_file_unmap(csr_matrix *csr);
+void csr_file_release(const csr_matrix *csr, int start, int stop);
+VALUE csr_matrix_dump(int argc, VALUE *argv, VALUE self);
+VALUE csr_matrix_load(int argc, VALUE *argv, VALUE klass);
+VALUE csr_matrix_copy_binary(int argc, VALUE *argv, VALUE self);
+#endif
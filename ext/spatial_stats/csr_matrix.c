@@ -1,7 +1,12 @@
 #include <ruby.h>
+#include <math.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include "csr_matrix.h"
+#include "csr_file.h"
+#include "dvec.h"
+#include "spmv.h"
 
 void csr_matrix_free(void *mat)
 {
@@ -9,17 +14,94 @@ void csr_matrix_free(void *mat)
 
     if (csr->init == 1)
     {
-        free(csr->values);
-        free(csr->col_index);
-        free(csr->row_index);
+        if (csr->map)
+        {
+            csr_file_unmap(csr);
+        }
+        else if (csr->arena)
+        {
+            free(csr->arena);
+        }
+        else
+        {
+            free(csr->values);
+            free(csr->values32);
+            free(csr->col_index);
+            free(csr->row_index);
+        }
+    }
+#ifdef HAVE_RB_GC_ADJUST_MEMORY_USAGE
+    if (csr->gc_size)
+    {
+        rb_gc_adjust_memory_usage(-(ssize_t)csr->gc_size);
     }
+#endif
     free(mat);
 }
 
+/**
+ *  Bytes of the arrays the matrix owns on the malloc heap. Arrays that
+ *  point into a memory mapped file are left out, they are file backed
+ *  pages the kernel can drop, see CSRMatrix#memory_stats.
+ */
+size_t csr_matrix_heap_size(const csr_matrix *csr)
+{
+    const char *row_index = (const char *)csr->row_index;
+    size_t size = 0;
+
+    if (csr->init != 1)
+    {
+        return 0;
+    }
+    if (csr->arena)
+    {
+        return csr->arena_size;
+    }
+    if (csr->map)
+    {
+        // row_index of a version 1 file is widened into memory
+        if (row_index < (const char *)csr->map ||
+            row_index >= (const char *)csr->map + csr->map_size)
+        {
+            size = sizeof(int64_t) * (size_t)(csr->n + 1);
+        }
+        return size;
+    }
+
+    size = sizeof(int) * (size_t)csr->nnz + sizeof(int64_t) * (size_t)(csr->n + 1);
+    if (csr->values)
+    {
+        size += sizeof(double) * (size_t)csr->nnz;
+    }
+    if (csr->values32)
+    {
+        size += sizeof(float) * (size_t)csr->nnz;
+    }
+    return size;
+}
+
+/**
+ *  Report changes in csr_matrix_heap_size to the GC, so large matrices
+ *  count towards malloc_limit like strings and arrays do. Called
+ *  whenever arrays are given to a matrix.
+ */
+void csr_matrix_account(csr_matrix *csr)
+{
+    size_t size = csr_matrix_heap_size(csr);
+
+#ifdef HAVE_RB_GC_ADJUST_MEMORY_USAGE
+    if (size != csr->gc_size)
+    {
+        rb_gc_adjust_memory_usage((ssize_t)size - (ssize_t)csr->gc_size);
+    }
+#endif
+    csr->gc_size = size;
+}
+
 size_t csr_matrix_memsize(const void *ptr)
 {
     const csr_matrix *csr = (const csr_matrix *)ptr;
-    return sizeof(*csr);
+    return sizeof(*csr) + csr_matrix_heap_size(csr);
 }
 
 const rb_data_type_t csr_matrix_type = {
@@ -33,15 +115,25 @@ const rb_data_type_t csr_matrix_type = {
 VALUE csr_matrix_alloc(VALUE self)
 {
     csr_matrix *csr = ALLOC(csr_matrix);
+    csr->init = 0;
+    csr->values_type = CSR_VALUES_FLOAT64;
+    csr->values = NULL;
+    csr->values32 = NULL;
+    csr->row_length = -1;
+    csr->map = NULL;
+    csr->map_size = 0;
+    csr->arena = NULL;
+    csr->arena_size = 0;
+    csr->gc_size = 0;
     return TypedData_Wrap_Struct(self, &csr_matrix_type, csr);
 }
 
 void mat_to_sparse(csr_matrix *csr, VALUE data, VALUE keys, VALUE num_rows)
 {
 
-    int nnz = 0;
+    int64_t nnz = 0;
     int n = NUM2INT(num_rows);
-    int m;
+    long m;
 
     VALUE key;
     VALUE row;
@@ -52,13 +144,14 @@ void mat_to_sparse(csr_matrix *csr, VALUE data, VALUE keys, VALUE num_rows)
 
     double *values;
     int *col_index;
-    int *row_index;
+    int64_t *row_index;
 
-    int nz_idx;
+    int64_t nz_idx;
     double weight;
+    int binary = 1;
 
     int i;
-    int j;
+    long j;
 
     // first get number non zero count so we can alloc values and col_index
     for (i = 0; i < n; i++)
@@ -72,12 +165,12 @@ void mat_to_sparse(csr_matrix *csr, VALUE data, VALUE keys, VALUE num_rows)
         // if it is, add array len to nnz
         row = rb_hash_aref(data, key);
         Check_Type(row, T_ARRAY);
-        nnz += (int)RARRAY_LEN(row); // Explicit cast to int
+        nnz += RARRAY_LEN(row);
     }
 
     values = malloc(sizeof(double) * nnz);
     col_index = malloc(sizeof(int) * nnz);
-    row_index = malloc(sizeof(int) * (n + 1));
+    row_index = malloc(sizeof(int64_t) * (n + 1));
 
     // for every row, work through each hash
     // in each hash, add the weight to values and get col_index
@@ -90,7 +183,7 @@ void mat_to_sparse(csr_matrix *csr, VALUE data, VALUE keys, VALUE num_rows)
 
         key = rb_ary_entry(keys, i);
         row = rb_hash_aref(data, key);
-        m = (int)RARRAY_LEN(row); // Explicit cast to int
+        m = RARRAY_LEN(row);
 
         for (j = 0; j < m; j++)
         {
@@ -104,17 +197,29 @@ void mat_to_sparse(csr_matrix *csr, VALUE data, VALUE keys, VALUE num_rows)
             // get index in the keys array of key from lookup table
             values[nz_idx] = weight;
             col_index[nz_idx] = NUM2INT(rb_hash_aref(key_lookup, key));
+            binary = binary && weight == 1;
             nz_idx++;
         }
     }
     row_index[n] = nnz;
 
+    // binary weights, like contiguity, keep no values
+    if (binary)
+    {
+        free(values);
+        values = NULL;
+    }
+
     csr->n = n;
+    csr->m = n;
     csr->nnz = nnz;
+    csr->values_type = binary ? CSR_VALUES_BINARY : CSR_VALUES_FLOAT64;
     csr->values = values;
+    csr->values32 = NULL;
     csr->col_index = col_index;
     csr->row_index = row_index;
     csr->init = 1;
+    csr_matrix_account(csr);
 }
 
 /**
@@ -141,6 +246,7 @@ VALUE csr_matrix_initialize(VALUE self, VALUE data, VALUE num_rows)
     csr_matrix *csr;
     TypedData_Get_Struct(self, csr_matrix, &csr_matrix_type, csr);
     csr->init = 0;
+    csr->row_length = -1;
 
     Check_Type(data, T_HASH);
     Check_Type(num_rows, T_FIXNUM);
@@ -156,13 +262,274 @@ VALUE csr_matrix_initialize(VALUE self, VALUE data, VALUE num_rows)
     mat_to_sparse(csr, data, keys, num_rows);
 
     rb_iv_set(self, "@n", num_rows);
-    rb_iv_set(self, "@nnz", INT2NUM(csr->nnz));
+    rb_iv_set(self, "@m", num_rows);
+    rb_iv_set(self, "@nnz", LL2NUM(csr->nnz));
+
+    return self;
+}
+
+/**
+ *  Raise unless the matrix is square. Only the products read columns
+ *  through a vector of length m, everything else indexes arrays of
+ *  length n by column.
+ */
+void csr_matrix_check_square(const csr_matrix *csr)
+{
+    if (csr->m != csr->n)
+    {
+        rb_raise(rb_eArgError, "Dimension Mismatch CSRMatrix must be square");
+    }
+}
+
+/**
+ *  Values of csr as doubles, for kernels that read them in place. The
+ *  values array itself when they are stored as double, otherwise they
+ *  are written into a temporary buffer held by buf, which the caller
+ *  frees with rb_free_tmp_buffer.
+ */
+const double *csr_matrix_float64_values(const csr_matrix *csr, VALUE *buf)
+{
+    double *values;
+    int i;
+    int64_t jj;
+
+    *buf = 0;
+    if (csr->values_type == CSR_VALUES_FLOAT64)
+    {
+        return csr->values;
+    }
+
+    values = (double *)rb_alloc_tmp_buffer(buf, (csr->nnz > 0 ? csr->nnz : 1) * (long)sizeof(double));
+    for (i = 0; i < csr->n; i++)
+    {
+        for (jj = csr->row_index[i]; jj < csr->row_index[i + 1]; jj++)
+        {
+            values[jj] = csr_matrix_value(csr, i, jj);
+        }
+    }
+    return values;
+}
+
+/**
+ *  Wrap malloc'd CSR arrays of an n x m matrix in a new instance of
+ *  klass. The instance takes ownership of the arrays and frees them
+ *  when collected. Without values the matrix is binary, see
+ *  csr_matrix_set_values_type for the other types.
+ */
+VALUE csr_matrix_wrap(VALUE klass, int n, int m, int64_t nnz, double *values,
+                      int *col_index, int64_t *row_index)
+{
+    VALUE self = rb_obj_alloc(klass);
+    csr_matrix *csr;
+
+    TypedData_Get_Struct(self, csr_matrix, &csr_matrix_type, csr);
+    csr->n = n;
+    csr->m = m;
+    csr->nnz = nnz;
+    csr->values_type = values ? CSR_VALUES_FLOAT64 : CSR_VALUES_BINARY;
+    csr->values = values;
+    csr->values32 = NULL;
+    csr->col_index = col_index;
+    csr->row_index = row_index;
+    csr->init = 1;
+    csr_matrix_account(csr);
+
+    rb_iv_set(self, "@n", INT2NUM(n));
+    rb_iv_set(self, "@m", INT2NUM(m));
+    rb_iv_set(self, "@nnz", LL2NUM(nnz));
+
+    return self;
+}
+
+/**
+ *  A new instance of klass for an n x m matrix with nnz entries of
+ *  values_type, whose arrays are slices of one malloc'd arena, laid out
+ *  like a CSRMatrix#dump file: values, padded to 8 bytes, then
+ *  row_index, then col_index. The arrays are left for the caller to
+ *  fill. If the caller raises the matrix is collected with its arena,
+ *  so nothing leaks.
+ */
+VALUE csr_matrix_new(VALUE klass, int n, int m, int64_t nnz, csr_values_type values_type)
+{
+    VALUE self;
+    csr_matrix *csr;
+    size_t values_size = 0;
+    size_t size;
+    char *arena;
+
+    if (values_type == CSR_VALUES_FLOAT64)
+    {
+        values_size = sizeof(double) * (size_t)nnz;
+    }
+    else if (values_type == CSR_VALUES_FLOAT32)
+    {
+        values_size = (sizeof(float) * (size_t)nnz + 7) / 8 * 8;
+    }
+    size = values_size + sizeof(int64_t) * (size_t)(n + 1) + sizeof(int) * (size_t)nnz;
+    arena = malloc(size);
+    if (!arena)
+    {
+        rb_memerror();
+    }
+
+    self = csr_matrix_wrap(klass, n, m, nnz, NULL, (int *)(arena + size - sizeof(int) * (size_t)nnz),
+                           (int64_t *)(arena + values_size));
+    TypedData_Get_Struct(self, csr_matrix, &csr_matrix_type, csr);
+    csr->values_type = values_type;
+    if (values_type == CSR_VALUES_FLOAT64)
+    {
+        csr->values = (double *)arena;
+    }
+    else if (values_type == CSR_VALUES_FLOAT32)
+    {
+        csr->values32 = (float *)arena;
+    }
+    csr->arena = arena;
+    csr->arena_size = size;
+    csr_matrix_account(csr);
 
     return self;
 }
 
 /**
- *  Non-zero values in the matrix.
+ *  Change the values type of a matrix from csr_matrix_wrap, which it was
+ *  given no values for. For CSR_VALUES_FLOAT32 it takes ownership of
+ *  the malloc'd values32.
+ */
+void csr_matrix_set_values_type(VALUE self, csr_values_type type, float *values32)
+{
+    csr_matrix *csr;
+
+    TypedData_Get_Struct(self, csr_matrix, &csr_matrix_type, csr);
+    csr->values_type = type;
+    csr->values32 = values32;
+    csr_matrix_account(csr);
+}
+
+/**
+ *  A new instance of CSRMatrix from coordinate (COO) format. Entry k of
+ *  the matrix is at row +i_idx[k]+ and column +j_idx[k]+ with value
+ *  +weights[k]+. Entries are sorted into rows with a counting sort, which
+ *  is stable so entries in a row keep their input order.
+ *
+ *  If weights is 1 the matrix is binary and stores no values, see
+ *  +values_type+.
+ *
+ *  @example
+ *      i_idx = [0, 1, 2]
+ *      j_idx = [2, 1, 0]
+ *      csr = CSRMatrix.from_coo(i_idx, j_idx, 1, 3)
+ *      csr.col_index
+ *      # => [2, 1, 0]
+ *
+ *  @param [Array, String, Numo::Int32] i_idx row of each entry, in 0...n. A String must be packed with pack('l*').
+ *  @param [Array, String, Numo::Int32] j_idx column of each entry, in 0...n.
+ *  @param [Array, Numo::DFloat, Numeric] weights value of each entry, or one value for every entry.
+ *  @param [Integer] num_rows n of the square matrix.
+ *
+ *  @return [CSRMatrix]
+ */
+VALUE csr_matrix_from_coo(VALUE klass, VALUE i_idx, VALUE j_idx, VALUE weights, VALUE num_rows)
+{
+    ivec rows;
+    ivec cols;
+    dvec vals;
+    double weight = 0;
+    int scalar = RB_FLOAT_TYPE_P(weights) || RB_INTEGER_TYPE_P(weights);
+
+    int n = NUM2INT(num_rows);
+    int64_t nnz;
+    int64_t *next;
+    VALUE next_v;
+    VALUE result;
+    csr_matrix *csr;
+    double *values;
+    int *col_index;
+    int64_t *row_index;
+
+    int i;
+    int64_t k;
+    int64_t nz_idx;
+
+    if (n < 0)
+    {
+        rb_raise(rb_eArgError, "num_rows must be >= 0");
+    }
+
+    ivec_read(&rows, i_idx);
+    ivec_read(&cols, j_idx);
+    if (rows.len != cols.len)
+    {
+        rb_raise(rb_eArgError, "Dimension Mismatch i_idx.size != j_idx.size");
+    }
+    nnz = (int64_t)rows.len;
+
+    if (scalar)
+    {
+        weight = NUM2DBL(weights);
+    }
+    else
+    {
+        dvec_read(&vals, weights, nnz);
+    }
+
+    // validate before allocating so nothing leaks on raise
+    for (k = 0; k < nnz; k++)
+    {
+        if (rows.ptr[k] < 0 || rows.ptr[k] >= n || cols.ptr[k] < 0 || cols.ptr[k] >= n)
+        {
+            rb_raise(rb_eArgError, "Index Error i_idx and j_idx must be in 0...n");
+        }
+    }
+
+    result = csr_matrix_new(klass, n, n, nnz,
+                            scalar && weight == 1 ? CSR_VALUES_BINARY : CSR_VALUES_FLOAT64);
+    TypedData_Get_Struct(result, csr_matrix, &csr_matrix_type, csr);
+    values = csr->values;
+    col_index = csr->col_index;
+    row_index = csr->row_index;
+    memset(row_index, 0, sizeof(int64_t) * (n + 1));
+
+    // count entries in each row, then prefix sum into row starts
+    for (k = 0; k < nnz; k++)
+    {
+        row_index[rows.ptr[k] + 1]++;
+    }
+    for (i = 0; i < n; i++)
+    {
+        row_index[i + 1] += row_index[i];
+    }
+
+    next = ALLOCV_N(int64_t, next_v, n > 0 ? n : 1);
+    for (i = 0; i < n; i++)
+    {
+        next[i] = row_index[i];
+    }
+
+    for (k = 0; k < nnz; k++)
+    {
+        nz_idx = next[rows.ptr[k]]++;
+        if (values)
+        {
+            values[nz_idx] = scalar ? weight : vals.ptr[k];
+        }
+        col_index[nz_idx] = cols.ptr[k];
+    }
+    ALLOCV_END(next_v);
+
+    ivec_release(&rows);
+    ivec_release(&cols);
+    if (!scalar)
+    {
+        dvec_release(&vals);
+    }
+
+    return result;
+}
+
+/**
+ *  Non-zero values in the matrix. Values that are not stored, like the
+ *  ones of binary weights, are computed.
  *  
  *  @return [Array] of the non-zero values.
  */
@@ -172,13 +539,17 @@ VALUE csr_matrix_values(VALUE self)
     VALUE result;
 
     int i;
+    int64_t jj;
 
     TypedData_Get_Struct(self, csr_matrix, &csr_matrix_type, csr);
 
     result = rb_ary_new_capa(csr->nnz);
-    for (i = 0; i < csr->nnz; i++)
+    for (i = 0; i < csr->n; i++)
     {
-        rb_ary_store(result, i, DBL2NUM(csr->values[i]));
+        for (jj = csr->row_index[i]; jj < csr->row_index[i + 1]; jj++)
+        {
+            rb_ary_store(result, jj, DBL2NUM(csr_matrix_value(csr, i, jj)));
+        }
     }
 
     return result;
@@ -194,7 +565,7 @@ VALUE csr_matrix_col_index(VALUE self)
     csr_matrix *csr;
     VALUE result;
 
-    int i;
+    int64_t i;
 
     TypedData_Get_Struct(self, csr_matrix, &csr_matrix_type, csr);
 
@@ -229,7 +600,7 @@ VALUE csr_matrix_row_index(VALUE self)
     result = rb_ary_new_capa(csr->n + 1);
     for (i = 0; i <= csr->n; i++)
     {
-        rb_ary_store(result, i, INT2NUM(csr->row_index[i]));
+        rb_ary_store(result, i, LL2NUM(csr->row_index[i]));
     }
 
     return result;
@@ -237,92 +608,158 @@ VALUE csr_matrix_row_index(VALUE self)
 
 /**
  *  Multiply matrix by the input vector.
- *  
+ *
+ *  Packed double strings and Numo::DFloat are read through their
+ *  buffers, so no value is boxed per non-zero. The result is the same
+ *  kind as +vec+, or is written into +out+ when given. Matrices whose
+ *  rows all have the same number of entries, like kNN weights, run a
+ *  loop unrolled for that length.
+ *
+ *  @example
+ *      csr.mulvec([1, 2, 3])
+ *      # => [3.0, 2.0, 1.0]
+ *      csr.mulvec(Numo::DFloat[1, 2, 3])
+ *      # => Numo::DFloat[3, 2, 1]
+ *      csr.mulvec(vec, out)
+ *      # => out
+ *
  *  @see https://github.com/scipy/scipy/blob/53fac7a1d8a81d48be757632ad285b6fc76529ba/scipy/sparse/sparsetools/csr.h#L1120
- *  
- *  @param [Array] vec of length n. 
- * 
- *  @return [Array] of the result of the multiplication.
+ *
+ *  @param [Array, String, Numo::DFloat] vec of length m.
+ *  @param [Array, String, Numo::DFloat] out optional buffer of length n for the result.
+ *
+ *  @return [Array, String, Numo::DFloat] of the result of the multiplication.
  */
-VALUE csr_matrix_mulvec(VALUE self, VALUE vec)
+VALUE csr_matrix_mulvec(int argc, VALUE *argv, VALUE self)
 {
     csr_matrix *csr;
-    VALUE result;
-
-    int i;
-    int jj;
-    double tmp;
+    VALUE vec;
+    VALUE target;
+    dvec input;
+    dvec_out out;
 
-    Check_Type(vec, T_ARRAY);
+    rb_scan_args(argc, argv, "11", &vec, &target);
 
     TypedData_Get_Struct(self, csr_matrix, &csr_matrix_type, csr);
 
-    if (RARRAY_LEN(vec) != csr->n)
-    {
-        rb_raise(rb_eArgError, "Dimension Mismatch CSRMatrix.n != vec.size");
-    }
-
-    result = rb_ary_new_capa(csr->n);
-
-    // float *vals = (float *)DATA_PTR(result);
+    dvec_read(&input, vec, csr->m);
+    dvec_out_init(&out, target, input.kind, csr->n, &input);
 
-    for (i = 0; i < csr->n; i++)
-    {
-        tmp = 0;
-        for (jj = csr->row_index[i]; jj < csr->row_index[i + 1]; jj++)
-        {
-            tmp += csr->values[jj] * NUM2DBL(rb_ary_entry(vec, csr->col_index[jj]));
-        }
-        rb_ary_store(result, i, DBL2NUM(tmp));
-    }
+    csr_matrix_row_length(csr);
+    csr_matrix_spmv(csr, input.ptr, out.ptr);
 
-    return result;
+    dvec_release(&input);
+    return dvec_out_finish(&out);
 }
 
 /**
  *  Compute the dot product of the given row with the input vector.
  *  Equivalent to +mulvec(vec)[row]+.
- *  
- *  @param [Array] vec of length n. 
+ *
+ *  @param [Array, String, Numo::DFloat] vec of length m.
  *  @param [Integer] row of the dot product.
- * 
+ *
  *  @return [Float] of the result of the dot product.
  */
 VALUE csr_matrix_dot_row(VALUE self, VALUE vec, VALUE row)
 {
     csr_matrix *csr;
+    dvec input;
     VALUE result;
 
     int i;
-    int jj;
     double tmp;
 
-    Check_Type(vec, T_ARRAY);
     Check_Type(row, T_FIXNUM);
 
     TypedData_Get_Struct(self, csr_matrix, &csr_matrix_type, csr);
 
-    if (RARRAY_LEN(vec) != csr->n)
-    {
-        rb_raise(rb_eArgError, "Dimension Mismatch CSRMatrix.n != vec.size");
-    }
-
     i = NUM2INT(row);
     if (!(i >= 0 && i < csr->n))
     {
         rb_raise(rb_eArgError, "Index Error row_idx >= m or idx < 0");
     }
 
-    tmp = 0;
-    for (jj = csr->row_index[i]; jj < csr->row_index[i + 1]; jj++)
-    {
-        tmp += csr->values[jj] * NUM2DBL(rb_ary_entry(vec, csr->col_index[jj]));
-    }
+    dvec_read(&input, vec, csr->m);
+    tmp = csr_matrix_row_dot(csr, i, input.ptr);
 
+    dvec_release(&input);
     result = DBL2NUM(tmp);
     return result;
 }
 
+// number of columns of the dense matrix processed together, so the
+// block of each row that is read stays in cache across a row's non-zeros.
+#define MULMAT_BLOCK 64
+
+/**
+ *  Multiply matrix by an m x k dense matrix. Each column of +mat+ is
+ *  multiplied in a single pass over the non-zeros, which is the same as
+ *  calling +mulvec+ on every column without an n x n dense matrix. The
+ *  columns are processed in blocks so rows of +mat+ are read from cache.
+ *
+ *  @example
+ *      csr.mulmat(Numo::DFloat[[1, 4], [2, 5], [3, 6]])
+ *      # => Numo::DFloat[[3, 6], [2, 5], [1, 4]]
+ *
+ *  @param [Numo::DFloat, Array] mat of shape m x k.
+ *  @param [Numo::DFloat] out optional buffer of shape n x k for the result.
+ *
+ *  @return [Numo::DFloat] of shape n x k with the result of the multiplication.
+ */
+VALUE csr_matrix_mulmat(int argc, VALUE *argv, VALUE self)
+{
+    csr_matrix *csr;
+    VALUE mat;
+    VALUE target;
+    dvec input;
+    dvec_out out;
+
+    long k;
+    long start;
+    long stop;
+    long c;
+    int i;
+    int64_t jj;
+    double w;
+    double *row;
+    const double *col;
+
+    rb_scan_args(argc, argv, "11", &mat, &target);
+
+    TypedData_Get_Struct(self, csr_matrix, &csr_matrix_type, csr);
+
+    dvec_read_matrix(&input, mat, csr->m, &k);
+    dvec_out_init_matrix(&out, target, csr->n, k);
+
+    for (start = 0; start < k; start += MULMAT_BLOCK)
+    {
+        stop = start + MULMAT_BLOCK < k ? start + MULMAT_BLOCK : k;
+
+        for (i = 0; i < csr->n; i++)
+        {
+            row = out.ptr + (long)i * k;
+            for (c = start; c < stop; c++)
+            {
+                row[c] = 0;
+            }
+
+            for (jj = csr->row_index[i]; jj < csr->row_index[i + 1]; jj++)
+            {
+                w = csr_matrix_value(csr, i, jj);
+                col = input.ptr + (long)csr->col_index[jj] * k;
+                for (c = start; c < stop; c++)
+                {
+                    row[c] += w * col[c];
+                }
+            }
+        }
+    }
+
+    dvec_release(&input);
+    return dvec_out_finish(&out);
+}
+
 /** 
  *  A hash representation of the matrix with coordinates as keys.
  *  @example
@@ -351,11 +788,11 @@ VALUE csr_matrix_coordinates(VALUE self)
     VALUE result;
 
     int i;
-    int k;
+    int64_t k;
 
     VALUE key;
     VALUE val;
-    int row_end;
+    int64_t row_end;
 
     TypedData_Get_Struct(self, csr_matrix, &csr_matrix_type, csr);
 
@@ -379,10 +816,1429 @@ VALUE csr_matrix_coordinates(VALUE self)
         rb_ary_store(key, 0, INT2NUM(i));
         rb_ary_store(key, 1, INT2NUM(csr->col_index[k]));
 
-        val = DBL2NUM(csr->values[k]);
+        val = DBL2NUM(csr_matrix_value(csr, i, k));
 
         rb_hash_aset(result, key, val);
     }
 
     return result;
-}
\ No newline at end of file
+}
+/**
+ *  Dimensions of the matrix. Weights matrices are always square, a
+ *  block from +row_block+ has a column for each entry of its halo.
+ *
+ *  @return [Array] of [n, m].
+ */
+VALUE csr_matrix_shape(VALUE self)
+{
+    csr_matrix *csr;
+
+    TypedData_Get_Struct(self, csr_matrix, &csr_matrix_type, csr);
+    return rb_assoc_new(INT2NUM(csr->n), INT2NUM(csr->m));
+}
+
+/**
+ *  Values on the diagonal of the matrix, 0 where a row has no entry for
+ *  itself.
+ *
+ *  @example
+ *      csr.diagonal
+ *      # => [0.0, 1.0, 0.0]
+ *
+ *  @return [Array] of length n.
+ */
+VALUE csr_matrix_diagonal(VALUE self)
+{
+    csr_matrix *csr;
+    VALUE result;
+
+    int i;
+    int64_t jj;
+    double tmp;
+
+    TypedData_Get_Struct(self, csr_matrix, &csr_matrix_type, csr);
+    csr_matrix_check_square(csr);
+
+    result = rb_ary_new_capa(csr->n);
+    for (i = 0; i < csr->n; i++)
+    {
+        tmp = 0;
+        for (jj = csr->row_index[i]; jj < csr->row_index[i + 1]; jj++)
+        {
+            if (csr->col_index[jj] == i)
+            {
+                tmp += csr_matrix_value(csr, i, jj);
+            }
+        }
+        rb_ary_store(result, i, DBL2NUM(tmp));
+    }
+
+    return result;
+}
+
+/**
+ *  Sum of the diagonal of the matrix, without forming the dense matrix.
+ *
+ *  @return [Float]
+ */
+VALUE csr_matrix_trace(VALUE self)
+{
+    csr_matrix *csr;
+
+    int i;
+    int64_t jj;
+    double tmp;
+
+    TypedData_Get_Struct(self, csr_matrix, &csr_matrix_type, csr);
+    csr_matrix_check_square(csr);
+
+    tmp = 0;
+    for (i = 0; i < csr->n; i++)
+    {
+        for (jj = csr->row_index[i]; jj < csr->row_index[i + 1]; jj++)
+        {
+            if (csr->col_index[jj] == i)
+            {
+                tmp += csr_matrix_value(csr, i, jj);
+            }
+        }
+    }
+
+    return DBL2NUM(tmp);
+}
+
+/**
+ *  Sum of the values in each row.
+ *
+ *  @example
+ *      csr.row_sums
+ *      # => [1.0, 1.0, 2.0]
+ *
+ *  @return [Array] of length n.
+ */
+VALUE csr_matrix_row_sums(VALUE self)
+{
+    csr_matrix *csr;
+    VALUE result;
+
+    int i;
+    int64_t jj;
+    double tmp;
+
+    TypedData_Get_Struct(self, csr_matrix, &csr_matrix_type, csr);
+
+    result = rb_ary_new_capa(csr->n);
+    for (i = 0; i < csr->n; i++)
+    {
+        tmp = 0;
+        for (jj = csr->row_index[i]; jj < csr->row_index[i + 1]; jj++)
+        {
+            tmp += csr_matrix_value(csr, i, jj);
+        }
+        rb_ary_store(result, i, DBL2NUM(tmp));
+    }
+
+    return result;
+}
+
+/**
+ *  Row standardized copy of the matrix, each value divided by the sum
+ *  of its row. Rows without neighbors stay empty. The receiver is not
+ *  modified.
+ *
+ *  Values keep their type. Binary weights are standardized without
+ *  storing values, each entry is 1 / the entries in its row.
+ *
+ *  @example
+ *      csr.values
+ *      # => [1.0, 1.0, 2.0, 2.0]
+ *      csr.row_standardize.values
+ *      # => [1.0, 1.0, 0.5, 0.5]
+ *
+ *  @return [CSRMatrix]
+ */
+VALUE csr_matrix_row_standardize(VALUE self)
+{
+    csr_matrix *csr;
+    csr_matrix *standardized;
+    VALUE result;
+    csr_values_type values_type;
+    double *values;
+    float *values32;
+
+    int i;
+    int64_t jj;
+    double sum;
+
+    TypedData_Get_Struct(self, csr_matrix, &csr_matrix_type, csr);
+
+    values_type = csr->values_type == CSR_VALUES_BINARY ? CSR_VALUES_BINARY_STANDARDIZED : csr->values_type;
+    result = csr_matrix_new(rb_obj_class(self), csr->n, csr->m, csr->nnz, values_type);
+    TypedData_Get_Struct(result, csr_matrix, &csr_matrix_type, standardized);
+    values = standardized->values;
+    values32 = standardized->values32;
+
+    memcpy(standardized->col_index, csr->col_index, sizeof(int) * csr->nnz);
+    memcpy(standardized->row_index, csr->row_index, sizeof(int64_t) * (csr->n + 1));
+
+    for (i = 0; i < csr->n && (values || values32); i++)
+    {
+        sum = 0;
+        for (jj = csr->row_index[i]; jj < csr->row_index[i + 1]; jj++)
+        {
+            sum += csr_matrix_value(csr, i, jj);
+        }
+        for (jj = csr->row_index[i]; jj < csr->row_index[i + 1]; jj++)
+        {
+            if (values)
+            {
+                values[jj] = csr->values[jj] / sum;
+            }
+            else
+            {
+                values32[jj] = (float)(csr->values32[jj] / sum);
+            }
+        }
+    }
+
+    return result;
+}
+
+/**
+ *  Inverse distance weighted copy of a matrix of distances, each value
+ *  d replaced by 1/((scale * d)**alpha). If the lowest distance is < 1,
+ *  scale is the factor that makes it 1, otherwise it is 1, the same as
+ *  +Queries::Weights.idw_weights+. The receiver is not modified.
+ *
+ *  Every distance must be > 0, so an ArgumentError is raised for the
+ *  pairs of coincident points instead of giving them infinite weights.
+ *
+ *  @example
+ *      csr.values
+ *      # => [0.5, 0.5, 1.0, 2.0]
+ *      csr.inverse_distance(1).values
+ *      # => [1.0, 1.0, 0.5, 0.25]
+ *
+ *  @param [Numeric] alpha number used in inverse calculations (usually 1 or 2)
+ *
+ *  @return [CSRMatrix]
+ */
+VALUE csr_matrix_inverse_distance(VALUE self, VALUE alpha_v)
+{
+    csr_matrix *csr;
+    double alpha = NUM2DBL(alpha_v);
+    const double *distances;
+    VALUE distances_v;
+    VALUE result;
+    csr_matrix *weights;
+
+    int64_t jj;
+    double min_dist = 1;
+    double scale = 1;
+
+    TypedData_Get_Struct(self, csr_matrix, &csr_matrix_type, csr);
+
+    distances = csr_matrix_float64_values(csr, &distances_v);
+    for (jj = 0; jj < csr->nnz; jj++)
+    {
+        if (!(distances[jj] > 0))
+        {
+            rb_free_tmp_buffer(&distances_v);
+            rb_raise(rb_eArgError, "distances must be > 0");
+        }
+        min_dist = distances[jj] < min_dist ? distances[jj] : min_dist;
+    }
+    if (min_dist < 1)
+    {
+        scale = 1 / min_dist;
+    }
+
+    result = csr_matrix_new(rb_obj_class(self), csr->n, csr->m, csr->nnz, CSR_VALUES_FLOAT64);
+    TypedData_Get_Struct(result, csr_matrix, &csr_matrix_type, weights);
+
+    memcpy(weights->col_index, csr->col_index, sizeof(int) * csr->nnz);
+    memcpy(weights->row_index, csr->row_index, sizeof(int64_t) * (csr->n + 1));
+
+    for (jj = 0; jj < csr->nnz; jj++)
+    {
+        weights->values[jj] = 1.0 / pow(scale * distances[jj], alpha);
+    }
+    rb_free_tmp_buffer(&distances_v);
+
+    return result;
+}
+
+typedef enum csr_kernel
+{
+    CSR_KERNEL_TRIANGULAR,
+    CSR_KERNEL_BISQUARE,
+    CSR_KERNEL_GAUSSIAN
+} csr_kernel;
+
+/**
+ *  Kernel weighted copy of a matrix of distances. Each value d is
+ *  replaced by a kernel of z = d / bandwidth.
+ *
+ *  [triangular] 1 - z
+ *  [bisquare] (1 - z**2)**2
+ *  [gaussian] exp(-z**2 / 2)
+ *
+ *  The triangular and bisquare kernels are 0 from the bandwidth on, so
+ *  those entries are dropped instead of stored as 0. Gaussian weights
+ *  are computed for every entry. The receiver is not modified.
+ *
+ *  @example
+ *      csr.values
+ *      # => [1.0, 2.0, 3.0]
+ *      csr.kernel(:triangular, 2).values
+ *      # => [0.5]
+ *
+ *  @param [Symbol] kind of kernel. One of +:triangular+, +:bisquare+ or +:gaussian+.
+ *  @param [Numeric] bandwidth distances are scaled by, > 0.
+ *
+ *  @return [CSRMatrix]
+ */
+VALUE csr_matrix_kernel(VALUE self, VALUE kind_v, VALUE bandwidth_v)
+{
+    csr_matrix *csr;
+    csr_kernel kind;
+    double bandwidth = NUM2DBL(bandwidth_v);
+    double *values;
+    int *col_index;
+    int64_t *row_index;
+    int64_t nnz_alloc;
+    ID kind_id;
+
+    int i;
+    int64_t jj;
+    int64_t nz_idx = 0;
+    double z;
+
+    Check_Type(kind_v, T_SYMBOL);
+    kind_id = SYM2ID(kind_v);
+    if (kind_id == rb_intern("triangular"))
+    {
+        kind = CSR_KERNEL_TRIANGULAR;
+    }
+    else if (kind_id == rb_intern("bisquare"))
+    {
+        kind = CSR_KERNEL_BISQUARE;
+    }
+    else if (kind_id == rb_intern("gaussian"))
+    {
+        kind = CSR_KERNEL_GAUSSIAN;
+    }
+    else
+    {
+        rb_raise(rb_eArgError, "kind must be :triangular, :bisquare or :gaussian");
+    }
+    if (!(bandwidth > 0))
+    {
+        rb_raise(rb_eArgError, "bandwidth must be > 0");
+    }
+
+    TypedData_Get_Struct(self, csr_matrix, &csr_matrix_type, csr);
+
+    nnz_alloc = csr->nnz > 0 ? csr->nnz : 1;
+    values = malloc(sizeof(double) * nnz_alloc);
+    col_index = malloc(sizeof(int) * nnz_alloc);
+    row_index = malloc(sizeof(int64_t) * (csr->n + 1));
+
+    // entries are only dropped, so the result is written in place as
+    // the rows are read
+    row_index[0] = 0;
+    for (i = 0; i < csr->n; i++)
+    {
+        for (jj = csr->row_index[i]; jj < csr->row_index[i + 1]; jj++)
+        {
+            z = csr_matrix_value(csr, i, jj) / bandwidth;
+            if (kind != CSR_KERNEL_GAUSSIAN && !(z < 1))
+            {
+                continue;
+            }
+
+            switch (kind)
+            {
+            case CSR_KERNEL_TRIANGULAR:
+                values[nz_idx] = 1 - z;
+                break;
+            case CSR_KERNEL_BISQUARE:
+                values[nz_idx] = (1 - z * z) * (1 - z * z);
+                break;
+            case CSR_KERNEL_GAUSSIAN:
+                values[nz_idx] = exp(-z * z / 2);
+                break;
+            }
+            col_index[nz_idx++] = csr->col_index[jj];
+        }
+        row_index[i + 1] = nz_idx;
+    }
+
+    if (nz_idx > 0)
+    {
+        values = realloc(values, sizeof(double) * nz_idx);
+        col_index = realloc(col_index, sizeof(int) * nz_idx);
+    }
+
+    return csr_matrix_wrap(rb_obj_class(self), csr->n, csr->m, nz_idx, values,
+                           col_index, row_index);
+}
+
+static int csr_row_has_diagonal(const csr_matrix *csr, int i)
+{
+    int64_t jj;
+
+    for (jj = csr->row_index[i]; jj < csr->row_index[i + 1]; jj++)
+    {
+        if (csr->col_index[jj] == i)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// copy entry jj of row i to entry nz_idx of the windowed arrays
+static void csr_window_copy(const csr_matrix *csr, int i, int64_t jj, double *values,
+                            float *values32, int *col_index, int64_t nz_idx)
+{
+    if (values)
+    {
+        values[nz_idx] = csr_matrix_value(csr, i, jj);
+    }
+    else if (values32)
+    {
+        values32[nz_idx] = csr->values32[jj];
+    }
+    col_index[nz_idx] = csr->col_index[jj];
+}
+
+/**
+ *  Windowed copy of the matrix, with a weight of 1 for each observation
+ *  itself. Rows that already have an entry on the diagonal are copied
+ *  as they are. Otherwise the diagonal is inserted before the first
+ *  entry of a later column, so sorted rows stay sorted, and the other
+ *  entries keep their order. The receiver is not modified.
+ *
+ *  Binary and float32 matrices keep their values type, standardized
+ *  binary values are written as float64.
+ *
+ *  @example
+ *      csr = CSRMatrix.from_coo([0, 1], [1, 0], 1, 2)
+ *      csr.window.col_index
+ *      # => [0, 1, 0, 1]
+ *
+ *  @param [Array, String, Numo::Int32] labels optional order of the observations the diagonal is inserted by, +permutation+ of reordered weights. Defaults to the row and column indices.
+ *
+ *  @return [CSRMatrix]
+ */
+VALUE csr_matrix_window(int argc, VALUE *argv, VALUE self)
+{
+    csr_matrix *csr;
+    VALUE labels_v;
+    VALUE result;
+    csr_matrix *windowed;
+    ivec labels;
+    csr_values_type values_type;
+    double *values;
+    float *values32;
+    int *col_index;
+    int64_t *row_index;
+    int64_t nnz;
+    int64_t nz_idx = 0;
+    int64_t jj;
+    int i;
+    int label;
+
+    rb_scan_args(argc, argv, "01", &labels_v);
+
+    TypedData_Get_Struct(self, csr_matrix, &csr_matrix_type, csr);
+    csr_matrix_check_square(csr);
+
+    labels.ptr = NULL;
+    if (!NIL_P(labels_v))
+    {
+        ivec_read(&labels, labels_v);
+        if (labels.len != csr->n)
+        {
+            ivec_release(&labels);
+            rb_raise(rb_eArgError, "Dimension Mismatch labels.size != n");
+        }
+    }
+
+    nnz = csr->nnz;
+    for (i = 0; i < csr->n; i++)
+    {
+        nnz += !csr_row_has_diagonal(csr, i);
+    }
+
+    values_type = csr->values_type == CSR_VALUES_BINARY_STANDARDIZED ? CSR_VALUES_FLOAT64 : csr->values_type;
+    result = csr_matrix_new(rb_obj_class(self), csr->n, csr->m, nnz, values_type);
+    TypedData_Get_Struct(result, csr_matrix, &csr_matrix_type, windowed);
+    values = windowed->values;
+    values32 = windowed->values32;
+    col_index = windowed->col_index;
+    row_index = windowed->row_index;
+
+    row_index[0] = 0;
+    for (i = 0; i < csr->n; i++)
+    {
+        jj = csr->row_index[i];
+        if (!csr_row_has_diagonal(csr, i))
+        {
+            // entries of earlier columns, then the diagonal
+            label = labels.ptr ? labels.ptr[i] : i;
+            while (jj < csr->row_index[i + 1] &&
+                   (labels.ptr ? labels.ptr[csr->col_index[jj]] : csr->col_index[jj]) < label)
+            {
+                csr_window_copy(csr, i, jj++, values, values32, col_index, nz_idx++);
+            }
+            if (values)
+            {
+                values[nz_idx] = 1;
+            }
+            else if (values32)
+            {
+                values32[nz_idx] = 1;
+            }
+            col_index[nz_idx++] = i;
+        }
+        while (jj < csr->row_index[i + 1])
+        {
+            csr_window_copy(csr, i, jj++, values, values32, col_index, nz_idx++);
+        }
+        row_index[i + 1] = nz_idx;
+    }
+
+    if (labels.ptr)
+    {
+        ivec_release(&labels);
+    }
+
+    return result;
+}
+
+static int csr_int_cmp(const void *a, const void *b)
+{
+    int x = *(const int *)a;
+    int y = *(const int *)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ *  Rows start...stop as their own matrix, with only the columns those
+ *  rows use. The halo is the sorted list of those columns and column k
+ *  of the block is column +halo[k]+ of the matrix, so the lag of the
+ *  rows only needs the values of the halo.
+ *
+ *  If the matrix is mapped from a file, the pages of the rows are
+ *  released from the mapping once they are copied, so streaming a
+ *  matrix larger than memory block by block keeps about one block
+ *  resident.
+ *
+ *  @example
+ *      csr = CSRMatrix.from_coo([0, 1, 2], [2, 0, 1], [1, 2, 3], 3)
+ *      block, halo = csr.row_block(1, 3)
+ *      halo
+ *      # => [0, 1]
+ *      block.mulvec(x.values_at(*halo))
+ *      # => csr.mulvec(x)[1...3]
+ *
+ *  @param [Integer] start first row.
+ *  @param [Integer] stop row after the last.
+ *
+ *  @return [Array] of the block, a CSRMatrix of shape [stop - start, halo.size], and the halo.
+ */
+VALUE csr_matrix_row_block(VALUE self, VALUE start_v, VALUE stop_v)
+{
+    csr_matrix *csr;
+    VALUE halo_v;
+    VALUE halo;
+    VALUE block;
+    csr_matrix *rows;
+    int *halo_cols;
+    int64_t nnz;
+    int64_t offset;
+    int start = NUM2INT(start_v);
+    int stop = NUM2INT(stop_v);
+    int m;
+    int i;
+    int64_t jj;
+
+    TypedData_Get_Struct(self, csr_matrix, &csr_matrix_type, csr);
+    if (start < 0 || stop > csr->n || start > stop)
+    {
+        rb_raise(rb_eArgError, "Index Error rows must be in 0..n");
+    }
+
+    offset = csr->row_index[start];
+    nnz = csr->row_index[stop] - offset;
+
+    // sort a copy of the columns and drop repeats to get the halo
+    halo_cols = ALLOCV_N(int, halo_v, nnz > 0 ? nnz : 1);
+    memcpy(halo_cols, csr->col_index + offset, sizeof(int) * nnz);
+    qsort(halo_cols, (size_t)nnz, sizeof(int), csr_int_cmp);
+    m = 0;
+    for (jj = 0; jj < nnz; jj++)
+    {
+        if (m == 0 || halo_cols[m - 1] != halo_cols[jj])
+        {
+            halo_cols[m++] = halo_cols[jj];
+        }
+    }
+
+    // whole rows are copied, so standardized binary rows stay standardized
+    block = csr_matrix_new(rb_obj_class(self), stop - start, m, nnz, csr->values_type);
+    TypedData_Get_Struct(block, csr_matrix, &csr_matrix_type, rows);
+    if (csr->values_type == CSR_VALUES_FLOAT64)
+    {
+        memcpy(rows->values, csr->values + offset, sizeof(double) * nnz);
+    }
+    else if (csr->values_type == CSR_VALUES_FLOAT32)
+    {
+        memcpy(rows->values32, csr->values32 + offset, sizeof(float) * nnz);
+    }
+
+    for (i = start; i <= stop; i++)
+    {
+        rows->row_index[i - start] = csr->row_index[i] - offset;
+    }
+    for (jj = 0; jj < nnz; jj++)
+    {
+        rows->col_index[jj] = (int)((int *)bsearch(csr->col_index + offset + jj, halo_cols, m,
+                                             sizeof(int), csr_int_cmp) -
+                              halo_cols);
+    }
+    if (csr->map)
+    {
+        csr_file_release(csr, start, stop);
+    }
+
+    halo = rb_ary_new_capa(m);
+    for (i = 0; i < m; i++)
+    {
+        rb_ary_push(halo, INT2NUM(halo_cols[i]));
+    }
+    ALLOCV_END(halo_v);
+
+    return rb_assoc_new(block, halo);
+}
+
+/**
+ *  Fill values, col_index and row_index with the transpose of csr.
+ *  values and col_index hold nnz entries and row_index n + 1. Entries
+ *  are placed with a counting sort over the columns, so every row of
+ *  the transpose is sorted by column. values may be NULL to transpose
+ *  only the pattern.
+ */
+void csr_matrix_transpose_arrays(const csr_matrix *csr, double *values,
+                                 int *col_index, int64_t *row_index)
+{
+    int i;
+    int64_t jj;
+    int64_t dest;
+
+    memset(row_index, 0, sizeof(int64_t) * (csr->n + 1));
+    for (jj = 0; jj < csr->nnz; jj++)
+    {
+        row_index[csr->col_index[jj] + 1]++;
+    }
+    for (i = 0; i < csr->n; i++)
+    {
+        row_index[i + 1] += row_index[i];
+    }
+
+    // row_index[j] is used as the next free slot of row j while
+    // filling, which leaves it at the start of row j + 1.
+    for (i = 0; i < csr->n; i++)
+    {
+        for (jj = csr->row_index[i]; jj < csr->row_index[i + 1]; jj++)
+        {
+            dest = row_index[csr->col_index[jj]]++;
+            if (values)
+            {
+                values[dest] = csr_matrix_value(csr, i, jj);
+            }
+            col_index[dest] = i;
+        }
+    }
+    for (i = csr->n; i > 0; i--)
+    {
+        row_index[i] = row_index[i - 1];
+    }
+    row_index[0] = 0;
+}
+
+/**
+ *  Sums of the weights used in the variance of Moran's I, computed in
+ *  one pass over the matrix and its transpose.
+ *
+ *  s0 = sum(w_ij)
+ *  s1 = 1/2 * sum((w_ij + w_ji)**2)
+ *  s2 = sum((sum_j(w_ij) + sum_j(w_ji))**2)
+ *
+ *  The matrix does not need to be symmetric and entries repeated at the
+ *  same coordinate are summed.
+ *
+ *  @see https://en.wikipedia.org/wiki/Moran%27s_I#Expected_value
+ *
+ *  @example
+ *      csr = CSRMatrix.from_coo([0, 0, 1, 2], [1, 2, 2, 0], [1, 2, 3, 4], 3)
+ *      csr.moran_moments
+ *      # => {s0: 10.0, s1: 46.0, s2: 146.0}
+ *
+ *  @return [Hash] with Float values at +:s0+, +:s1+ and +:s2+.
+ */
+VALUE csr_matrix_moran_moments(VALUE self)
+{
+    csr_matrix *csr;
+    VALUE result;
+    VALUE t_values_v = 0;
+    VALUE t_col_index_v = 0;
+    VALUE t_row_index_v = 0;
+    VALUE sums_v = 0;
+    VALUE mark_v = 0;
+    double *t_values;
+    int *t_col_index;
+    int64_t *t_row_index;
+    double *sums;
+    int *mark;
+    long nnz_alloc;
+
+    int i;
+    int j;
+    int64_t jj;
+    double w;
+    double s0 = 0;
+    double squares = 0;
+    double cross = 0;
+    double s2 = 0;
+    double row_sum;
+    double col_sum;
+
+    TypedData_Get_Struct(self, csr_matrix, &csr_matrix_type, csr);
+    csr_matrix_check_square(csr);
+
+    nnz_alloc = csr->nnz > 0 ? csr->nnz : 1;
+    t_values = (double *)rb_alloc_tmp_buffer(&t_values_v, nnz_alloc * (long)sizeof(double));
+    t_col_index = (int *)rb_alloc_tmp_buffer(&t_col_index_v, nnz_alloc * (long)sizeof(int));
+    t_row_index = (int64_t *)rb_alloc_tmp_buffer(&t_row_index_v, (csr->n + 1) * (long)sizeof(int64_t));
+    sums = (double *)rb_alloc_tmp_buffer(&sums_v, (csr->n > 0 ? csr->n : 1) * (long)sizeof(double));
+    mark = (int *)rb_alloc_tmp_buffer(&mark_v, (csr->n > 0 ? csr->n : 1) * (long)sizeof(int));
+
+    csr_matrix_transpose_arrays(csr, t_values, t_col_index, t_row_index);
+    for (i = 0; i < csr->n; i++)
+    {
+        mark[i] = -1;
+    }
+
+    for (i = 0; i < csr->n; i++)
+    {
+        // sums[j] holds w_ij for the columns of row i marked with i
+        row_sum = 0;
+        for (jj = csr->row_index[i]; jj < csr->row_index[i + 1]; jj++)
+        {
+            j = csr->col_index[jj];
+            if (mark[j] != i)
+            {
+                mark[j] = i;
+                sums[j] = 0;
+            }
+            w = csr_matrix_value(csr, i, jj);
+            sums[j] += w;
+            row_sum += w;
+        }
+
+        // row i of the transpose holds w_ji
+        col_sum = 0;
+        for (jj = t_row_index[i]; jj < t_row_index[i + 1]; jj++)
+        {
+            j = t_col_index[jj];
+            if (mark[j] == i)
+            {
+                cross += sums[j] * t_values[jj];
+            }
+            col_sum += t_values[jj];
+        }
+
+        for (jj = csr->row_index[i]; jj < csr->row_index[i + 1]; jj++)
+        {
+            j = csr->col_index[jj];
+            if (mark[j] == i)
+            {
+                squares += sums[j] * sums[j];
+                mark[j] = -1;
+            }
+        }
+
+        s0 += row_sum;
+        s2 += (row_sum + col_sum) * (row_sum + col_sum);
+    }
+
+    rb_free_tmp_buffer(&t_values_v);
+    rb_free_tmp_buffer(&t_col_index_v);
+    rb_free_tmp_buffer(&t_row_index_v);
+    rb_free_tmp_buffer(&sums_v);
+    rb_free_tmp_buffer(&mark_v);
+
+    // s1 = 1/2 * sum(w_ij**2 + 2 * w_ij * w_ji + w_ji**2)
+    //    = sum(w_ij**2) + sum(w_ij * w_ji)
+    result = rb_hash_new();
+    rb_hash_aset(result, ID2SYM(rb_intern("s0")), DBL2NUM(s0));
+    rb_hash_aset(result, ID2SYM(rb_intern("s1")), DBL2NUM(squares + cross));
+    rb_hash_aset(result, ID2SYM(rb_intern("s2")), DBL2NUM(s2));
+    return result;
+}
+
+/**
+ *  Transpose of the matrix, built with a counting sort over the columns
+ *  in O(nnz + n). Rows of the result are sorted by column. This is the
+ *  compressed sparse column form of the receiver, so +transpose.row_index+
+ *  and +transpose.col_index+ give column access to the original matrix.
+ *  Binary weights stay binary, other values are transposed as doubles.
+ *
+ *  @example
+ *      csr = CSRMatrix.from_coo([0, 0, 1], [1, 2, 2], [1, 2, 3], 3)
+ *      csr.transpose.coordinates
+ *      # => {[1, 0] => 1.0, [2, 0] => 2.0, [2, 1] => 3.0}
+ *
+ *  @return [CSRMatrix]
+ */
+VALUE csr_matrix_transpose(VALUE self)
+{
+    csr_matrix *csr;
+    csr_matrix *transposed;
+    VALUE result;
+
+    TypedData_Get_Struct(self, csr_matrix, &csr_matrix_type, csr);
+    csr_matrix_check_square(csr);
+
+    result = csr_matrix_new(rb_obj_class(self), csr->n, csr->n, csr->nnz,
+                            csr->values_type == CSR_VALUES_BINARY ? CSR_VALUES_BINARY : CSR_VALUES_FLOAT64);
+    TypedData_Get_Struct(result, csr_matrix, &csr_matrix_type, transposed);
+    csr_matrix_transpose_arrays(csr, transposed->values, transposed->col_index,
+                                transposed->row_index);
+
+    return result;
+}
+
+typedef enum csr_merge_mode
+{
+    CSR_MERGE_CHECK,
+    CSR_MERGE_UNION,
+    CSR_MERGE_INTERSECTION
+} csr_merge_mode;
+
+// Sum the run of entries starting at *jj in a row sorted by column
+// that are in column col, moving *jj past them. Returns 1 if there
+// was at least one.
+static int csr_merge_run(const int *col_index, const double *values, int64_t *jj,
+                         int64_t stop, int col, double *sum)
+{
+    int found = 0;
+
+    *sum = 0;
+    while (*jj < stop && col_index[*jj] == col)
+    {
+        *sum += values[*jj];
+        (*jj)++;
+        found = 1;
+    }
+    return found;
+}
+
+/**
+ *  Walk the matrix and its transpose row by row, merging each pair of
+ *  rows by column. Entries repeated at the same coordinate are summed.
+ *
+ *  With CSR_MERGE_CHECK nothing is written and 1 is returned if w_ij ==
+ *  w_ji everywhere, 0 otherwise. Otherwise values, col_index and
+ *  row_index (2 * nnz, 2 * nnz and n + 1 long) are filled with the union
+ *  or intersection of the two patterns and the nnz of the result is
+ *  returned.
+ */
+static int64_t csr_matrix_merge_transpose(const csr_matrix *csr, csr_merge_mode mode,
+                                          double *values, int *col_index, int64_t *row_index)
+{
+    csr_matrix t;
+    csr_matrix sorted;
+    VALUE t_values_v = 0;
+    VALUE t_col_index_v = 0;
+    VALUE t_row_index_v = 0;
+    VALUE s_values_v = 0;
+    VALUE s_col_index_v = 0;
+    VALUE s_row_index_v = 0;
+    long nnz_alloc = csr->nnz > 0 ? csr->nnz : 1;
+
+    int i;
+    int64_t p;
+    int64_t q;
+    int col;
+    int has_ij;
+    int has_ji;
+    double w_ij;
+    double w_ji;
+    int64_t nz_idx = 0;
+    int result = 1;
+
+    t.n = csr->n;
+    t.m = csr->n;
+    t.nnz = csr->nnz;
+    t.values_type = CSR_VALUES_FLOAT64;
+    t.values32 = NULL;
+    t.values = (double *)rb_alloc_tmp_buffer(&t_values_v, nnz_alloc * (long)sizeof(double));
+    t.col_index = (int *)rb_alloc_tmp_buffer(&t_col_index_v, nnz_alloc * (long)sizeof(int));
+    t.row_index = (int64_t *)rb_alloc_tmp_buffer(&t_row_index_v, (csr->n + 1) * (long)sizeof(int64_t));
+    sorted = t;
+    sorted.values = (double *)rb_alloc_tmp_buffer(&s_values_v, nnz_alloc * (long)sizeof(double));
+    sorted.col_index = (int *)rb_alloc_tmp_buffer(&s_col_index_v, nnz_alloc * (long)sizeof(int));
+    sorted.row_index = (int64_t *)rb_alloc_tmp_buffer(&s_row_index_v, (csr->n + 1) * (long)sizeof(int64_t));
+
+    // transposing twice sorts the rows of the receiver by column
+    csr_matrix_transpose_arrays(csr, t.values, t.col_index, t.row_index);
+    csr_matrix_transpose_arrays(&t, sorted.values, sorted.col_index, sorted.row_index);
+
+    if (mode != CSR_MERGE_CHECK)
+    {
+        row_index[0] = 0;
+    }
+    for (i = 0; i < csr->n && result; i++)
+    {
+        p = sorted.row_index[i];
+        q = t.row_index[i];
+        while (p < sorted.row_index[i + 1] || q < t.row_index[i + 1])
+        {
+            if (q >= t.row_index[i + 1] ||
+                (p < sorted.row_index[i + 1] && sorted.col_index[p] < t.col_index[q]))
+            {
+                col = sorted.col_index[p];
+            }
+            else
+            {
+                col = t.col_index[q];
+            }
+            has_ij = csr_merge_run(sorted.col_index, sorted.values, &p,
+                                   sorted.row_index[i + 1], col, &w_ij);
+            has_ji = csr_merge_run(t.col_index, t.values, &q,
+                                   t.row_index[i + 1], col, &w_ji);
+
+            if (mode == CSR_MERGE_CHECK)
+            {
+                if (w_ij != w_ji)
+                {
+                    result = 0;
+                    break;
+                }
+            }
+            else if (mode == CSR_MERGE_UNION || (has_ij && has_ji))
+            {
+                if (has_ij && has_ji)
+                {
+                    values[nz_idx] = mode == CSR_MERGE_UNION ? fmax(w_ij, w_ji) : fmin(w_ij, w_ji);
+                }
+                else
+                {
+                    values[nz_idx] = has_ij ? w_ij : w_ji;
+                }
+                col_index[nz_idx] = col;
+                nz_idx++;
+            }
+        }
+        if (mode != CSR_MERGE_CHECK)
+        {
+            row_index[i + 1] = nz_idx;
+        }
+    }
+
+    rb_free_tmp_buffer(&t_values_v);
+    rb_free_tmp_buffer(&t_col_index_v);
+    rb_free_tmp_buffer(&t_row_index_v);
+    rb_free_tmp_buffer(&s_values_v);
+    rb_free_tmp_buffer(&s_col_index_v);
+    rb_free_tmp_buffer(&s_row_index_v);
+
+    return mode == CSR_MERGE_CHECK ? result : nz_idx;
+}
+
+/**
+ *  Whether w_ij == w_ji for every i and j. Runs in O(nnz + n) and does
+ *  not require the rows to be sorted.
+ *
+ *  @return [Boolean]
+ */
+VALUE csr_matrix_symmetric(VALUE self)
+{
+    csr_matrix *csr;
+
+    TypedData_Get_Struct(self, csr_matrix, &csr_matrix_type, csr);
+    csr_matrix_check_square(csr);
+
+    return csr_matrix_merge_transpose(csr, CSR_MERGE_CHECK, NULL, NULL, NULL) ? Qtrue : Qfalse;
+}
+
+/**
+ *  Symmetric copy of the matrix. With +:union+ (the default) there is
+ *  an entry wherever w_ij or w_ji is, with value max(w_ij, w_ji) if both
+ *  are. With +:intersection+ there is an entry only where both w_ij and
+ *  w_ji are, with value min(w_ij, w_ji).
+ *
+ *  For binary knn weights these are the "either is a neighbor" and the
+ *  mutual neighbors weights. Rows of the result are sorted by column.
+ *
+ *  @example
+ *      csr = CSRMatrix.from_coo([0, 1, 2], [1, 2, 1], 1, 3)
+ *      csr.symmetrize.coordinates.keys
+ *      # => [[0, 1], [1, 0], [1, 2], [2, 1]]
+ *      csr.symmetrize(:intersection).coordinates.keys
+ *      # => [[1, 2], [2, 1]]
+ *
+ *  @param [Symbol] mode +:union+ or +:intersection+.
+ *
+ *  @return [CSRMatrix]
+ */
+VALUE csr_matrix_symmetrize(int argc, VALUE *argv, VALUE self)
+{
+    VALUE mode_sym;
+    csr_matrix *csr;
+    csr_merge_mode mode = CSR_MERGE_UNION;
+    double *values;
+    int *col_index;
+    int64_t *row_index;
+    long nnz_alloc;
+    int64_t nnz;
+    int64_t jj;
+    int binary;
+
+    rb_scan_args(argc, argv, "01", &mode_sym);
+    if (!NIL_P(mode_sym))
+    {
+        if (mode_sym == ID2SYM(rb_intern("intersection")))
+        {
+            mode = CSR_MERGE_INTERSECTION;
+        }
+        else if (mode_sym != ID2SYM(rb_intern("union")))
+        {
+            rb_raise(rb_eArgError, "mode must be :union or :intersection");
+        }
+    }
+
+    TypedData_Get_Struct(self, csr_matrix, &csr_matrix_type, csr);
+    csr_matrix_check_square(csr);
+
+    nnz_alloc = csr->nnz > 0 ? 2 * csr->nnz : 1;
+    values = malloc(sizeof(double) * nnz_alloc);
+    col_index = malloc(sizeof(int) * nnz_alloc);
+    row_index = malloc(sizeof(int64_t) * (csr->n + 1));
+
+    nnz = csr_matrix_merge_transpose(csr, mode, values, col_index, row_index);
+    if (nnz > 0)
+    {
+        values = realloc(values, sizeof(double) * nnz);
+        col_index = realloc(col_index, sizeof(int) * nnz);
+    }
+
+    // binary weights stay binary unless repeated entries were summed
+    binary = csr->values_type == CSR_VALUES_BINARY;
+    for (jj = 0; jj < nnz && binary; jj++)
+    {
+        binary = values[jj] == 1;
+    }
+    if (binary)
+    {
+        free(values);
+        values = NULL;
+    }
+
+    return csr_matrix_wrap(rb_obj_class(self), csr->n, csr->n, nnz, values,
+                           col_index, row_index);
+}
+
+/**
+ *  A new CSRMatrix with the entries of some observations replaced. Every
+ *  entry in a row or column of +rows+ is dropped, then the entries given
+ *  in coordinate format are added. Other entries are copied as they are,
+ *  so changing a few observations costs one pass over the matrix instead
+ *  of rebuilding it.
+ *
+ *  Every new entry must be in a row or column of +rows+. New entries are
+ *  merged into each row by column, so if the rows of the matrix and the
+ *  new entries of each row are sorted by column, so are the rows of the
+ *  result.
+ *
+ *  Splicing entries of 1 into binary weights keeps them binary. Row
+ *  standardized binary weights stay standardized, so every row holds
+ *  1 / its new number of entries, and only accept entries of 1. Float32
+ *  matrices stay float32, with the new entries rounded to float.
+ *
+ *  @example
+ *      csr = CSRMatrix.from_coo([0, 1, 1, 2], [1, 0, 2, 1], 1, 3)
+ *      csr.splice([2], [0, 2], [2, 0], 1).coordinates.keys
+ *      # => [[0, 1], [0, 2], [1, 0], [2, 0]]
+ *
+ *  @param [Array, String, Numo::Int32] rows observations to replace, in 0...n.
+ *  @param [Array, String, Numo::Int32] i_idx row of each new entry, in 0...n.
+ *  @param [Array, String, Numo::Int32] j_idx column of each new entry, in 0...n.
+ *  @param [Array, Numo::DFloat, Numeric] weights value of each new entry, or one value for every entry.
+ *
+ *  @return [CSRMatrix]
+ */
+VALUE csr_matrix_splice(VALUE self, VALUE rows_v, VALUE i_idx, VALUE j_idx, VALUE weights)
+{
+    csr_matrix *csr;
+    ivec rows;
+    ivec ent_rows;
+    ivec ent_cols;
+    dvec vals;
+    double weight = 0;
+    int scalar = RB_FLOAT_TYPE_P(weights) || RB_INTEGER_TYPE_P(weights);
+
+    char *mark;
+    int64_t *ent_start;
+    long *order;
+    VALUE mark_v, ent_start_v, order_v;
+    VALUE result;
+    double *values;
+    float *values32;
+    int *col_index;
+    int64_t *row_index;
+    int binary;
+    int float32;
+
+    int n;
+    long count;
+    int64_t nnz;
+    int i;
+    long k;
+    int64_t jj;
+    int64_t kk;
+    int64_t nz_idx;
+
+    TypedData_Get_Struct(self, csr_matrix, &csr_matrix_type, csr);
+    csr_matrix_check_square(csr);
+    n = csr->n;
+    float32 = csr->values_type == CSR_VALUES_FLOAT32;
+
+    ivec_read(&rows, rows_v);
+    ivec_read(&ent_rows, i_idx);
+    ivec_read(&ent_cols, j_idx);
+    if (ent_rows.len != ent_cols.len)
+    {
+        rb_raise(rb_eArgError, "Dimension Mismatch i_idx.size != j_idx.size");
+    }
+    count = ent_rows.len;
+
+    if (scalar)
+    {
+        weight = NUM2DBL(weights);
+    }
+    // unit entries keep binary weights binary, so the values of standardized
+    // ones follow from the new row lengths
+    binary = (csr->values_type == CSR_VALUES_BINARY ||
+              csr->values_type == CSR_VALUES_BINARY_STANDARDIZED) &&
+             scalar && weight == 1;
+    if (csr->values_type == CSR_VALUES_BINARY_STANDARDIZED && !binary)
+    {
+        rb_raise(rb_eArgError, "standardized binary weights can only be spliced with weights of 1");
+    }
+    if (!scalar)
+    {
+        dvec_read(&vals, weights, count);
+    }
+
+    mark = ALLOCV_N(char, mark_v, n > 0 ? n : 1);
+    memset(mark, 0, n);
+    for (k = 0; k < rows.len; k++)
+    {
+        if (rows.ptr[k] < 0 || rows.ptr[k] >= n)
+        {
+            rb_raise(rb_eArgError, "Index Error rows must be in 0...n");
+        }
+        mark[rows.ptr[k]] = 1;
+    }
+
+    // validate before allocating so nothing leaks on raise
+    for (k = 0; k < count; k++)
+    {
+        if (ent_rows.ptr[k] < 0 || ent_rows.ptr[k] >= n || ent_cols.ptr[k] < 0 || ent_cols.ptr[k] >= n)
+        {
+            rb_raise(rb_eArgError, "Index Error i_idx and j_idx must be in 0...n");
+        }
+        if (!mark[ent_rows.ptr[k]] && !mark[ent_cols.ptr[k]])
+        {
+            rb_raise(rb_eArgError, "Index Error i_idx or j_idx must be in rows");
+        }
+    }
+
+    // bucket the new entries by row with a stable counting sort
+    ent_start = ALLOCV_N(int64_t, ent_start_v, n + 1);
+    memset(ent_start, 0, sizeof(int64_t) * (n + 1));
+    for (k = 0; k < count; k++)
+    {
+        ent_start[ent_rows.ptr[k] + 1]++;
+    }
+    for (i = 0; i < n; i++)
+    {
+        ent_start[i + 1] += ent_start[i];
+    }
+    order = ALLOCV_N(long, order_v, count > 0 ? count : 1);
+    row_index = calloc(n + 1, sizeof(int64_t));
+    for (k = 0; k < count; k++)
+    {
+        order[ent_start[ent_rows.ptr[k]] + row_index[ent_rows.ptr[k]]++] = k;
+    }
+
+    // size each row as the entries kept from it plus the new ones
+    nnz = 0;
+    row_index[0] = 0;
+    for (i = 0; i < n; i++)
+    {
+        if (!mark[i])
+        {
+            for (jj = csr->row_index[i]; jj < csr->row_index[i + 1]; jj++)
+            {
+                nnz += !mark[csr->col_index[jj]];
+            }
+        }
+        nnz += ent_start[i + 1] - ent_start[i];
+        row_index[i + 1] = nnz;
+    }
+
+    values = binary || float32 ? NULL : malloc(sizeof(double) * (nnz > 0 ? nnz : 1));
+    values32 = float32 ? malloc(sizeof(float) * (nnz > 0 ? nnz : 1)) : NULL;
+    col_index = malloc(sizeof(int) * (nnz > 0 ? nnz : 1));
+
+    for (i = 0; i < n; i++)
+    {
+        nz_idx = row_index[i];
+        jj = mark[i] ? csr->row_index[i + 1] : csr->row_index[i];
+        kk = ent_start[i];
+        while (jj < csr->row_index[i + 1] || kk < ent_start[i + 1])
+        {
+            if (jj < csr->row_index[i + 1] && mark[csr->col_index[jj]])
+            {
+                jj++;
+            }
+            else if (kk >= ent_start[i + 1] ||
+                     (jj < csr->row_index[i + 1] && csr->col_index[jj] <= ent_cols.ptr[order[kk]]))
+            {
+                if (values)
+                {
+                    values[nz_idx] = csr_matrix_value(csr, i, jj);
+                }
+                else if (values32)
+                {
+                    values32[nz_idx] = csr->values32[jj];
+                }
+                col_index[nz_idx++] = csr->col_index[jj++];
+            }
+            else
+            {
+                if (values)
+                {
+                    values[nz_idx] = scalar ? weight : vals.ptr[order[kk]];
+                }
+                else if (values32)
+                {
+                    values32[nz_idx] = (float)(scalar ? weight : vals.ptr[order[kk]]);
+                }
+                col_index[nz_idx++] = ent_cols.ptr[order[kk++]];
+            }
+        }
+    }
+
+    ALLOCV_END(mark_v);
+    ALLOCV_END(ent_start_v);
+    ALLOCV_END(order_v);
+    ivec_release(&rows);
+    ivec_release(&ent_rows);
+    ivec_release(&ent_cols);
+    if (!scalar)
+    {
+        dvec_release(&vals);
+    }
+
+    result = csr_matrix_wrap(rb_obj_class(self), n, n, nnz, values,
+                             col_index, row_index);
+    if (binary && csr->values_type == CSR_VALUES_BINARY_STANDARDIZED)
+    {
+        csr_matrix_set_values_type(result, CSR_VALUES_BINARY_STANDARDIZED, NULL);
+    }
+    else if (float32)
+    {
+        csr_matrix_set_values_type(result, CSR_VALUES_FLOAT32, values32);
+    }
+    return result;
+}
+
+/**
+ *  How the values of the matrix are stored. Binary weights store no
+ *  values, every entry is 1, or 1 / the entries in its row once they
+ *  are row standardized.
+ *
+ *  @example
+ *      CSRMatrix.from_coo([0, 1], [1, 0], 1, 2).values_type
+ *      # => :binary
+ *
+ *  @return [Symbol] :float64, :float32, :binary or :binary_standardized.
+ */
+VALUE csr_matrix_values_type(VALUE self)
+{
+    csr_matrix *csr;
+
+    TypedData_Get_Struct(self, csr_matrix, &csr_matrix_type, csr);
+    switch (csr->values_type)
+    {
+    case CSR_VALUES_FLOAT32:
+        return ID2SYM(rb_intern("float32"));
+    case CSR_VALUES_BINARY:
+        return ID2SYM(rb_intern("binary"));
+    case CSR_VALUES_BINARY_STANDARDIZED:
+        return ID2SYM(rb_intern("binary_standardized"));
+    default:
+        return ID2SYM(rb_intern("float64"));
+    }
+}
+
+/**
+ *  Copy of the matrix with its values stored as type. float32 halves
+ *  the memory of the values and products still accumulate in double,
+ *  binary drops them and requires every value to be 1. The receiver is
+ *  not modified.
+ *
+ *  @example
+ *      csr.astype(:float32).mulvec(vec)
+ *
+ *  @param [Symbol] type :float64, :float32 or :binary.
+ *
+ *  @return [CSRMatrix]
+ */
+VALUE csr_matrix_astype(VALUE self, VALUE type_v)
+{
+    csr_matrix *csr;
+    csr_matrix *converted;
+    VALUE result;
+    csr_values_type type;
+    ID type_id;
+    double *values;
+    float *values32;
+
+    int i;
+    int64_t jj;
+
+    TypedData_Get_Struct(self, csr_matrix, &csr_matrix_type, csr);
+
+    type_id = SYMBOL_P(type_v) ? SYM2ID(type_v) : 0;
+    if (type_id == rb_intern("float64"))
+    {
+        type = CSR_VALUES_FLOAT64;
+    }
+    else if (type_id == rb_intern("float32"))
+    {
+        type = CSR_VALUES_FLOAT32;
+    }
+    else if (type_id == rb_intern("binary"))
+    {
+        type = CSR_VALUES_BINARY;
+    }
+    else
+    {
+        rb_raise(rb_eArgError, "type must be :float64, :float32 or :binary");
+    }
+
+    // validate before allocating so nothing leaks on raise
+    if (type == CSR_VALUES_BINARY)
+    {
+        for (i = 0; i < csr->n; i++)
+        {
+            for (jj = csr->row_index[i]; jj < csr->row_index[i + 1]; jj++)
+            {
+                if (csr_matrix_value(csr, i, jj) != 1)
+                {
+                    rb_raise(rb_eArgError, "binary values must all be 1");
+                }
+            }
+        }
+    }
+
+    result = csr_matrix_new(rb_obj_class(self), csr->n, csr->m, csr->nnz, type);
+    TypedData_Get_Struct(result, csr_matrix, &csr_matrix_type, converted);
+    values = converted->values;
+    values32 = converted->values32;
+
+    memcpy(converted->col_index, csr->col_index, sizeof(int) * csr->nnz);
+    memcpy(converted->row_index, csr->row_index, sizeof(int64_t) * (csr->n + 1));
+
+    for (i = 0; i < csr->n && (values || values32); i++)
+    {
+        for (jj = csr->row_index[i]; jj < csr->row_index[i + 1]; jj++)
+        {
+            if (values)
+            {
+                values[jj] = csr_matrix_value(csr, i, jj);
+            }
+            else
+            {
+                values32[jj] = (float)csr_matrix_value(csr, i, jj);
+            }
+        }
+    }
+
+    return result;
+}
+
+/**
+ *  Memory used by the arrays of the matrix, in bytes. +heap+ is what
+ *  the matrix owns on the malloc heap, which +ObjectSpace.memsize_of+
+ *  and the GC count, and +mapped+ is the size of the file it is
+ *  memory mapped from, if any. +allocations+ is the number of malloc'd
+ *  blocks, 1 when the arrays share an arena.
+ *
+ *  @example
+ *      CSRMatrix.from_coo([0, 1], [1, 0], [0.5, 2], 2).memory_stats
+ *      # => {values: 16, col_index: 8, row_index: 24, heap: 48, mapped: 0, allocations: 1}
+ *
+ *  @return [Hash]
+ */
+VALUE csr_matrix_memory_stats(VALUE self)
+{
+    csr_matrix *csr;
+    VALUE result;
+    long values_size = 0;
+    int allocations;
+    const char *row_index;
+
+    TypedData_Get_Struct(self, csr_matrix, &csr_matrix_type, csr);
+
+    if (csr->values_type == CSR_VALUES_FLOAT64)
+    {
+        values_size = (long)sizeof(double) * csr->nnz;
+    }
+    else if (csr->values_type == CSR_VALUES_FLOAT32)
+    {
+        values_size = (long)sizeof(float) * csr->nnz;
+    }
+
+    if (csr->arena)
+    {
+        allocations = 1;
+    }
+    else if (csr->map)
+    {
+        row_index = (const char *)csr->row_index;
+        allocations = row_index < (const char *)csr->map ||
+                      row_index >= (const char *)csr->map + csr->map_size;
+    }
+    else
+    {
+        allocations = (csr->values != NULL) + (csr->values32 != NULL) + 2;
+    }
+
+    result = rb_hash_new();
+    rb_hash_aset(result, ID2SYM(rb_intern("values")), LONG2NUM(values_size));
+    rb_hash_aset(result, ID2SYM(rb_intern("col_index")), LONG2NUM((long)sizeof(int) * csr->nnz));
+    rb_hash_aset(result, ID2SYM(rb_intern("row_index")), LONG2NUM((long)sizeof(int64_t) * (csr->n + 1)));
+    rb_hash_aset(result, ID2SYM(rb_intern("heap")), SIZET2NUM(csr_matrix_heap_size(csr)));
+    rb_hash_aset(result, ID2SYM(rb_intern("mapped")), SIZET2NUM(csr->map_size));
+    rb_hash_aset(result, ID2SYM(rb_intern("allocations")), INT2NUM(allocations));
+    return result;
+}
@@ -1,28 +1,111 @@
 #ifndef CSR_MATRIX
 #define CSR_MATRIX
 
+#include <stdint.h>
+
+// How the values of a matrix are stored. Binary weights keep no
+// values, every entry is 1, or 1 / the entries in its row once they
+// are row standardized.
+typedef enum csr_values_type
+{
+    CSR_VALUES_FLOAT64,
+    CSR_VALUES_FLOAT32,
+    CSR_VALUES_BINARY,
+    CSR_VALUES_BINARY_STANDARDIZED
+} csr_values_type;
+
+// Rows and columns are int, but offsets into values and col_index are
+// 64 bit, so a matrix can hold more than INT_MAX non-zeros.
 typedef struct csr_matrix
 {
     char init;
     int n;
-    int nnz;
+    // columns, n except for a block of rows from CSRMatrix#row_block
+    int m;
+    int64_t nnz;
+    csr_values_type values_type;
+    // values for CSR_VALUES_FLOAT64, values32 for CSR_VALUES_FLOAT32,
+    // the other is NULL
     double *values;
+    float *values32;
     int *col_index;
-    int *row_index;
+    int64_t *row_index;
+
+    // entries in every row, 0 if rows differ and -1 until
+    // csr_matrix_row_length computes it
+    int64_t row_length;
+
+    // set when the arrays point into a read only memory mapped file
+    // written by CSRMatrix#dump, instead of being malloc'd.
+    void *map;
+    size_t map_size;
+
+    // set when the arrays are slices of one malloc'd block from
+    // csr_matrix_new, which is freed instead of each array
+    void *arena;
+    size_t arena_size;
+
+    // bytes reported to the GC with rb_gc_adjust_memory_usage
+    size_t gc_size;
 } csr_matrix;
 
+// value of entry jj, which is in row i
+static inline double csr_matrix_value(const csr_matrix *csr, int i, int64_t jj)
+{
+    switch (csr->values_type)
+    {
+    case CSR_VALUES_FLOAT64:
+        return csr->values[jj];
+    case CSR_VALUES_FLOAT32:
+        return csr->values32[jj];
+    case CSR_VALUES_BINARY:
+        return 1;
+    default:
+        return 1.0 / (double)(csr->row_index[i + 1] - csr->row_index[i]);
+    }
+}
+
 void csr_matrix_free(void *mat);
 size_t csr_matrix_memsize(const void *ptr);
+size_t csr_matrix_heap_size(const csr_matrix *csr);
+void csr_matrix_account(csr_matrix *csr);
 
 extern const rb_data_type_t csr_matrix_type;
 
 void mat_to_sparse(csr_matrix *csr, VALUE data, VALUE keys, VALUE num_rows);
 VALUE csr_matrix_alloc(VALUE self);
+void csr_matrix_check_square(const csr_matrix *csr);
+const double *csr_matrix_float64_values(const csr_matrix *csr, VALUE *buf);
+void csr_matrix_set_values_type(VALUE self, csr_values_type type, float *values32);
+VALUE csr_matrix_wrap(VALUE klass, int n, int m, int64_t nnz, double *values,
+                      int *col_index, int64_t *row_index);
+VALUE csr_matrix_new(VALUE klass, int n, int m, int64_t nnz, csr_values_type values_type);
 VALUE csr_matrix_initialize(VALUE self, VALUE data, VALUE num_rows);
+VALUE csr_matrix_from_coo(VALUE klass, VALUE i_idx, VALUE j_idx, VALUE weights, VALUE num_rows);
 VALUE csr_matrix_values(VALUE self);
 VALUE csr_matrix_col_index(VALUE self);
 VALUE csr_matrix_row_index(VALUE self);
-VALUE csr_matrix_mulvec(VALUE self, VALUE vec);
+VALUE csr_matrix_mulvec(int argc, VALUE *argv, VALUE self);
 VALUE csr_matrix_dot_row(VALUE self, VALUE vec, VALUE row);
+VALUE csr_matrix_mulmat(int argc, VALUE *argv, VALUE self);
 VALUE csr_matrix_coordinates(VALUE self);
+VALUE csr_matrix_shape(VALUE self);
+VALUE csr_matrix_diagonal(VALUE self);
+VALUE csr_matrix_trace(VALUE self);
+VALUE csr_matrix_row_sums(VALUE self);
+VALUE csr_matrix_row_standardize(VALUE self);
+VALUE csr_matrix_inverse_distance(VALUE self, VALUE alpha_v);
+VALUE csr_matrix_kernel(VALUE self, VALUE kind_v, VALUE bandwidth_v);
+VALUE csr_matrix_window(int argc, VALUE *argv, VALUE self);
+VALUE csr_matrix_row_block(VALUE self, VALUE start_v, VALUE stop_v);
+void csr_matrix_transpose_arrays(const csr_matrix *csr, double *values,
+                                 int *col_index, int64_t *row_index);
+VALUE csr_matrix_moran_moments(VALUE self);
+VALUE csr_matrix_transpose(VALUE self);
+VALUE csr_matrix_symmetric(VALUE self);
+VALUE csr_matrix_symmetrize(int argc, VALUE *argv, VALUE self);
+VALUE csr_matrix_splice(VALUE self, VALUE rows_v, VALUE i_idx, VALUE j_idx, VALUE weights);
+VALUE csr_matrix_values_type(VALUE self);
+VALUE csr_matrix_astype(VALUE self, VALUE type_v);
+VALUE csr_matrix_memory_stats(VALUE self);
 #endif
\ No newline at end of file
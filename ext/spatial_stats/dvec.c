@@ -0,0 +1,399 @@
+#include <ruby.h>
+#include <stdint.h>
+#include <string.h>
+#include "dvec.h"
+
+static VALUE dvec_dfloat_class(void)
+{
+    return rb_path2class("Numo::DFloat");
+}
+
+static dvec_kind dvec_detect(VALUE obj)
+{
+    if (RB_TYPE_P(obj, T_ARRAY))
+    {
+        return DVEC_ARRAY;
+    }
+    else if (RB_TYPE_P(obj, T_STRING))
+    {
+        return DVEC_STRING;
+    }
+    else if (rb_respond_to(obj, rb_intern("to_binary")))
+    {
+        return DVEC_NARRAY;
+    }
+
+    rb_raise(rb_eTypeError,
+             "wrong argument type %s (expected Array, String or Numo::DFloat)",
+             rb_obj_classname(obj));
+}
+
+static int dvec_aligned(const void *ptr)
+{
+    return ((uintptr_t)ptr % sizeof(double)) == 0;
+}
+
+static double *dvec_tmp_buffer(VALUE *tmp, long len)
+{
+    return (double *)rb_alloc_tmp_buffer(tmp, (len > 0 ? len : 1) * (long)sizeof(double));
+}
+
+/**
+ *  Read obj as a vector of len doubles. Packed double strings are
+ *  used in place and Numo::DFloat is read through its binary buffer,
+ *  so neither boxes a value per element. Other Numo types are cast to
+ *  DFloat first.
+ *
+ *  Raises ArgumentError if obj does not have len elements.
+ */
+void dvec_read(dvec *vec, VALUE obj, long len)
+{
+    double *buf;
+    long i;
+
+    vec->kind = dvec_detect(obj);
+    vec->len = len;
+    vec->str = Qnil;
+    vec->tmp = 0;
+
+    if (vec->kind == DVEC_ARRAY)
+    {
+        if (RARRAY_LEN(obj) != len)
+        {
+            rb_raise(rb_eArgError, "Dimension Mismatch CSRMatrix.n != vec.size");
+        }
+
+        buf = dvec_tmp_buffer(&vec->tmp, len);
+        for (i = 0; i < len; i++)
+        {
+            buf[i] = NUM2DBL(rb_ary_entry(obj, i));
+        }
+        vec->ptr = buf;
+        return;
+    }
+
+    if (vec->kind == DVEC_NARRAY)
+    {
+        if (!rb_obj_is_kind_of(obj, dvec_dfloat_class()))
+        {
+            obj = rb_funcall(dvec_dfloat_class(), rb_intern("cast"), 1, obj);
+        }
+        obj = rb_funcall(obj, rb_intern("to_binary"), 0);
+        Check_Type(obj, T_STRING);
+    }
+
+    if (RSTRING_LEN(obj) != len * (long)sizeof(double))
+    {
+        rb_raise(rb_eArgError, "Dimension Mismatch CSRMatrix.n != vec.size");
+    }
+
+    vec->str = obj;
+    if (dvec_aligned(RSTRING_PTR(obj)))
+    {
+        vec->ptr = (const double *)RSTRING_PTR(obj);
+    }
+    else
+    {
+        buf = dvec_tmp_buffer(&vec->tmp, len);
+        memcpy(buf, RSTRING_PTR(obj), len * sizeof(double));
+        vec->ptr = buf;
+    }
+}
+
+/**
+ *  Read obj as a row major rows x cols matrix of doubles and set cols.
+ *  obj must be a 2-D Numo::NArray or an Array of Arrays, which is cast
+ *  to a Numo::DFloat.
+ *
+ *  Raises ArgumentError if obj is not 2-D or does not have rows rows.
+ */
+void dvec_read_matrix(dvec *vec, VALUE obj, long rows, long *cols)
+{
+    VALUE shape;
+
+    if (RB_TYPE_P(obj, T_ARRAY))
+    {
+        obj = rb_funcall(dvec_dfloat_class(), rb_intern("cast"), 1, obj);
+    }
+    if (dvec_detect(obj) != DVEC_NARRAY)
+    {
+        rb_raise(rb_eTypeError,
+                 "wrong argument type %s (expected Numo::DFloat or Array)",
+                 rb_obj_classname(obj));
+    }
+
+    shape = rb_funcall(obj, rb_intern("shape"), 0);
+    Check_Type(shape, T_ARRAY);
+    if (RARRAY_LEN(shape) != 2)
+    {
+        rb_raise(rb_eArgError, "Dimension Mismatch matrix must be 2-D");
+    }
+    if (NUM2LONG(rb_ary_entry(shape, 0)) != rows)
+    {
+        rb_raise(rb_eArgError, "Dimension Mismatch CSRMatrix.n != mat.shape[0]");
+    }
+
+    *cols = NUM2LONG(rb_ary_entry(shape, 1));
+    dvec_read(vec, obj, rows * *cols);
+}
+
+void dvec_release(dvec *vec)
+{
+    if (vec->tmp)
+    {
+        rb_free_tmp_buffer(&vec->tmp);
+    }
+    RB_GC_GUARD(vec->str);
+}
+
+/**
+ *  Read obj as a vector of 32 bit integers. obj can be an Array, a
+ *  String packed with pack('l*') or any Numo::NArray, which is cast to
+ *  Numo::Int32 and read through its binary buffer. The length is taken
+ *  from obj.
+ */
+void ivec_read(ivec *vec, VALUE obj)
+{
+    int32_t *buf;
+    long i;
+
+    vec->str = Qnil;
+    vec->tmp = 0;
+
+    if (RB_TYPE_P(obj, T_ARRAY))
+    {
+        vec->len = RARRAY_LEN(obj);
+        buf = (int32_t *)rb_alloc_tmp_buffer(&vec->tmp,
+                                             (vec->len > 0 ? vec->len : 1) * (long)sizeof(int32_t));
+        for (i = 0; i < vec->len; i++)
+        {
+            buf[i] = NUM2INT(rb_ary_entry(obj, i));
+        }
+        vec->ptr = buf;
+        return;
+    }
+
+    if (RB_TYPE_P(obj, T_STRING))
+    {
+        if (RSTRING_LEN(obj) % (long)sizeof(int32_t) != 0)
+        {
+            rb_raise(rb_eArgError, "String length must be a multiple of 4 to be read as int32");
+        }
+    }
+    else
+    {
+        if (!rb_respond_to(obj, rb_intern("to_binary")))
+        {
+            rb_raise(rb_eTypeError,
+                     "wrong argument type %s (expected Array, String or Numo::Int32)",
+                     rb_obj_classname(obj));
+        }
+        if (!rb_obj_is_kind_of(obj, rb_path2class("Numo::Int32")))
+        {
+            obj = rb_funcall(rb_path2class("Numo::Int32"), rb_intern("cast"), 1, obj);
+        }
+        obj = rb_funcall(obj, rb_intern("to_binary"), 0);
+        Check_Type(obj, T_STRING);
+    }
+
+    vec->str = obj;
+    vec->len = RSTRING_LEN(obj) / (long)sizeof(int32_t);
+    if (((uintptr_t)RSTRING_PTR(obj) % sizeof(int32_t)) == 0)
+    {
+        vec->ptr = (const int32_t *)RSTRING_PTR(obj);
+    }
+    else
+    {
+        buf = (int32_t *)rb_alloc_tmp_buffer(&vec->tmp,
+                                             (vec->len > 0 ? vec->len : 1) * (long)sizeof(int32_t));
+        memcpy(buf, RSTRING_PTR(obj), vec->len * sizeof(int32_t));
+        vec->ptr = buf;
+    }
+}
+
+void ivec_release(ivec *vec)
+{
+    if (vec->tmp)
+    {
+        rb_free_tmp_buffer(&vec->tmp);
+    }
+    RB_GC_GUARD(vec->str);
+}
+
+/**
+ *  Prepare an output vector of len doubles. If target is nil a new
+ *  object of the same kind as the input is created when finished,
+ *  otherwise the result is written into target which must be an Array,
+ *  a packed double String or a Numo::DFloat with len elements.
+ *
+ *  input is the vector being read, so a target sharing its buffer is
+ *  written through a copy.
+ */
+void dvec_out_init(dvec_out *out, VALUE target, dvec_kind like, long len,
+                   const dvec *input)
+{
+    const char *ptr;
+
+    out->len = len;
+    out->ndim = 1;
+    out->rows = len;
+    out->cols = 1;
+    out->target = target;
+    out->str = Qnil;
+    out->tmp = 0;
+    out->copy = 0;
+
+    if (NIL_P(target))
+    {
+        out->kind = like;
+        if (like == DVEC_ARRAY)
+        {
+            out->ptr = dvec_tmp_buffer(&out->tmp, len);
+        }
+        else
+        {
+            out->str = rb_str_new(NULL, len * (long)sizeof(double));
+            out->ptr = (double *)RSTRING_PTR(out->str);
+            if (!dvec_aligned(out->ptr))
+            {
+                out->copy = 1;
+                out->ptr = dvec_tmp_buffer(&out->tmp, len);
+            }
+        }
+        return;
+    }
+
+    out->kind = dvec_detect(target);
+    rb_check_frozen(target);
+
+    switch (out->kind)
+    {
+    case DVEC_ARRAY:
+        if (RARRAY_LEN(target) != len)
+        {
+            rb_raise(rb_eArgError, "Dimension Mismatch CSRMatrix.n != out.size");
+        }
+        out->ptr = dvec_tmp_buffer(&out->tmp, len);
+        break;
+    case DVEC_STRING:
+        if (RSTRING_LEN(target) != len * (long)sizeof(double))
+        {
+            rb_raise(rb_eArgError, "Dimension Mismatch CSRMatrix.n != out.size");
+        }
+        rb_str_modify(target);
+        ptr = RSTRING_PTR(target);
+
+        if (!dvec_aligned(ptr) ||
+            (input && ptr < (const char *)(input->ptr + input->len) &&
+             (const char *)input->ptr < ptr + len * sizeof(double)))
+        {
+            out->copy = 1;
+            out->ptr = dvec_tmp_buffer(&out->tmp, len);
+        }
+        else
+        {
+            out->ptr = (double *)ptr;
+        }
+        break;
+    case DVEC_NARRAY:
+        if (!rb_obj_is_kind_of(target, dvec_dfloat_class()))
+        {
+            rb_raise(rb_eTypeError, "out must be a Numo::DFloat");
+        }
+        if (NUM2LONG(rb_funcall(target, rb_intern("size"), 0)) != len)
+        {
+            rb_raise(rb_eArgError, "Dimension Mismatch CSRMatrix.n != out.size");
+        }
+        out->str = rb_str_new(NULL, len * (long)sizeof(double));
+        out->ptr = (double *)RSTRING_PTR(out->str);
+        if (!dvec_aligned(out->ptr))
+        {
+            out->copy = 1;
+            out->ptr = dvec_tmp_buffer(&out->tmp, len);
+        }
+        break;
+    }
+}
+
+/**
+ *  Prepare a row major rows x cols output matrix. If target is nil a
+ *  new Numo::DFloat is created when finished, otherwise the result is
+ *  written into target which must be a Numo::DFloat of the same shape.
+ */
+void dvec_out_init_matrix(dvec_out *out, VALUE target, long rows, long cols)
+{
+    VALUE shape;
+
+    if (!NIL_P(target))
+    {
+        if (!rb_obj_is_kind_of(target, dvec_dfloat_class()))
+        {
+            rb_raise(rb_eTypeError, "out must be a Numo::DFloat");
+        }
+        shape = rb_funcall(target, rb_intern("shape"), 0);
+        Check_Type(shape, T_ARRAY);
+        if (RARRAY_LEN(shape) != 2 || NUM2LONG(rb_ary_entry(shape, 0)) != rows ||
+            NUM2LONG(rb_ary_entry(shape, 1)) != cols)
+        {
+            rb_raise(rb_eArgError, "Dimension Mismatch out.shape != [CSRMatrix.n, mat.shape[1]]");
+        }
+    }
+
+    dvec_out_init(out, target, DVEC_NARRAY, rows * cols, NULL);
+    out->ndim = 2;
+    out->rows = rows;
+    out->cols = cols;
+}
+
+/**
+ *  Store the written values and return the ruby object holding them.
+ */
+VALUE dvec_out_finish(dvec_out *out)
+{
+    VALUE result;
+    long i;
+
+    if (out->kind == DVEC_ARRAY)
+    {
+        result = NIL_P(out->target) ? rb_ary_new_capa(out->len) : out->target;
+        for (i = 0; i < out->len; i++)
+        {
+            rb_ary_store(result, i, DBL2NUM(out->ptr[i]));
+        }
+    }
+    else
+    {
+        if (out->copy)
+        {
+            memcpy(NIL_P(out->str) ? RSTRING_PTR(out->target) : RSTRING_PTR(out->str),
+                   out->ptr, out->len * sizeof(double));
+        }
+
+        if (out->kind == DVEC_STRING)
+        {
+            result = NIL_P(out->target) ? out->str : out->target;
+        }
+        else if (NIL_P(out->target))
+        {
+            result = rb_funcall(dvec_dfloat_class(), rb_intern("from_binary"), 2,
+                                out->str,
+                                out->ndim == 2
+                                    ? rb_ary_new_from_args(2, LONG2NUM(out->rows),
+                                                           LONG2NUM(out->cols))
+                                    : rb_ary_new_from_args(1, LONG2NUM(out->len)));
+        }
+        else
+        {
+            rb_funcall(out->target, rb_intern("store_binary"), 1, out->str);
+            result = out->target;
+        }
+    }
+
+    if (out->tmp)
+    {
+        rb_free_tmp_buffer(&out->tmp);
+    }
+    RB_GC_GUARD(out->str);
+
+    return result;
+}
@@ -0,0 +1,60 @@
+#ifndef DVEC
+#define DVEC
+
+#include <stdint.h>
+
+// Source of a vector of doubles passed in from ruby.
+typedef enum dvec_kind
+{
+    DVEC_ARRAY,
+    DVEC_STRING,
+    DVEC_NARRAY
+} dvec_kind;
+
+// Read only view of an input vector. Packed strings are read in place,
+// Numo::DFloat through its binary buffer and arrays are unboxed once.
+typedef struct dvec
+{
+    dvec_kind kind;
+    const double *ptr;
+    long len;
+    VALUE str;
+    VALUE tmp;
+} dvec;
+
+// Read only view of an input vector of 32 bit integers.
+typedef struct ivec
+{
+    const int32_t *ptr;
+    long len;
+    VALUE str;
+    VALUE tmp;
+} ivec;
+
+// Output vector, or row major rows x cols matrix when ndim is 2.
+// ptr is written by the caller, then dvec_out_finish returns the ruby object holding the
+// result.
+typedef struct dvec_out
+{
+    dvec_kind kind;
+    double *ptr;
+    long len;
+    int ndim;
+    long rows;
+    long cols;
+    VALUE target;
+    VALUE str;
+    VALUE tmp;
+    int copy;
+} dvec_out;
+
+void dvec_read(dvec *vec, VALUE obj, long len);
+void dvec_read_matrix(dvec *vec, VALUE obj, long rows, long *cols);
+void dvec_release(dvec *vec);
+void ivec_read(ivec *vec, VALUE obj);
+void ivec_release(ivec *vec);
+void dvec_out_init(dvec_out *out, VALUE target, dvec_kind like, long len,
+                   const dvec *input);
+void dvec_out_init_matrix(dvec_out *out, VALUE target, long rows, long cols);
+VALUE dvec_out_finish(dvec_out *out);
+#endif
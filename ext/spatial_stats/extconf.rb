@@ -2,5 +2,10 @@
 
 require 'mkmf'
 
+have_header('pthread.h')
+have_library('pthread')
+have_header('sys/mman.h')
+have_func('rb_gc_adjust_memory_usage', 'ruby.h')
+
 create_header
 create_makefile 'spatial_stats/spatial_stats'
@@ -0,0 +1,280 @@
+#include <ruby.h>
+#include <math.h>
+#include "csr_matrix.h"
+#include "dvec.h"
+#include "permutation.h"
+#include "local_stats.h"
+
+// quadrant codes, indexes into %w[HH LH LL HL]
+#define QUAD_HH 0
+#define QUAD_LH 1
+#define QUAD_LL 2
+#define QUAD_HL 3
+
+// group codes for getis_ord, indexes into %w[H L]
+#define GROUP_H 0
+#define GROUP_L 1
+
+static void local_stats_out(dvec_out *out, VALUE targets, const char *name,
+                            dvec_kind like, long len)
+{
+    VALUE target = Qnil;
+
+    if (!NIL_P(targets))
+    {
+        target = rb_hash_lookup(targets, ID2SYM(rb_intern(name)));
+    }
+    dvec_out_init(out, target, like, len, NULL);
+}
+
+// local_stats also takes :getis_ord_star, which only changes the
+// expectation and variance of getis_ord.
+static mc_kind parse_local_kind(VALUE kind, int *star)
+{
+    *star = 0;
+    if (SYMBOL_P(kind) && SYM2ID(kind) == rb_intern("getis_ord_star"))
+    {
+        *star = 1;
+        return MC_GETIS_ORD;
+    }
+    return parse_mc_kind(kind);
+}
+
+static int quad_code(double factor, double lag)
+{
+    if (factor > 0)
+    {
+        return lag > 0 ? QUAD_HH : QUAD_HL;
+    }
+    return lag > 0 ? QUAD_LH : QUAD_LL;
+}
+
+/**
+ *  Computes a local statistic and its companion values for every
+ *  observation in one pass over the matrix. The matrix is expected to
+ *  be row standardized, same as +local_mc+, and factors and values have
+ *  the same meaning as they do there.
+ *
+ *  [moran] I_i = factors[i] * sum_j(w_ij * values[j]), with its
+ *          variance and z-score under randomization. The variance uses
+ *          the kurtosis of factors, so they should be the standardized z.
+ *  [geary] C_i = sum_j(w_ij * (factors[i] - values[j])**2)
+ *  [multivariate_geary] C_i = sum_j(w_ij * sum_v((factors[i, v] - values[j, v])**2)) / m
+ *                       where factors and values are n x m matrices.
+ *  [getis_ord] G_i = sum_j(w_ij * values[j]) / factors[i], with its
+ *              expectation, variance and z-score under randomization
+ *              of the other values. +:getis_ord_star+ is the same but
+ *              values[i] is part of the randomization, like in G*.
+ *
+ *  +:quads+ holds the quadrant of each observation as an index into
+ *  +%w[HH LH LL HL]+, from the sign of factors[i] and the lag of
+ *  values for moran and geary. For getis_ord it is an index into
+ *  +%w[H L]+, high when values[i] is above the mean of values.
+ *
+ *  @see https://pro.arcgis.com/en/pro-app/tool-reference/spatial-statistics/h-local-morans-i-additional-math.htm
+ *  @see https://doi.org/10.1111/j.1538-4632.1995.tb00912.x
+ *
+ *  @example
+ *      csr.local_stats(:moran, z, z)
+ *      # => {stat: [...], variance: [...], z_score: [...], quads: [0, 2, ...]}
+ *
+ *  @param [Symbol] kind of stat. One of +:moran+, +:geary+, +:getis_ord+, +:getis_ord_star+ or +:multivariate_geary+.
+ *  @param [Array, Numo::DFloat] factors per observation. The held value for moran and geary, denominator for getis_ord.
+ *  @param [Array, Numo::DFloat] values that are lagged.
+ *  @param [Hash] out optional buffers to write +:stat+, +:expectation+, +:variance+ and +:z_score+ into, see +mulvec+.
+ *
+ *  @return [Hash] with +:stat+ and, except for multivariate_geary, +:quads+, plus +:variance+ and +:z_score+ for moran and +:expectation+, +:variance+ and +:z_score+ for getis_ord.
+ */
+VALUE csr_matrix_local_stats(int argc, VALUE *argv, VALUE self)
+{
+    VALUE kind_v, factors, values, targets;
+    VALUE result;
+    VALUE quads;
+    csr_matrix *csr;
+    mc_kind kind;
+    dvec factors_vec, values_vec;
+    dvec_out stat_out, exp_out, var_out, z_out;
+    int star;
+    int moments;
+    long vars = 1;
+    long values_vars = 1;
+    long v;
+    const double *sample;
+
+    int n;
+    int i;
+    int64_t jj;
+    double w;
+    double lag;
+    double diff;
+    double geary;
+    double w2_sum;
+    double row_sum;
+
+    double m2 = 0;
+    double m4 = 0;
+    double mean = 0;
+    double total = 0;
+    double total2 = 0;
+    double pop;
+    double y1;
+    double y2;
+    double b2i = 0;
+    double e = 0;
+    double a_factor = 0;
+    double b_factor = 0;
+
+    rb_scan_args(argc, argv, "31", &kind_v, &factors, &values, &targets);
+    if (!NIL_P(targets))
+    {
+        Check_Type(targets, T_HASH);
+    }
+
+    kind = parse_local_kind(kind_v, &star);
+    moments = kind == MC_MORAN || kind == MC_GETIS_ORD;
+    TypedData_Get_Struct(self, csr_matrix, &csr_matrix_type, csr);
+    csr_matrix_check_square(csr);
+    n = csr->n;
+
+    if (kind == MC_MULTIVARIATE_GEARY)
+    {
+        dvec_read_matrix(&factors_vec, factors, n, &vars);
+        dvec_read_matrix(&values_vec, values, n, &values_vars);
+        if (vars != values_vars || vars < 1)
+        {
+            rb_raise(rb_eArgError, "Dimension Mismatch factors.shape[1] != values.shape[1]");
+        }
+    }
+    else
+    {
+        dvec_read(&factors_vec, factors, n);
+        dvec_read(&values_vec, values, n);
+    }
+
+    local_stats_out(&stat_out, targets, "stat", values_vec.kind, n);
+    if (moments)
+    {
+        local_stats_out(&var_out, targets, "variance", values_vec.kind, n);
+        local_stats_out(&z_out, targets, "z_score", values_vec.kind, n);
+    }
+    if (kind == MC_GETIS_ORD)
+    {
+        local_stats_out(&exp_out, targets, "expectation", values_vec.kind, n);
+    }
+
+    if (kind == MC_MORAN)
+    {
+        // a_i = (n - b2i) * sum_j(w_ij**2) / (n - 1)
+        // b_i = (2 * b2i - n) * sum_k(sum_h(w_ik * w_ih)) / ((n - 1) * (n - 2))
+        for (i = 0; i < n; i++)
+        {
+            m2 += factors_vec.ptr[i] * factors_vec.ptr[i];
+            m4 += factors_vec.ptr[i] * factors_vec.ptr[i] * factors_vec.ptr[i] * factors_vec.ptr[i];
+        }
+        b2i = m4 / (m2 * m2);
+        e = -1.0 / (n - 1);
+        a_factor = (n - b2i) / (n - 1);
+        b_factor = (2 * b2i - n) / ((double)(n - 1) * (n - 2));
+    }
+    else if (kind == MC_GETIS_ORD)
+    {
+        for (i = 0; i < n; i++)
+        {
+            total += values_vec.ptr[i];
+            total2 += values_vec.ptr[i] * values_vec.ptr[i];
+        }
+        mean = total / n;
+    }
+
+    quads = rb_ary_new_capa(n);
+    for (i = 0; i < n; i++)
+    {
+        lag = 0;
+        geary = 0;
+        w2_sum = 0;
+        row_sum = 0;
+        for (jj = csr->row_index[i]; jj < csr->row_index[i + 1]; jj++)
+        {
+            w = csr_matrix_value(csr, i, jj);
+            lag += w * values_vec.ptr[(long)csr->col_index[jj] * vars];
+            w2_sum += w * w;
+            row_sum += w;
+            if (kind == MC_GEARY)
+            {
+                diff = factors_vec.ptr[i] - values_vec.ptr[csr->col_index[jj]];
+                geary += w * (diff * diff);
+            }
+            else if (kind == MC_MULTIVARIATE_GEARY)
+            {
+                // the attributes of an observation are contiguous
+                sample = values_vec.ptr + (long)csr->col_index[jj] * vars;
+                for (v = 0; v < vars; v++)
+                {
+                    diff = factors_vec.ptr[(long)i * vars + v] - sample[v];
+                    geary += w * (diff * diff);
+                }
+            }
+        }
+
+        switch (kind)
+        {
+        case MC_MORAN:
+            stat_out.ptr[i] = factors_vec.ptr[i] * lag;
+            var_out.ptr[i] = a_factor * w2_sum - b_factor * row_sum * row_sum - e * e;
+            z_out.ptr[i] = (stat_out.ptr[i] - e) / sqrt(var_out.ptr[i]);
+            rb_ary_push(quads, INT2FIX(quad_code(factors_vec.ptr[i], lag)));
+            break;
+        case MC_GEARY:
+            stat_out.ptr[i] = geary;
+            rb_ary_push(quads, INT2FIX(quad_code(factors_vec.ptr[i], lag)));
+            break;
+        case MC_MULTIVARIATE_GEARY:
+            stat_out.ptr[i] = geary / vars;
+            break;
+        case MC_GETIS_ORD:
+            // lag is a sample without replacement of pop values with
+            // mean y1 and variance y2, weighted by the row.
+            // E[G_i] = W_i / pop
+            // Var[G_i] = y2 * (pop * S1_i - W_i**2) / ((pop - 1) * pop**2 * y1**2)
+            if (star)
+            {
+                pop = n;
+                y1 = total / pop;
+                y2 = total2 / pop - y1 * y1;
+            }
+            else
+            {
+                pop = n - 1;
+                y1 = (total - values_vec.ptr[i]) / pop;
+                y2 = (total2 - values_vec.ptr[i] * values_vec.ptr[i]) / pop - y1 * y1;
+            }
+            stat_out.ptr[i] = lag / factors_vec.ptr[i];
+            exp_out.ptr[i] = row_sum / pop;
+            var_out.ptr[i] = y2 * (pop * w2_sum - row_sum * row_sum) /
+                             ((pop - 1) * pop * pop * y1 * y1);
+            z_out.ptr[i] = (stat_out.ptr[i] - exp_out.ptr[i]) / sqrt(var_out.ptr[i]);
+            rb_ary_push(quads, INT2FIX(values_vec.ptr[i] > mean ? GROUP_H : GROUP_L));
+            break;
+        }
+    }
+
+    dvec_release(&factors_vec);
+    dvec_release(&values_vec);
+
+    result = rb_hash_new();
+    rb_hash_aset(result, ID2SYM(rb_intern("stat")), dvec_out_finish(&stat_out));
+    if (kind == MC_GETIS_ORD)
+    {
+        rb_hash_aset(result, ID2SYM(rb_intern("expectation")), dvec_out_finish(&exp_out));
+    }
+    if (moments)
+    {
+        rb_hash_aset(result, ID2SYM(rb_intern("variance")), dvec_out_finish(&var_out));
+        rb_hash_aset(result, ID2SYM(rb_intern("z_score")), dvec_out_finish(&z_out));
+    }
+    if (kind != MC_MULTIVARIATE_GEARY)
+    {
+        rb_hash_aset(result, ID2SYM(rb_intern("quads")), quads);
+    }
+    return result;
+}
@@ -0,0 +1,5 @@
+#ifndef LOCAL_STATS
+#define LOCAL_STATS
+
+VALUE csr_matrix_local_stats(int argc, VALUE *argv, VALUE self);
+#endif
@@ -0,0 +1,170 @@
+#include <ruby.h>
+#include <ruby/thread.h>
+#include "extconf.h"
+#include "parallel.h"
+
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+
+typedef struct parallel_task
+{
+    parallel_fn fn;
+    void *ctx;
+    int total;
+    int threads;
+    volatile int interrupted;
+} parallel_task;
+
+typedef struct parallel_chunk
+{
+    parallel_task *task;
+    int thread;
+    int start;
+    int stop;
+#ifdef HAVE_PTHREAD_H
+    pthread_t tid;
+    int started;
+#endif
+} parallel_chunk;
+
+static void *parallel_chunk_run(void *ptr)
+{
+    parallel_chunk *chunk = (parallel_chunk *)ptr;
+    parallel_task *task = chunk->task;
+
+    if (chunk->start < chunk->stop)
+    {
+        chunk->start = task->fn(task->ctx, chunk->thread, chunk->start,
+                                chunk->stop, &task->interrupted);
+    }
+    return NULL;
+}
+
+static void *parallel_task_run(void *ptr)
+{
+    parallel_chunk *chunks = (parallel_chunk *)ptr;
+    parallel_task *task = chunks[0].task;
+    int t;
+
+#ifdef HAVE_PTHREAD_H
+    for (t = 1; t < task->threads; t++)
+    {
+        chunks[t].started = chunks[t].start < chunks[t].stop &&
+                            pthread_create(&chunks[t].tid, NULL,
+                                           parallel_chunk_run, &chunks[t]) == 0;
+    }
+
+    parallel_chunk_run(&chunks[0]);
+
+    for (t = 1; t < task->threads; t++)
+    {
+        if (chunks[t].started)
+        {
+            pthread_join(chunks[t].tid, NULL);
+        }
+        else
+        {
+            // could not spawn a thread, or it had nothing left to do,
+            // run its chunk here instead.
+            parallel_chunk_run(&chunks[t]);
+        }
+    }
+#else
+    for (t = 0; t < task->threads; t++)
+    {
+        parallel_chunk_run(&chunks[t]);
+    }
+#endif
+
+    return NULL;
+}
+
+static int parallel_task_done(const parallel_task *task, const parallel_chunk *chunks)
+{
+    int t;
+
+    for (t = 0; t < task->threads; t++)
+    {
+        if (chunks[t].start < chunks[t].stop)
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static void parallel_task_ubf(void *ptr)
+{
+    parallel_chunk *chunks = (parallel_chunk *)ptr;
+    chunks[0].task->interrupted = 1;
+}
+
+/**
+ *  Convert and validate a thread count. The result is clamped to
+ *  total so no thread is started without work.
+ */
+int parallel_threads(VALUE threads, int total)
+{
+    int count = NUM2INT(threads);
+
+    if (count < 1)
+    {
+        rb_raise(rb_eArgError, "threads must be >= 1");
+    }
+    if (count > total)
+    {
+        count = total > 0 ? total : 1;
+    }
+    return count;
+}
+
+/**
+ *  Run fn over total items split across threads. The GVL is released
+ *  for the duration of the work so other ruby threads keep running.
+ *  An interrupt (Ctrl-C, Thread#raise, a trapped signal) stops the
+ *  workers early and is handled once the GVL is reacquired. If it
+ *  does not raise, like a trap handler that returns, every thread
+ *  resumes from the first item it did not finish, so the work is done
+ *  as if it had not been interrupted.
+ */
+void parallel_for(parallel_fn fn, void *ctx, int total, int threads)
+{
+    parallel_task task;
+    parallel_chunk *chunks;
+    VALUE chunks_v;
+    int t;
+
+    task.fn = fn;
+    task.ctx = ctx;
+    task.total = total;
+    task.threads = threads;
+    task.interrupted = 0;
+
+    chunks = ALLOCV_N(parallel_chunk, chunks_v, threads);
+    for (t = 0; t < threads; t++)
+    {
+        chunks[t].task = &task;
+        chunks[t].thread = t;
+
+        // split the items evenly and contiguously so thread t always
+        // gets the same range for a given total and thread count.
+        chunks[t].start = (int)((long long)total * t / threads);
+        chunks[t].stop = (int)((long long)total * (t + 1) / threads);
+    }
+
+    for (;;)
+    {
+        rb_thread_call_without_gvl(parallel_task_run, chunks, parallel_task_ubf, chunks);
+        if (!task.interrupted || parallel_task_done(&task, chunks))
+        {
+            break;
+        }
+
+        // raises if the interrupt is an exception, chunks is freed
+        // with its temporary object then.
+        rb_thread_check_ints();
+        task.interrupted = 0;
+    }
+    ALLOCV_END(chunks_v);
+}
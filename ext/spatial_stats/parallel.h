@@ -0,0 +1,15 @@
+#ifndef PARALLEL
+#define PARALLEL
+
+// Work function for parallel_for. Called per thread with the half
+// open range [start, stop) of items it is responsible for, and
+// returns the first item it did not finish, stop once done.
+// Implementations must not call into ruby and should return early
+// when *interrupted is set, they are called again from there if the
+// interrupt does not raise.
+typedef int (*parallel_fn)(void *ctx, int thread, int start, int stop,
+                            volatile int *interrupted);
+
+int parallel_threads(VALUE threads, int total);
+void parallel_for(parallel_fn fn, void *ctx, int total, int threads);
+#endif
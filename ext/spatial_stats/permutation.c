@@ -0,0 +1,1061 @@
+#include <ruby.h>
+#include <stdint.h>
+#include <string.h>
+#include "csr_matrix.h"
+#include "dvec.h"
+#include "parallel.h"
+#include "permutation.h"
+#include "rng.h"
+#include "spmv.h"
+
+typedef struct local_mc_ctx
+{
+    const csr_matrix *csr;
+    // values of csr as doubles, see csr_matrix_float64_values
+    const double *values;
+    mc_kind kind;
+    const double *factors;
+    const double *permuted;
+    int vars;
+    const double *stat;
+    const int32_t *rids;
+    int k;
+    int permutations;
+    int *counts;
+
+    // base seed of the per observation streams when rids is NULL
+    uint64_t seed;
+
+    // key index of each row of reordered weights and the row of each
+    // key, or NULL. Streams and samples are numbered by key so results
+    // do not depend on the order of the rows.
+    const int32_t *labels;
+    const int *rows;
+
+    // sequential tests stop an observation once its count reaches
+    // stop, and record the permutations it used. totals holds the sum
+    // and sum of squares of each variable of permuted, for the
+    // expectation of geary.
+    int stop;
+    int *used;
+    const double *totals;
+
+    // per thread scratch space and random streams
+    int *idsi;
+    int *samples;
+    int *swaps;
+    double *stat_new;
+    xoshiro256_state *streams;
+} local_mc_ctx;
+
+typedef struct global_mc_ctx
+{
+    const csr_matrix *csr;
+    const double *factors;
+    const double *permuted;
+    double denominator;
+    double *result;
+
+    // base seed of the per permutation streams, and the number of the
+    // stream of the first permutation
+    uint64_t seed;
+    uint64_t offset;
+
+    // key index of each row of reordered weights, or NULL. permuted is
+    // shuffled in key order from keyed, then gathered into row order,
+    // so results do not depend on the order of the rows.
+    const int32_t *labels;
+    const double *keyed;
+
+    // per thread scratch space
+    double *shuffled;
+    double *gathered;
+    double *lags;
+} global_mc_ctx;
+
+mc_kind parse_mc_kind(VALUE kind)
+{
+    ID id;
+
+    Check_Type(kind, T_SYMBOL);
+    id = SYM2ID(kind);
+
+    if (id == rb_intern("moran"))
+    {
+        return MC_MORAN;
+    }
+    else if (id == rb_intern("geary"))
+    {
+        return MC_GEARY;
+    }
+    else if (id == rb_intern("getis_ord"))
+    {
+        return MC_GETIS_ORD;
+    }
+    else if (id == rb_intern("multivariate_geary"))
+    {
+        return MC_MULTIVARIATE_GEARY;
+    }
+
+    rb_raise(rb_eArgError, "Unknown kind, expected :moran, :geary, :getis_ord or :multivariate_geary");
+}
+
+// base seed for the native streams. An Integer seed is used as is,
+// its low 64 bits, otherwise the seed is drawn from a ruby rng so a
+// seeded Random gives the same streams every time.
+static uint64_t stream_seed(VALUE seed)
+{
+    uint64_t hi;
+    uint64_t lo;
+
+    if (RB_INTEGER_TYPE_P(seed))
+    {
+        seed = rb_funcall(seed, rb_intern("&"), 1, ULL2NUM(UINT64_MAX));
+        return NUM2ULL(seed);
+    }
+
+    hi = rb_random_int32(seed);
+    lo = rb_random_int32(seed);
+    return (hi << 32) | lo;
+}
+
+// one stream per thread, each 2^128 draws apart.
+static void init_streams(xoshiro256_state *streams, int threads, uint64_t seed)
+{
+    int t;
+
+    xoshiro256_seed(&streams[0], seed);
+    for (t = 1; t < threads; t++)
+    {
+        streams[t] = streams[t - 1];
+        xoshiro256_jump(&streams[t]);
+    }
+}
+
+// Read the labels of reordered weights, the key index of each of the
+// n rows, and fill rows with the row of each key. Returns rows, or NULL
+// without labels. rows needs room for n ints when labels are given.
+static int *read_labels(VALUE labels_v, int n, ivec *labels, int *rows)
+{
+    int i;
+
+    labels->ptr = NULL;
+    if (NIL_P(labels_v))
+    {
+        return NULL;
+    }
+
+    ivec_read(labels, labels_v);
+    if (labels->len != n)
+    {
+        rb_raise(rb_eArgError, "Dimension Mismatch labels.size != n");
+    }
+    memset(rows, -1, sizeof(int) * n);
+    for (i = 0; i < n; i++)
+    {
+        if (labels->ptr[i] < 0 || labels->ptr[i] >= n || rows[labels->ptr[i]] != -1)
+        {
+            rb_raise(rb_eArgError, "Index Error labels must be a permutation of 0...n");
+        }
+        rows[labels->ptr[i]] = i;
+    }
+    return rows;
+}
+
+static void release_labels(ivec *labels)
+{
+    if (labels->ptr)
+    {
+        ivec_release(labels);
+    }
+}
+
+// ids 0...n without idx, returns the number of ids.
+static int fill_ids(int *idsi, int n, int idx)
+{
+    int i;
+    int m = 0;
+
+    for (i = 0; i < n; i++)
+    {
+        if (i != idx)
+        {
+            idsi[m++] = i;
+        }
+    }
+    return m;
+}
+
+// shuffle the same way as Array#shuffle! so ruby rngs give
+// identical results to the original ruby implementation.
+static void shuffle_ids_ruby(int *idsi, int m, VALUE rng)
+{
+    long i = m;
+    long j;
+    int tmp;
+
+    while (i)
+    {
+        j = (long)rb_random_ulong_limited(rng, i - 1);
+        i--;
+        tmp = idsi[i];
+        idsi[i] = idsi[j];
+        idsi[j] = tmp;
+    }
+}
+
+static void shuffle_ids_native(int *idsi, int m, xoshiro256_state *rng)
+{
+    long i = m;
+    long j;
+    int tmp;
+
+    while (i)
+    {
+        j = (long)xoshiro256_bounded(rng, (uint64_t)i);
+        i--;
+        tmp = idsi[i];
+        idsi[i] = idsi[j];
+        idsi[j] = tmp;
+    }
+}
+
+// draw wc distinct ids, other than idx, into samples with a partial
+// Fisher-Yates shuffle of pool. pool holds 0...m, the m = n - 1 ids
+// that remain after removing idx, so ids >= idx are shifted by one.
+// The swaps are undone afterwards, which leaves pool as it was and
+// makes the draws only depend on rng. Each draw costs O(wc) no matter
+// how many observations there are.
+static void sample_neighbors(int *pool, int *swaps, int m, int idx, int wc,
+                             xoshiro256_state *rng, int *samples)
+{
+    int j;
+    int r;
+    int tmp;
+
+    for (j = 0; j < wc; j++)
+    {
+        r = j + (int)xoshiro256_bounded(rng, (uint64_t)(m - j));
+        swaps[j] = r;
+        tmp = pool[j];
+        pool[j] = pool[r];
+        pool[r] = tmp;
+        samples[j] = pool[j] >= idx ? pool[j] + 1 : pool[j];
+    }
+
+    for (j = wc - 1; j >= 0; j--)
+    {
+        r = swaps[j];
+        tmp = pool[j];
+        pool[j] = pool[r];
+        pool[r] = tmp;
+    }
+}
+
+// key index of the observation in row idx, see local_mc_ctx.labels
+static int observation_key(const local_mc_ctx *ctx, int idx)
+{
+    return ctx->labels ? ctx->labels[idx] : idx;
+}
+
+// sample_neighbors for the observation with key, drawn among keys and
+// mapped back to rows, so the rows of reordered weights get the same
+// neighbors as in key order.
+static void sample_keys(const local_mc_ctx *ctx, int *pool, int *swaps, int key,
+                        int wc, xoshiro256_state *rng, int *samples)
+{
+    int j;
+
+    sample_neighbors(pool, swaps, ctx->csr->n - 1, key, wc, rng, samples);
+    if (ctx->rows)
+    {
+        for (j = 0; j < wc; j++)
+        {
+            samples[j] = ctx->rows[samples[j]];
+        }
+    }
+}
+
+// compute the permuted statistic of a single observation, with its
+// wc neighbors replaced by the observations in samples.
+//
+// factor points to the vars held values of the observation and
+// permuted is n x vars, row major, so the attributes of a sample are
+// contiguous. vars is 1 for every kind except multivariate geary.
+static double permuted_stat(mc_kind kind, const double *w, int wc,
+                            const double *factor, const double *permuted,
+                            int vars, const int *samples)
+{
+    int j;
+    int v;
+    double tmp = 0;
+    double diff;
+    double dist;
+    const double *sample;
+
+    if (kind == MC_MULTIVARIATE_GEARY)
+    {
+        for (j = 0; j < wc; j++)
+        {
+            sample = permuted + (long)samples[j] * vars;
+            dist = 0;
+            for (v = 0; v < vars; v++)
+            {
+                diff = factor[v] - sample[v];
+                dist += diff * diff;
+            }
+            tmp += w[j] * dist;
+        }
+        return tmp / vars;
+    }
+    else if (kind == MC_GEARY)
+    {
+        for (j = 0; j < wc; j++)
+        {
+            diff = *factor - permuted[samples[j]];
+            tmp += w[j] * (diff * diff);
+        }
+        return tmp;
+    }
+
+    for (j = 0; j < wc; j++)
+    {
+        tmp += w[j] * permuted[samples[j]];
+    }
+    return kind == MC_MORAN ? *factor * tmp : tmp / *factor;
+}
+
+// number of permuted statistics that are at least as extreme as the
+// original. Each stat defines its own tail, see the ruby docs for each.
+static int observation_count(mc_kind kind, double orig, const double *stat_new,
+                             int permutations)
+{
+    int p;
+    int count = 0;
+    double mean;
+
+    switch (kind)
+    {
+    case MC_MORAN:
+        for (p = 0; p < permutations; p++)
+        {
+            if (orig > 0 ? stat_new[p] >= orig : stat_new[p] <= orig)
+            {
+                count++;
+            }
+        }
+        return count;
+    case MC_GEARY:
+    case MC_MULTIVARIATE_GEARY:
+        // Geary cannot be negative, so the tail is chosen by comparing
+        // to the mean of the permuted values.
+        // https://github.com/GeoDaCenter/geoda/blob/master/Explore/LocalGearyCoordinator.cpp#L981
+        mean = 0;
+        for (p = 0; p < permutations; p++)
+        {
+            mean += stat_new[p];
+        }
+        mean /= permutations;
+
+        for (p = 0; p < permutations; p++)
+        {
+            if (orig <= mean ? stat_new[p] <= orig : stat_new[p] >= orig)
+            {
+                count++;
+            }
+        }
+        return count;
+    case MC_GETIS_ORD:
+        // GetisOrd cannot be negative, select p or 1-p like ESDA.
+        // https://github.com/pysal/esda/blob/master/esda/getisord.py#L388
+        for (p = 0; p < permutations; p++)
+        {
+            if (stat_new[p] >= orig)
+            {
+                count++;
+            }
+        }
+        return (permutations - count) < count ? permutations - count : count;
+    }
+    return count;
+}
+
+// count for one observation. With rids, idsi must already be shuffled
+// and samples are selected through idsi[rids[p, j]], the same indexing
+// scheme the ruby implementation used. Without rids, idsi is the pool
+// for sample_neighbors and samples are drawn from the observation's
+// own stream.
+static int local_mc_observation(const local_mc_ctx *ctx, int idx, int *idsi,
+                                int *samples, int *swaps, double *stat_new)
+{
+    const csr_matrix *csr = ctx->csr;
+    int wc = (int)(csr->row_index[idx + 1] - csr->row_index[idx]);
+    const double *w = ctx->values + csr->row_index[idx];
+    const double *factor = ctx->factors + (long)idx * ctx->vars;
+    const int32_t *row;
+    xoshiro256_state rng;
+    int p;
+    int j;
+
+    // account for case where there are no neighbors
+    if (wc == 0)
+    {
+        return ctx->permutations;
+    }
+
+    if (!ctx->rids)
+    {
+        xoshiro256_seed_stream(&rng, ctx->seed, (uint64_t)observation_key(ctx, idx));
+    }
+
+    for (p = 0; p < ctx->permutations; p++)
+    {
+        if (ctx->rids)
+        {
+            row = ctx->rids + (long)p * ctx->k;
+            for (j = 0; j < wc; j++)
+            {
+                samples[j] = idsi[row[j]];
+            }
+        }
+        else
+        {
+            sample_keys(ctx, idsi, swaps, observation_key(ctx, idx), wc, &rng, samples);
+        }
+        stat_new[p] = permuted_stat(ctx->kind, w, wc, factor, ctx->permuted,
+                                    ctx->vars, samples);
+    }
+
+    return observation_count(ctx->kind, ctx->stat[idx], stat_new,
+                             ctx->permutations);
+}
+
+// expected permuted geary of an observation, sum_j(w_ij) times the
+// mean distance to the other observations.
+static double geary_expectation(const local_mc_ctx *ctx, int idx, double w_sum)
+{
+    const double *factor = ctx->factors + (long)idx * ctx->vars;
+    const double *held = ctx->permuted + (long)idx * ctx->vars;
+    int m = ctx->csr->n - 1;
+    int v;
+    double mean;
+    double mean2;
+    double dist = 0;
+
+    for (v = 0; v < ctx->vars; v++)
+    {
+        mean = (ctx->totals[2 * v] - held[v]) / m;
+        mean2 = (ctx->totals[2 * v + 1] - held[v] * held[v]) / m;
+        dist += factor[v] * factor[v] - 2 * factor[v] * mean + mean2;
+    }
+    return w_sum * dist / ctx->vars;
+}
+
+// count for one observation of a sequential test. Permutations stop
+// once the count reaches ctx->stop, and the number used is recorded.
+// The tail has to be known before permuting, so geary compares to its
+// expectation rather than the mean of the permuted values, and
+// getis_ord counts the smaller of both tails as it goes.
+static int local_mc_observation_sequential(const local_mc_ctx *ctx, int idx,
+                                           int *idsi, int *samples, int *swaps)
+{
+    const csr_matrix *csr = ctx->csr;
+    int wc = (int)(csr->row_index[idx + 1] - csr->row_index[idx]);
+    const double *w = ctx->values + csr->row_index[idx];
+    const double *factor = ctx->factors + (long)idx * ctx->vars;
+    double orig = ctx->stat[idx];
+    double stat_new;
+    double w_sum = 0;
+    xoshiro256_state rng;
+    int tail;
+    int upper = 0;
+    int lower = 0;
+    int count = 0;
+    int p;
+    int j;
+
+    if (wc == 0)
+    {
+        ctx->used[idx] = ctx->permutations;
+        return ctx->permutations;
+    }
+
+    switch (ctx->kind)
+    {
+    case MC_MORAN:
+        tail = orig > 0 ? 1 : -1;
+        break;
+    case MC_GEARY:
+    case MC_MULTIVARIATE_GEARY:
+        for (j = 0; j < wc; j++)
+        {
+            w_sum += w[j];
+        }
+        tail = orig <= geary_expectation(ctx, idx, w_sum) ? -1 : 1;
+        break;
+    default:
+        tail = 0;
+        break;
+    }
+
+    xoshiro256_seed_stream(&rng, ctx->seed, (uint64_t)observation_key(ctx, idx));
+    for (p = 0; p < ctx->permutations; p++)
+    {
+        sample_keys(ctx, idsi, swaps, observation_key(ctx, idx), wc, &rng, samples);
+        stat_new = permuted_stat(ctx->kind, w, wc, factor, ctx->permuted,
+                                 ctx->vars, samples);
+
+        if (tail > 0)
+        {
+            count += stat_new >= orig;
+        }
+        else if (tail < 0)
+        {
+            count += stat_new <= orig;
+        }
+        else
+        {
+            upper += stat_new >= orig;
+            lower += stat_new < orig;
+            count = upper < lower ? upper : lower;
+        }
+
+        if (count >= ctx->stop)
+        {
+            ctx->used[idx] = p + 1;
+            return count;
+        }
+    }
+
+    ctx->used[idx] = ctx->permutations;
+    return count;
+}
+
+static int local_mc_chunk(void *ptr, int thread, int start, int stop,
+                           volatile int *interrupted)
+{
+    local_mc_ctx *ctx = (local_mc_ctx *)ptr;
+    int n = ctx->csr->n;
+    int *idsi = ctx->idsi + (long)thread * n;
+    int *samples = ctx->samples + (long)thread * ctx->k;
+    int *swaps = ctx->swaps + (long)thread * ctx->k;
+    double *stat_new = ctx->stat_new + (long)thread * ctx->permutations;
+    xoshiro256_state *rng = &ctx->streams[thread];
+    int idx;
+    int m;
+
+    if (!ctx->rids)
+    {
+        fill_ids(idsi, n, n);
+    }
+
+    for (idx = start; idx < stop; idx++)
+    {
+        if (*interrupted)
+        {
+            return idx;
+        }
+
+        if (ctx->stop > 0)
+        {
+            ctx->counts[idx] = local_mc_observation_sequential(ctx, idx, idsi,
+                                                               samples, swaps);
+            continue;
+        }
+        if (ctx->rids)
+        {
+            m = fill_ids(idsi, n, idx);
+            shuffle_ids_native(idsi, m, rng);
+        }
+        ctx->counts[idx] = local_mc_observation(ctx, idx, idsi, samples, swaps,
+                                                stat_new);
+    }
+    return stop;
+}
+
+// shared by local_mc and local_mc_sequential. A sequential run takes
+// a stop count before threads and returns the permutations used too.
+static VALUE local_mc(int argc, VALUE *argv, VALUE self, int sequential)
+{
+    VALUE kind, factors, permuted, stat, rids, rng, stop_v, threads_v, labels_v;
+    csr_matrix *csr;
+    local_mc_ctx ctx;
+    VALUE result;
+    VALUE counts_arr;
+    VALUE used;
+    VALUE shape;
+    VALUE rids_bin;
+    VALUE counts_v, used_v, idsi_v, samples_v, swaps_v, stat_new_v, streams_v, values_v, rows_v;
+    dvec factors_vec, permuted_vec, stat_vec;
+    ivec labels;
+
+    int *counts;
+    double *totals;
+    VALUE totals_v;
+    long v;
+
+    int n;
+    int permutations;
+    int k;
+    int threads;
+    int idx;
+    long j;
+    long vars = 1;
+    long permuted_vars = 1;
+
+    if (sequential)
+    {
+        rb_scan_args(argc, argv, "72", &kind, &factors, &permuted, &stat, &rids,
+                     &rng, &stop_v, &threads_v, &labels_v);
+        Check_Type(rids, T_FIXNUM);
+        ctx.stop = NUM2INT(stop_v);
+        if (ctx.stop < 1)
+        {
+            rb_raise(rb_eArgError, "stop must be >= 1");
+        }
+    }
+    else
+    {
+        rb_scan_args(argc, argv, "62", &kind, &factors, &permuted, &stat, &rids,
+                     &rng, &threads_v, &labels_v);
+        ctx.stop = 0;
+    }
+
+    TypedData_Get_Struct(self, csr_matrix, &csr_matrix_type, csr);
+    csr_matrix_check_square(csr);
+    n = csr->n;
+    threads = NIL_P(threads_v) ? 1 : parallel_threads(threads_v, n);
+
+    ctx.kind = parse_mc_kind(kind);
+
+    ctx.rows = read_labels(labels_v, n, &labels,
+                           ALLOCV_N(int, rows_v, NIL_P(labels_v) || n < 1 ? 1 : n));
+    ctx.labels = labels.ptr;
+
+    k = 0;
+    for (idx = 0; idx < n; idx++)
+    {
+        if (csr->row_index[idx + 1] - csr->row_index[idx] > k)
+        {
+            k = (int)(csr->row_index[idx + 1] - csr->row_index[idx]);
+        }
+    }
+
+    if (RB_INTEGER_TYPE_P(rids))
+    {
+        permutations = NUM2INT(rids);
+        if (permutations < 0)
+        {
+            rb_raise(rb_eArgError, "permutations must be >= 0");
+        }
+        if (k > n - 1)
+        {
+            rb_raise(rb_eArgError, "rows must have fewer neighbors than n");
+        }
+        rids_bin = Qnil;
+        ctx.rids = NULL;
+    }
+    else
+    {
+        shape = rb_funcall(rids, rb_intern("shape"), 0);
+        Check_Type(shape, T_ARRAY);
+        if (RARRAY_LEN(shape) != 2)
+        {
+            rb_raise(rb_eArgError, "rids must be 2-D");
+        }
+        permutations = NUM2INT(rb_ary_entry(shape, 0));
+        if (k > NUM2INT(rb_ary_entry(shape, 1)))
+        {
+            rb_raise(rb_eArgError, "rids has fewer columns than neighbors in a row");
+        }
+        k = NUM2INT(rb_ary_entry(shape, 1));
+
+        rids_bin = rb_funcall(rids, rb_intern("to_binary"), 0);
+        Check_Type(rids_bin, T_STRING);
+        if (RSTRING_LEN(rids_bin) != (long)permutations * k * (long)sizeof(int32_t))
+        {
+            rb_raise(rb_eArgError, "rids must be a Numo::Int32");
+        }
+        ctx.rids = (const int32_t *)RSTRING_PTR(rids_bin);
+
+        // rids index into the n - 1 ids that remain after removing
+        // an observation, so make sure we cannot read out of bounds.
+        for (j = 0; j < (long)permutations * k; j++)
+        {
+            if (ctx.rids[j] < 0 || ctx.rids[j] >= n - 1)
+            {
+                rb_raise(rb_eArgError, "Index Error rids must be in 0...n - 1");
+            }
+        }
+    }
+
+    if (ctx.kind == MC_MULTIVARIATE_GEARY)
+    {
+        dvec_read_matrix(&factors_vec, factors, n, &vars);
+        dvec_read_matrix(&permuted_vec, permuted, n, &permuted_vars);
+        if (vars != permuted_vars || vars < 1)
+        {
+            rb_raise(rb_eArgError, "Dimension Mismatch factors.shape[1] != permuted.shape[1]");
+        }
+    }
+    else
+    {
+        dvec_read(&factors_vec, factors, n);
+        dvec_read(&permuted_vec, permuted, n);
+    }
+    dvec_read(&stat_vec, stat, n);
+
+    counts = ALLOCV_N(int, counts_v, n);
+    ctx.used = ALLOCV_N(int, used_v, n);
+    totals = ALLOCV_N(double, totals_v, 2 * vars);
+    for (v = 0; v < 2 * vars; v++)
+    {
+        totals[v] = 0;
+    }
+    for (j = 0; j < (long)n * vars; j++)
+    {
+        totals[2 * (j % vars)] += permuted_vec.ptr[j];
+        totals[2 * (j % vars) + 1] += permuted_vec.ptr[j] * permuted_vec.ptr[j];
+    }
+    ctx.totals = totals;
+    ctx.idsi = ALLOCV_N(int, idsi_v, (long)threads * n);
+    ctx.samples = ALLOCV_N(int, samples_v, (long)threads * (k > 0 ? k : 1));
+    ctx.swaps = ALLOCV_N(int, swaps_v, (long)threads * (k > 0 ? k : 1));
+    ctx.stat_new = ALLOCV_N(double, stat_new_v,
+                            (long)threads * (permutations > 0 ? permutations : 1));
+    ctx.streams = ALLOCV_N(xoshiro256_state, streams_v, threads);
+
+    ctx.csr = csr;
+    ctx.factors = factors_vec.ptr;
+    ctx.permuted = permuted_vec.ptr;
+    ctx.vars = (int)vars;
+    ctx.stat = stat_vec.ptr;
+    ctx.k = k;
+    ctx.permutations = permutations;
+    ctx.counts = counts;
+    ctx.values = csr_matrix_float64_values(csr, &values_v);
+
+    if (threads == 1 && ctx.rids && !RB_INTEGER_TYPE_P(rng))
+    {
+        for (idx = 0; idx < n; idx++)
+        {
+            j = fill_ids(ctx.idsi, n, idx);
+            shuffle_ids_ruby(ctx.idsi, (int)j, rng);
+            counts[idx] = local_mc_observation(&ctx, idx, ctx.idsi, ctx.samples,
+                                               ctx.swaps, ctx.stat_new);
+        }
+    }
+    else
+    {
+        ctx.seed = stream_seed(rng);
+        init_streams(ctx.streams, threads, ctx.seed);
+        parallel_for(local_mc_chunk, &ctx, n, threads);
+    }
+
+    result = rb_ary_new_capa(n);
+    for (idx = 0; idx < n; idx++)
+    {
+        rb_ary_store(result, idx, INT2NUM(counts[idx]));
+    }
+
+    if (sequential)
+    {
+        used = rb_ary_new_capa(n);
+        for (idx = 0; idx < n; idx++)
+        {
+            rb_ary_store(used, idx, INT2NUM(ctx.used[idx]));
+        }
+        counts_arr = result;
+        result = rb_hash_new();
+        rb_hash_aset(result, ID2SYM(rb_intern("counts")), counts_arr);
+        rb_hash_aset(result, ID2SYM(rb_intern("permutations")), used);
+    }
+
+    dvec_release(&factors_vec);
+    dvec_release(&permuted_vec);
+    dvec_release(&stat_vec);
+    ALLOCV_END(counts_v);
+    ALLOCV_END(used_v);
+    ALLOCV_END(totals_v);
+    ALLOCV_END(idsi_v);
+    ALLOCV_END(samples_v);
+    ALLOCV_END(swaps_v);
+    ALLOCV_END(stat_new_v);
+    ALLOCV_END(streams_v);
+    ALLOCV_END(values_v);
+    ALLOCV_END(rows_v);
+    release_labels(&labels);
+    RB_GC_GUARD(rids_bin);
+
+    return result;
+}
+
+/**
+ *  Conditional randomization kernel used by the local permutation tests.
+ *  For every observation, its value is held in place while the rest of
+ *  the observations are shuffled and its neighbors are sampled from them.
+ *  The permuted statistic is computed for every permutation and compared
+ *  to the original.
+ *
+ *  When +rids+ is the number of permutations, every observation draws
+ *  exactly as many samples as it has neighbors with a partial
+ *  Fisher-Yates shuffle, from its own xoshiro256** stream derived from
+ *  +rng+. Memory does not depend on the largest row, and results are
+ *  deterministic for a given seed no matter the number of threads.
+ *
+ *  When +rids+ is a matrix from +crand+, samples are selected through
+ *  it like the original ruby implementation. With 1 thread and a
+ *  +Random+, draws come from +rng+ in the same order, so a seeded
+ *  +Random+ gives the same results. Otherwise each thread shuffles
+ *  with its own xoshiro256** stream derived from +rng+, so results are
+ *  deterministic for a given seed and thread count.
+ *
+ *  With more than 1 thread, the GVL is released and observations are
+ *  split across native threads.
+ *
+ *  For reordered weights, +labels+ is the +permutation+ that gives the
+ *  key index of each row. Streams and samples are then numbered by key
+ *  instead of by row, so the counts are the same as for the weights in
+ *  key order, permuted like the rows.
+ *
+ *  @example
+ *      csr.local_mc(:moran, z, z, stat.stat, 99, 1234)
+ *      # => [12, 40, 3, ...]
+ *
+ *      rids = stat.crand(99, rng)
+ *      csr.local_mc(:moran, z, z, stat.stat, rids, rng)
+ *      # => [10, 42, 3, ...]
+ *
+ *  @param [Symbol] kind of stat. One of +:moran+, +:geary+, +:getis_ord+ or +:multivariate_geary+.
+ *  @param [Array, Numo::DFloat] factors per observation. The held value for moran and geary, denominator for getis_ord. An n x m matrix of the held attributes for multivariate_geary.
+ *  @param [Array, Numo::DFloat] permuted values that neighbors are sampled from. An n x m matrix for multivariate_geary.
+ *  @param [Array, Numo::DFloat] stat original value of the statistic at each observation.
+ *  @param [Integer, Numo::Int32] rids number of permutations, or a matrix from +crand+ of shape permutations x k.
+ *  @param [Integer, Random] rng seed of the native streams, or a rng to draw it from.
+ *  @param [Integer] threads to split observations across. Defaults to 1.
+ *  @param [Array, String, Numo::Int32] labels optional key index of each row, +permutation+ of reordered weights.
+ *
+ *  @return [Array] of the number of equal or more extreme permutations for each observation.
+ */
+VALUE csr_matrix_local_mc(int argc, VALUE *argv, VALUE self)
+{
+    return local_mc(argc, argv, self, 0);
+}
+
+/**
+ *  Sequential version of +local_mc+, that stops permuting an
+ *  observation once its count reaches +stop+, following Besag and
+ *  Clifford. Observations that are clearly not significant stop after
+ *  a few permutations, so the work goes to the borderline ones.
+ *
+ *  Samples are drawn the same way as +local_mc+ with a number of
+ *  permutations. The tail of each test has to be known before
+ *  permuting, so geary compares to the expected permuted value instead
+ *  of the mean of the permutations and getis_ord counts the smaller of
+ *  both tails.
+ *
+ *  @see https://doi.org/10.1093/biomet/78.2.301
+ *
+ *  @example
+ *      csr.local_mc_sequential(:moran, z, z, stat.stat, 9999, 1234, 500)
+ *      # => {counts: [500, 12, ...], permutations: [1043, 9999, ...]}
+ *
+ *  @param [Symbol] kind of stat, see +local_mc+.
+ *  @param [Array, Numo::DFloat] factors per observation, see +local_mc+.
+ *  @param [Array, Numo::DFloat] permuted values that neighbors are sampled from.
+ *  @param [Array, Numo::DFloat] stat original value of the statistic at each observation.
+ *  @param [Integer] permutations most to run for an observation.
+ *  @param [Integer, Random] rng seed of the native streams, or a rng to draw it from.
+ *  @param [Integer] stop count at which an observation stops.
+ *  @param [Integer] threads to split observations across. Defaults to 1.
+ *  @param [Array, String, Numo::Int32] labels optional key index of each row, see +local_mc+.
+ *
+ *  @return [Hash] +:counts+ of equal or more extreme permutations and +:permutations+ used for each observation.
+ */
+VALUE csr_matrix_local_mc_sequential(int argc, VALUE *argv, VALUE self)
+{
+    return local_mc(argc, argv, self, 1);
+}
+
+static int global_mc_chunk(void *ptr, int thread, int start, int stop,
+                            volatile int *interrupted)
+{
+    global_mc_ctx *ctx = (global_mc_ctx *)ptr;
+    const csr_matrix *csr = ctx->csr;
+    int n = csr->n;
+    double *shuffled = ctx->shuffled + (long)thread * n;
+    double *gathered = ctx->gathered + (long)thread * n;
+    double *lags = ctx->lags + (long)thread * n;
+    const double *source = ctx->keyed ? ctx->keyed : ctx->permuted;
+    const double *x = ctx->labels ? gathered : shuffled;
+    xoshiro256_state rng;
+    int p;
+    int i;
+    long t;
+    long j;
+    double tmp;
+    double numerator;
+
+    for (p = start; p < stop; p++)
+    {
+        if (*interrupted)
+        {
+            return p;
+        }
+
+        for (i = 0; i < n; i++)
+        {
+            shuffled[i] = source[i];
+        }
+
+        xoshiro256_seed_stream(&rng, ctx->seed, ctx->offset + (uint64_t)p);
+        t = n;
+        while (t)
+        {
+            j = (long)xoshiro256_bounded(&rng, (uint64_t)t);
+            t--;
+            tmp = shuffled[t];
+            shuffled[t] = shuffled[j];
+            shuffled[j] = tmp;
+        }
+
+        if (ctx->labels)
+        {
+            for (i = 0; i < n; i++)
+            {
+                gathered[i] = shuffled[ctx->labels[i]];
+            }
+        }
+
+        // factors.dot(W * shuffled)
+        csr_matrix_spmv(csr, x, lags);
+        numerator = 0;
+        for (i = 0; i < n; i++)
+        {
+            numerator += ctx->factors[i] * lags[i];
+        }
+        ctx->result[p] = numerator / ctx->denominator;
+    }
+    return stop;
+}
+
+/**
+ *  Permutation kernel used by the global moran statistics. Every
+ *  permutation shuffles +permuted+, lags it and computes
+ *  +factors.dot(lag) / factors.dot(factors)+.
+ *
+ *  The GVL is released and permutations are split across native
+ *  threads. Every permutation shuffles with its own xoshiro256** stream
+ *  derived from +seed+, so results are deterministic for a given seed
+ *  no matter the number of threads. The streams are numbered from
+ *  +offset+, so a later call with the same seed continues with the
+ *  permutations after the ones already run.
+ *
+ *  For reordered weights, +labels+ is the +permutation+ that gives the
+ *  key index of each row. +permuted+ is then shuffled in key order, so
+ *  the permutations are the same as for the weights in key order.
+ *
+ *  @example
+ *      csr.global_mc(z, z, 99, 1234, 4)
+ *      # => [-0.12, 0.03, ...]
+ *
+ *      # the same 99 permutations in two batches
+ *      csr.global_mc(z, z, 49, 1234, 4) + csr.global_mc(z, z, 50, 1234, 4, 49)
+ *
+ *  @param [Array, Numo::DFloat] factors held in place. z for moran, x for bivariate moran.
+ *  @param [Array, Numo::DFloat] permuted values that are shuffled and lagged.
+ *  @param [Integer] permutations to run.
+ *  @param [Integer, Random] seed of the native streams, or a rng to draw it from.
+ *  @param [Integer] threads to split permutations across. Defaults to 1.
+ *  @param [Integer] offset number of the first permutation's stream. Defaults to 0.
+ *  @param [Array, String, Numo::Int32] labels optional key index of each row, +permutation+ of reordered weights.
+ *
+ *  @return [Array] of the permuted statistics.
+ */
+VALUE csr_matrix_global_mc(int argc, VALUE *argv, VALUE self)
+{
+    VALUE factors, permuted, permutations_v, rng, threads_v, offset_v, labels_v;
+    csr_matrix *csr;
+    global_mc_ctx ctx;
+    VALUE result;
+    VALUE result_v, shuffled_v, gathered_v, lags_v, rows_v, keyed_v;
+    dvec factors_vec, permuted_vec;
+    ivec labels;
+    int *rows;
+    double *keyed;
+
+    double *result_arr;
+    double denominator;
+
+    int n;
+    int permutations;
+    int threads;
+    int i;
+
+    rb_scan_args(argc, argv, "43", &factors, &permuted, &permutations_v, &rng,
+                 &threads_v, &offset_v, &labels_v);
+
+    TypedData_Get_Struct(self, csr_matrix, &csr_matrix_type, csr);
+    csr_matrix_check_square(csr);
+    n = csr->n;
+
+    permutations = NUM2INT(permutations_v);
+    if (permutations < 1)
+    {
+        rb_raise(rb_eArgError, "permutations must be >= 1");
+    }
+    threads = NIL_P(threads_v) ? 1 : parallel_threads(threads_v, permutations);
+
+    dvec_read(&factors_vec, factors, n);
+    dvec_read(&permuted_vec, permuted, n);
+    rows = read_labels(labels_v, n, &labels,
+                       ALLOCV_N(int, rows_v, NIL_P(labels_v) || n < 1 ? 1 : n));
+
+    result_arr = ALLOCV_N(double, result_v, permutations);
+    ctx.shuffled = ALLOCV_N(double, shuffled_v, (long)threads * n);
+    ctx.gathered = ALLOCV_N(double, gathered_v, rows ? (long)threads * n : 1);
+    ctx.lags = ALLOCV_N(double, lags_v, (long)threads * n);
+    keyed = ALLOCV_N(double, keyed_v, rows ? n : 1);
+    for (i = 0; rows && i < n; i++)
+    {
+        keyed[i] = permuted_vec.ptr[rows[i]];
+    }
+    ctx.labels = labels.ptr;
+    ctx.keyed = rows ? keyed : NULL;
+
+    denominator = 0;
+    for (i = 0; i < n; i++)
+    {
+        denominator += factors_vec.ptr[i] * factors_vec.ptr[i];
+    }
+
+    ctx.csr = csr;
+    ctx.factors = factors_vec.ptr;
+    ctx.permuted = permuted_vec.ptr;
+    ctx.denominator = denominator;
+    ctx.result = result_arr;
+    ctx.seed = stream_seed(rng);
+    ctx.offset = NIL_P(offset_v) ? 0 : NUM2ULL(offset_v);
+    // cached before the threads read it
+    csr_matrix_row_length(csr);
+
+    parallel_for(global_mc_chunk, &ctx, permutations, threads);
+
+    result = rb_ary_new_capa(permutations);
+    for (i = 0; i < permutations; i++)
+    {
+        rb_ary_store(result, i, DBL2NUM(result_arr[i]));
+    }
+
+    dvec_release(&factors_vec);
+    dvec_release(&permuted_vec);
+    ALLOCV_END(result_v);
+    ALLOCV_END(shuffled_v);
+    ALLOCV_END(gathered_v);
+    ALLOCV_END(lags_v);
+    ALLOCV_END(keyed_v);
+    ALLOCV_END(rows_v);
+    release_labels(&labels);
+
+    return result;
+}
@@ -0,0 +1,16 @@
+#ifndef PERMUTATION
+#define PERMUTATION
+
+typedef enum mc_kind
+{
+    MC_MORAN,
+    MC_GEARY,
+    MC_GETIS_ORD,
+    MC_MULTIVARIATE_GEARY
+} mc_kind;
+
+mc_kind parse_mc_kind(VALUE kind);
+VALUE csr_matrix_local_mc(int argc, VALUE *argv, VALUE self);
+VALUE csr_matrix_local_mc_sequential(int argc, VALUE *argv, VALUE self);
+VALUE csr_matrix_global_mc(int argc, VALUE *argv, VALUE self);
+#endif
@@ -0,0 +1,605 @@
+#include <ruby.h>
+#include <limits.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "csr_matrix.h"
+#include "dvec.h"
+#include "point_index.h"
+
+// cells per point the grid is allowed to grow to, so a small bandwidth
+// over a wide extent does not allocate a huge empty grid.
+#define POINT_GRID_MAX_FILL 4
+
+// bits of each coordinate in the Hilbert index, so the index and the
+// point fit in one 64 bit sort key
+#define POINT_HILBERT_BITS 16
+
+typedef struct point_neighbor
+{
+    int j;
+    double d;
+} point_neighbor;
+
+static long point_coords_len(VALUE obj)
+{
+    if (RB_TYPE_P(obj, T_STRING))
+    {
+        return RSTRING_LEN(obj) / (long)sizeof(double);
+    }
+    return NUM2LONG(rb_funcall(obj, rb_intern("size"), 0));
+}
+
+static int point_valid(const point_grid *grid, int i)
+{
+    return isfinite(grid->x[i]) && isfinite(grid->y[i]);
+}
+
+static int point_cell_x(const point_grid *grid, double x)
+{
+    int cx = (int)((x - grid->min_x) / grid->cell);
+    return cx < grid->nx ? cx : grid->nx - 1;
+}
+
+static int point_cell_y(const point_grid *grid, double y)
+{
+    int cy = (int)((y - grid->min_y) / grid->cell);
+    return cy < grid->ny ? cy : grid->ny - 1;
+}
+
+/**
+ *  Bucket the points into a grid of square cells of at least +cell+
+ *  width. If +cell+ is not positive the width is picked so each cell
+ *  holds about +fill+ points. The cells are widened until there are at
+ *  most POINT_GRID_MAX_FILL cells per point.
+ *
+ *  The arrays are temporary buffers held by +tmp+.
+ */
+static void point_grid_build(point_grid *grid, const double *x, const double *y,
+                             int n, double cell, double fill, VALUE *tmp)
+{
+    double max_x = -INFINITY;
+    double max_y = -INFINITY;
+    double width;
+    double height;
+    double cells;
+    int valid = 0;
+    int *next;
+    long ncells;
+    long c;
+    int i;
+
+    grid->x = x;
+    grid->y = y;
+    grid->n = n;
+    grid->min_x = INFINITY;
+    grid->min_y = INFINITY;
+
+    for (i = 0; i < n; i++)
+    {
+        if (!point_valid(grid, i))
+        {
+            continue;
+        }
+        valid++;
+        grid->min_x = x[i] < grid->min_x ? x[i] : grid->min_x;
+        grid->min_y = y[i] < grid->min_y ? y[i] : grid->min_y;
+        max_x = x[i] > max_x ? x[i] : max_x;
+        max_y = y[i] > max_y ? y[i] : max_y;
+    }
+    if (valid == 0)
+    {
+        grid->min_x = grid->min_y = max_x = max_y = 0;
+    }
+
+    width = max_x - grid->min_x;
+    height = max_y - grid->min_y;
+    if (!(cell > 0))
+    {
+        if (width > 0 && height > 0)
+        {
+            cell = sqrt(width * height * fill / (valid > 0 ? valid : 1));
+        }
+        else
+        {
+            cell = (width > height ? width : height) * fill / (valid > 0 ? valid : 1);
+        }
+    }
+    if (!(cell > 0) || !isfinite(cell))
+    {
+        cell = 1;
+    }
+
+    cells = (floor(width / cell) + 1) * (floor(height / cell) + 1);
+    while (cells > (double)POINT_GRID_MAX_FILL * valid + 1)
+    {
+        cell *= 2;
+        cells = (floor(width / cell) + 1) * (floor(height / cell) + 1);
+    }
+    grid->cell = cell;
+    grid->nx = (int)floor(width / cell) + 1;
+    grid->ny = (int)floor(height / cell) + 1;
+    ncells = (long)grid->nx * grid->ny;
+
+    // tmp holds cell_start, then points, then the fill cursors
+    grid->cell_start = (int *)rb_alloc_tmp_buffer(tmp, (long)sizeof(int) * (2 * ncells + 1 + (n > 0 ? n : 1)));
+    grid->points = grid->cell_start + ncells + 1;
+    next = grid->points + (n > 0 ? n : 1);
+
+    memset(grid->cell_start, 0, sizeof(int) * (ncells + 1));
+    for (i = 0; i < n; i++)
+    {
+        if (point_valid(grid, i))
+        {
+            c = (long)point_cell_y(grid, y[i]) * grid->nx + point_cell_x(grid, x[i]);
+            grid->cell_start[c + 1]++;
+        }
+    }
+    for (c = 0; c < ncells; c++)
+    {
+        grid->cell_start[c + 1] += grid->cell_start[c];
+        next[c] = grid->cell_start[c];
+    }
+    for (i = 0; i < n; i++)
+    {
+        if (point_valid(grid, i))
+        {
+            c = (long)point_cell_y(grid, y[i]) * grid->nx + point_cell_x(grid, x[i]);
+            grid->points[next[c]++] = i;
+        }
+    }
+}
+
+static int point_neighbor_cmp(const void *a, const void *b)
+{
+    int ja = ((const point_neighbor *)a)->j;
+    int jb = ((const point_neighbor *)b)->j;
+    return (ja > jb) - (ja < jb);
+}
+
+// a is a worse neighbor than b, farther or as far with a higher index
+static int point_neighbor_worse(const point_neighbor *a, const point_neighbor *b)
+{
+    return a->d > b->d || (a->d == b->d && a->j > b->j);
+}
+
+// Offer j at distance d to the max heap of the k nearest neighbors.
+static void point_heap_offer(point_neighbor *heap, int *size, int k, int j, double d)
+{
+    point_neighbor cand = {j, d};
+    point_neighbor tmp;
+    int pos;
+    int child;
+
+    if (*size < k)
+    {
+        pos = (*size)++;
+        heap[pos] = cand;
+        while (pos > 0 && point_neighbor_worse(&heap[pos], &heap[(pos - 1) / 2]))
+        {
+            tmp = heap[pos];
+            heap[pos] = heap[(pos - 1) / 2];
+            heap[(pos - 1) / 2] = tmp;
+            pos = (pos - 1) / 2;
+        }
+        return;
+    }
+    if (!point_neighbor_worse(&heap[0], &cand))
+    {
+        return;
+    }
+
+    heap[0] = cand;
+    pos = 0;
+    for (;;)
+    {
+        child = 2 * pos + 1;
+        if (child >= k)
+        {
+            break;
+        }
+        if (child + 1 < k && point_neighbor_worse(&heap[child + 1], &heap[child]))
+        {
+            child++;
+        }
+        if (!point_neighbor_worse(&heap[child], &heap[pos]))
+        {
+            break;
+        }
+        tmp = heap[pos];
+        heap[pos] = heap[child];
+        heap[child] = tmp;
+        pos = child;
+    }
+}
+
+static double point_distance(const point_grid *grid, int i, int j)
+{
+    double dx = grid->x[i] - grid->x[j];
+    double dy = grid->y[i] - grid->y[j];
+    return sqrt(dx * dx + dy * dy);
+}
+
+// Append a row of neighbors, sorted by index, to the packed results.
+static void point_pairs_append(VALUE result[3], int i, point_neighbor *row, int count)
+{
+    int k;
+    int32_t idx;
+
+    qsort(row, count, sizeof(point_neighbor), point_neighbor_cmp);
+    for (k = 0; k < count; k++)
+    {
+        idx = i;
+        rb_str_cat(result[0], (const char *)&idx, sizeof(int32_t));
+        idx = row[k].j;
+        rb_str_cat(result[1], (const char *)&idx, sizeof(int32_t));
+        rb_str_cat(result[2], (const char *)&row[k].d, sizeof(double));
+    }
+}
+
+static VALUE point_pairs_result(VALUE result[3])
+{
+    VALUE hash = rb_hash_new();
+    rb_hash_aset(hash, ID2SYM(rb_intern("i_idx")), result[0]);
+    rb_hash_aset(hash, ID2SYM(rb_intern("j_idx")), result[1]);
+    rb_hash_aset(hash, ID2SYM(rb_intern("distance")), result[2]);
+    return hash;
+}
+
+static void point_coords_read(dvec *xs, dvec *ys, VALUE x, VALUE y, int *n)
+{
+    long len = point_coords_len(x);
+
+    if (len != point_coords_len(y))
+    {
+        rb_raise(rb_eArgError, "Dimension Mismatch x.size != y.size");
+    }
+    if (len > INT_MAX)
+    {
+        rb_raise(rb_eArgError, "too many points");
+    }
+    *n = (int)len;
+    dvec_read(xs, x, len);
+    dvec_read(ys, y, len);
+}
+
+/**
+ *  The k nearest neighbors of every point, found with a grid index over
+ *  the points instead of comparing every pair. Distances are planar, the
+ *  same as ST_Distance on geometries in a projected SRID. Ties are broken
+ *  by the lower index.
+ *
+ *  The result is in the format of +Queries::Weights.neighbor_indices+,
+ *  packed pairs sorted by row then column, so it can go straight into
+ *  +CSRMatrix.from_coo+. Points with a coordinate that is not finite,
+ *  like null geometries queried as NaN, have no neighbors.
+ *
+ *  @example
+ *      pairs = CSRMatrix.knn_pairs([0, 1, 3], [0, 0, 0], 1)
+ *      pairs[:j_idx].unpack('l*')
+ *      # => [1, 0, 1]
+ *
+ *  @param [Array, Numo::DFloat, String] x coordinate of each point.
+ *  @param [Array, Numo::DFloat, String] y coordinate of each point.
+ *  @param [Integer] k neighbors to find for each point.
+ *
+ *  @return [Hash] of packed int32 +:i_idx+ and +:j_idx+ and packed double +:distance+
+ */
+VALUE csr_matrix_knn_pairs(VALUE klass, VALUE x, VALUE y, VALUE k_v)
+{
+    dvec xs;
+    dvec ys;
+    point_grid grid;
+    VALUE grid_tmp = 0;
+    VALUE heap_v;
+    VALUE result[3];
+    point_neighbor *heap;
+    int n;
+    int k = NUM2INT(k_v);
+    int valid = 0;
+    int size;
+    int i;
+    int q;
+    int cx, cy;
+    int gx, gy;
+    int step;
+    int pt;
+    int j;
+    long c;
+
+    if (k < 1)
+    {
+        rb_raise(rb_eArgError, "k must be >= 1");
+    }
+    point_coords_read(&xs, &ys, x, y, &n);
+    point_grid_build(&grid, xs.ptr, ys.ptr, n, 0, k, &grid_tmp);
+    for (i = 0; i < n; i++)
+    {
+        valid += point_valid(&grid, i);
+    }
+    k = k < valid - 1 ? k : valid - 1;
+
+    result[0] = rb_str_buf_new((long)n * (k > 0 ? k : 0) * sizeof(int32_t));
+    result[1] = rb_str_buf_new((long)n * (k > 0 ? k : 0) * sizeof(int32_t));
+    result[2] = rb_str_buf_new((long)n * (k > 0 ? k : 0) * sizeof(double));
+    heap = ALLOCV_N(point_neighbor, heap_v, k > 0 ? k : 1);
+
+    for (i = 0; i < n && k > 0; i++)
+    {
+        if (!point_valid(&grid, i))
+        {
+            continue;
+        }
+        cx = point_cell_x(&grid, grid.x[i]);
+        cy = point_cell_y(&grid, grid.y[i]);
+        size = 0;
+
+        // visit rings of cells around the point. Points outside ring q
+        // are at least q cells away, so once the heap is full and its
+        // worst neighbor is closer than that, no other point can enter.
+        for (q = 0;; q++)
+        {
+            for (gy = cy - q; gy <= cy + q; gy++)
+            {
+                if (gy < 0 || gy >= grid.ny)
+                {
+                    continue;
+                }
+                step = (gy == cy - q || gy == cy + q) ? 1 : 2 * q;
+                for (gx = cx - q; gx <= cx + q; gx += step > 0 ? step : 1)
+                {
+                    if (gx < 0 || gx >= grid.nx)
+                    {
+                        continue;
+                    }
+                    c = (long)gy * grid.nx + gx;
+                    for (pt = grid.cell_start[c]; pt < grid.cell_start[c + 1]; pt++)
+                    {
+                        j = grid.points[pt];
+                        if (j != i)
+                        {
+                            point_heap_offer(heap, &size, k, j, point_distance(&grid, i, j));
+                        }
+                    }
+                }
+            }
+            if ((size == k && heap[0].d < q * grid.cell) ||
+                (q >= grid.nx && q >= grid.ny))
+            {
+                break;
+            }
+        }
+        point_pairs_append(result, i, heap, size);
+    }
+
+    ALLOCV_END(heap_v);
+    rb_free_tmp_buffer(&grid_tmp);
+    dvec_release(&xs);
+    dvec_release(&ys);
+
+    return point_pairs_result(result);
+}
+
+/**
+ *  The neighbors of every point within +bandwidth+, found with a grid
+ *  index over the points instead of comparing every pair. Distances are
+ *  planar and the band includes its bound, the same as ST_DWithin on
+ *  geometries in a projected SRID.
+ *
+ *  The result is in the format of +Queries::Weights.neighbor_indices+,
+ *  packed pairs sorted by row then column, so it can go straight into
+ *  +CSRMatrix.from_coo+. Points with a coordinate that is not finite,
+ *  like null geometries queried as NaN, have no neighbors.
+ *
+ *  @example
+ *      pairs = CSRMatrix.band_pairs([0, 1, 3], [0, 0, 0], 1)
+ *      pairs[:i_idx].unpack('l*')
+ *      # => [0, 1]
+ *
+ *  @param [Array, Numo::DFloat, String] x coordinate of each point.
+ *  @param [Array, Numo::DFloat, String] y coordinate of each point.
+ *  @param [Numeric] bandwidth to find neighbors in.
+ *
+ *  @return [Hash] of packed int32 +:i_idx+ and +:j_idx+ and packed double +:distance+
+ */
+VALUE csr_matrix_band_pairs(VALUE klass, VALUE x, VALUE y, VALUE bandwidth_v)
+{
+    dvec xs;
+    dvec ys;
+    point_grid grid;
+    VALUE grid_tmp = 0;
+    VALUE row_v;
+    VALUE result[3];
+    point_neighbor *row;
+    double bandwidth = NUM2DBL(bandwidth_v);
+    double d;
+    int n;
+    int count;
+    int reach;
+    int i;
+    int cx, cy;
+    int gx, gy;
+    int pt;
+    int j;
+    long c;
+
+    if (!(bandwidth >= 0) || !isfinite(bandwidth))
+    {
+        rb_raise(rb_eArgError, "bandwidth must be >= 0");
+    }
+    point_coords_read(&xs, &ys, x, y, &n);
+    point_grid_build(&grid, xs.ptr, ys.ptr, n, bandwidth, 1, &grid_tmp);
+    reach = (int)ceil(bandwidth / grid.cell);
+
+    result[0] = rb_str_buf_new(0);
+    result[1] = rb_str_buf_new(0);
+    result[2] = rb_str_buf_new(0);
+    row = ALLOCV_N(point_neighbor, row_v, n > 0 ? n : 1);
+
+    for (i = 0; i < n; i++)
+    {
+        if (!point_valid(&grid, i))
+        {
+            continue;
+        }
+        cx = point_cell_x(&grid, grid.x[i]);
+        cy = point_cell_y(&grid, grid.y[i]);
+        count = 0;
+
+        for (gy = cy - reach; gy <= cy + reach; gy++)
+        {
+            if (gy < 0 || gy >= grid.ny)
+            {
+                continue;
+            }
+            for (gx = cx - reach; gx <= cx + reach; gx++)
+            {
+                if (gx < 0 || gx >= grid.nx)
+                {
+                    continue;
+                }
+                c = (long)gy * grid.nx + gx;
+                for (pt = grid.cell_start[c]; pt < grid.cell_start[c + 1]; pt++)
+                {
+                    j = grid.points[pt];
+                    d = point_distance(&grid, i, j);
+                    if (j != i && d <= bandwidth)
+                    {
+                        row[count].j = j;
+                        row[count++].d = d;
+                    }
+                }
+            }
+        }
+        point_pairs_append(result, i, row, count);
+    }
+
+    ALLOCV_END(row_v);
+    rb_free_tmp_buffer(&grid_tmp);
+    dvec_release(&xs);
+    dvec_release(&ys);
+
+    return point_pairs_result(result);
+}
+
+// Distance of cell (x, y) along a Hilbert curve filling a grid of
+// side 2**POINT_HILBERT_BITS.
+static uint64_t point_hilbert_index(uint32_t x, uint32_t y)
+{
+    uint32_t side = (uint32_t)1 << POINT_HILBERT_BITS;
+    uint32_t rx, ry, s, t;
+    uint64_t d = 0;
+
+    for (s = side / 2; s > 0; s /= 2)
+    {
+        rx = (x & s) > 0;
+        ry = (y & s) > 0;
+        d += (uint64_t)s * s * ((3 * rx) ^ ry);
+        // rotate the quadrant so the curve stays continuous
+        if (ry == 0)
+        {
+            if (rx == 1)
+            {
+                x = side - 1 - x;
+                y = side - 1 - y;
+            }
+            t = x;
+            x = y;
+            y = t;
+        }
+    }
+    return d;
+}
+
+static int point_key_cmp(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ *  Order of the points along a Hilbert curve over their bounding box,
+ *  for +CSRMatrix#permute+. Points that are close in space are close
+ *  in the order, so weights between them are numbered close to each
+ *  other. Points with a coordinate that is not finite come last, in
+ *  their input order.
+ *
+ *  @see https://en.wikipedia.org/wiki/Hilbert_curve
+ *
+ *  @example
+ *      CSRMatrix.hilbert_order([0, 1, 0, 1], [0, 1, 1, 0])
+ *      # => [0, 2, 1, 3]
+ *
+ *  @param [Array, Numo::DFloat, String] x coordinate of each point.
+ *  @param [Array, Numo::DFloat, String] y coordinate of each point.
+ *
+ *  @return [Array] point of each position, a permutation of 0...n.
+ */
+VALUE csr_matrix_hilbert_order(VALUE klass, VALUE x, VALUE y)
+{
+    dvec xs;
+    dvec ys;
+    VALUE result;
+    VALUE keys_v;
+    uint64_t *keys;
+    double min_x = INFINITY;
+    double min_y = INFINITY;
+    double max_x = -INFINITY;
+    double max_y = -INFINITY;
+    double extent;
+    double scale;
+    uint32_t cx, cy;
+    int n;
+    int valid = 0;
+    int pos;
+    int i;
+
+    point_coords_read(&xs, &ys, x, y, &n);
+    for (i = 0; i < n; i++)
+    {
+        if (isfinite(xs.ptr[i]) && isfinite(ys.ptr[i]))
+        {
+            min_x = xs.ptr[i] < min_x ? xs.ptr[i] : min_x;
+            min_y = ys.ptr[i] < min_y ? ys.ptr[i] : min_y;
+            max_x = xs.ptr[i] > max_x ? xs.ptr[i] : max_x;
+            max_y = ys.ptr[i] > max_y ? ys.ptr[i] : max_y;
+        }
+    }
+
+    // one scale for both axes keeps cells square
+    extent = max_x - min_x > max_y - min_y ? max_x - min_x : max_y - min_y;
+    scale = extent > 0 ? (double)(((uint32_t)1 << POINT_HILBERT_BITS) - 1) / extent : 0;
+
+    keys = ALLOCV_N(uint64_t, keys_v, n > 0 ? n : 1);
+    for (i = 0; i < n; i++)
+    {
+        if (isfinite(xs.ptr[i]) && isfinite(ys.ptr[i]))
+        {
+            cx = (uint32_t)((xs.ptr[i] - min_x) * scale);
+            cy = (uint32_t)((ys.ptr[i] - min_y) * scale);
+            keys[valid++] = (point_hilbert_index(cx, cy) << 32) | (uint32_t)i;
+        }
+    }
+    qsort(keys, valid, sizeof(uint64_t), point_key_cmp);
+
+    result = rb_ary_new_capa(n);
+    for (pos = 0; pos < valid; pos++)
+    {
+        rb_ary_store(result, pos, INT2NUM((int)(keys[pos] & 0xffffffff)));
+    }
+    for (i = 0; i < n; i++)
+    {
+        if (!(isfinite(xs.ptr[i]) && isfinite(ys.ptr[i])))
+        {
+            rb_ary_store(result, pos++, INT2NUM(i));
+        }
+    }
+
+    ALLOCV_END(keys_v);
+    dvec_release(&xs);
+    dvec_release(&ys);
+
+    return result;
+}
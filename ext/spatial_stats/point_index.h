@@ -0,0 +1,25 @@
+#ifndef POINT_INDEX
+#define POINT_INDEX
+
+// Uniform grid over planar points. Points are bucketed by cell with a
+// counting sort, so the points of cell c are
+// points[cell_start[c]...cell_start[c + 1]]. Points with a coordinate
+// that is not finite are left out and never have neighbors.
+typedef struct point_grid
+{
+    const double *x;
+    const double *y;
+    int n;
+    double min_x;
+    double min_y;
+    double cell;
+    int nx;
+    int ny;
+    int *cell_start;
+    int *points;
+} point_grid;
+
+VALUE csr_matrix_knn_pairs(VALUE klass, VALUE x, VALUE y, VALUE k);
+VALUE csr_matrix_band_pairs(VALUE klass, VALUE x, VALUE y, VALUE bandwidth);
+VALUE csr_matrix_hilbert_order(VALUE klass, VALUE x, VALUE y);
+#endif
@@ -0,0 +1,363 @@
+#include <ruby.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "csr_matrix.h"
+#include "dvec.h"
+#include "reorder.h"
+
+// times the root of a component is moved to the far end of its
+// deepest level looking for a pseudo peripheral node
+#define RCM_MAX_ROOT_SEARCH 8
+
+// Neighbors of each node in the pattern of W + W^T. The row of i is
+// col_index[row_index[i]...row_index[i + 1]], the entries of W^T are
+// rows[row_start[i]...row_start[i + 1]]. degree leaves out self loops.
+typedef struct rcm_graph
+{
+    const csr_matrix *csr;
+    const int64_t *row_start;
+    const int *rows;
+    const int64_t *degree;
+} rcm_graph;
+
+static int rcm_key_cmp(const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *)a;
+    int64_t y = *(const int64_t *)b;
+    return (x > y) - (x < y);
+}
+
+// sort key of node i, by degree then index
+static int64_t rcm_key(const rcm_graph *g, int i)
+{
+    int64_t degree = g->degree[i] < INT32_MAX ? g->degree[i] : INT32_MAX;
+    return degree * ((int64_t)1 << 32) + i;
+}
+
+// Breadth first search from root over the nodes that are not placed,
+// stamping them in mark. Writes the count nodes it reaches into queue,
+// with the start of the deepest level in last, and returns the depth.
+static int rcm_bfs(const rcm_graph *g, int root, const char *placed, int *mark,
+                   int stamp, int *queue, int *count, int *last)
+{
+    const csr_matrix *csr = g->csr;
+    int head = 0;
+    int tail = 1;
+    int level_end = 1;
+    int depth = 0;
+    int u;
+    int v;
+    int64_t jj;
+
+    queue[0] = root;
+    mark[root] = stamp;
+    *last = 0;
+    while (head < tail)
+    {
+        if (head == level_end)
+        {
+            *last = head;
+            level_end = tail;
+            depth++;
+        }
+        u = queue[head++];
+        for (jj = csr->row_index[u]; jj < csr->row_index[u + 1]; jj++)
+        {
+            v = csr->col_index[jj];
+            if (!placed[v] && mark[v] != stamp)
+            {
+                mark[v] = stamp;
+                queue[tail++] = v;
+            }
+        }
+        for (jj = g->row_start[u]; jj < g->row_start[u + 1]; jj++)
+        {
+            v = g->rows[jj];
+            if (!placed[v] && mark[v] != stamp)
+            {
+                mark[v] = stamp;
+                queue[tail++] = v;
+            }
+        }
+    }
+    *count = tail;
+    return depth;
+}
+
+/**
+ *  Permuted copy of the matrix, P * W * P^T. Row and column r of the
+ *  result are row and column perm[r] of the receiver, so it is the
+ *  same matrix with its observations relabeled. Entries keep their
+ *  order within a row, so products with permuted vectors sum in the
+ *  same order. The receiver is not modified.
+ *
+ *  @example
+ *      csr.permute([2, 0, 1]).mulvec(vec.values_at(2, 0, 1))
+ *      # => csr.mulvec(vec).values_at(2, 0, 1)
+ *
+ *  @param [Array, String, Numo::Int32] perm observation of each new row, a permutation of 0...n.
+ *
+ *  @return [CSRMatrix]
+ */
+VALUE csr_matrix_permute(VALUE self, VALUE perm_v)
+{
+    csr_matrix *csr;
+    ivec perm;
+    csr_matrix *permuted;
+    VALUE result;
+    VALUE inverse_v;
+    int *inverse;
+    int *col_index;
+    int64_t *row_index;
+    int64_t start;
+    int64_t len;
+    int n;
+    int r;
+    int64_t jj;
+
+    TypedData_Get_Struct(self, csr_matrix, &csr_matrix_type, csr);
+    csr_matrix_check_square(csr);
+    n = csr->n;
+
+    ivec_read(&perm, perm_v);
+    if (perm.len != n)
+    {
+        rb_raise(rb_eArgError, "Dimension Mismatch perm.size != n");
+    }
+
+    inverse = ALLOCV_N(int, inverse_v, n > 0 ? n : 1);
+    memset(inverse, -1, sizeof(int) * n);
+    for (r = 0; r < n; r++)
+    {
+        if (perm.ptr[r] < 0 || perm.ptr[r] >= n || inverse[perm.ptr[r]] != -1)
+        {
+            rb_raise(rb_eArgError, "Index Error perm must be a permutation of 0...n");
+        }
+        inverse[perm.ptr[r]] = r;
+    }
+
+    result = csr_matrix_new(rb_obj_class(self), n, n, csr->nnz, csr->values_type);
+    TypedData_Get_Struct(result, csr_matrix, &csr_matrix_type, permuted);
+    col_index = permuted->col_index;
+    row_index = permuted->row_index;
+
+    row_index[0] = 0;
+    for (r = 0; r < n; r++)
+    {
+        start = csr->row_index[perm.ptr[r]];
+        len = csr->row_index[perm.ptr[r] + 1] - start;
+        row_index[r + 1] = row_index[r] + len;
+
+        for (jj = 0; jj < len; jj++)
+        {
+            col_index[row_index[r] + jj] = inverse[csr->col_index[start + jj]];
+        }
+        if (permuted->values)
+        {
+            memcpy(permuted->values + row_index[r], csr->values + start, sizeof(double) * len);
+        }
+        else if (permuted->values32)
+        {
+            memcpy(permuted->values32 + row_index[r], csr->values32 + start, sizeof(float) * len);
+        }
+    }
+
+    ALLOCV_END(inverse_v);
+    ivec_release(&perm);
+
+    return result;
+}
+
+/**
+ *  Reverse Cuthill-McKee ordering of the observations, for +permute+.
+ *  Neighbors are numbered close to each other, which narrows the band
+ *  the entries of the permuted matrix fall in, so products gather from
+ *  nearby memory instead of all over the vector.
+ *
+ *  The graph is the pattern of W + W^T, so weights that are not
+ *  symmetric are ordered by both directions. Every connected component
+ *  starts from a pseudo peripheral node, found from its node of lowest
+ *  degree, and neighbors are visited by increasing degree, then index.
+ *
+ *  @see https://en.wikipedia.org/wiki/Cuthill%E2%80%93McKee_algorithm
+ *
+ *  @example
+ *      perm = csr.rcm
+ *      csr.permute(perm)
+ *
+ *  @return [Array] observation of each new row, a permutation of 0...n.
+ */
+VALUE csr_matrix_rcm(VALUE self)
+{
+    csr_matrix *csr;
+    rcm_graph g;
+    VALUE result;
+    VALUE row_start_v, rows_v, degree_v, keys_v, added_v, placed_v, mark_v, queue_v, order_v;
+    int64_t *row_start;
+    int *rows;
+    int64_t *degree;
+    int64_t *keys;
+    int64_t *added_keys;
+    char *placed;
+    int *mark;
+    int *queue;
+    int *order;
+    int n;
+    int i;
+    int k;
+    int u;
+    int v;
+    int root;
+    int best;
+    int count;
+    int last;
+    int depth;
+    int new_depth;
+    int search;
+    int stamp = 0;
+    int pos = 0;
+    int head;
+    int added;
+    int64_t jj;
+    int64_t nnz_alloc;
+
+    TypedData_Get_Struct(self, csr_matrix, &csr_matrix_type, csr);
+    csr_matrix_check_square(csr);
+    n = csr->n;
+    nnz_alloc = csr->nnz > 0 ? csr->nnz : 1;
+
+    // W^T with a counting sort by column, for the reverse direction
+    row_start = ALLOCV_N(int64_t, row_start_v, n + 1);
+    rows = ALLOCV_N(int, rows_v, nnz_alloc);
+    degree = ALLOCV_N(int64_t, degree_v, n > 0 ? n : 1);
+    memset(row_start, 0, sizeof(int64_t) * (n + 1));
+    memset(degree, 0, sizeof(int64_t) * n);
+    for (i = 0; i < n; i++)
+    {
+        for (jj = csr->row_index[i]; jj < csr->row_index[i + 1]; jj++)
+        {
+            row_start[csr->col_index[jj] + 1]++;
+            if (csr->col_index[jj] != i)
+            {
+                degree[i]++;
+                degree[csr->col_index[jj]]++;
+            }
+        }
+    }
+    for (i = 0; i < n; i++)
+    {
+        row_start[i + 1] += row_start[i];
+    }
+    // queue holds the fill cursor of each row of W^T until the search
+    queue = ALLOCV_N(int, queue_v, n > 0 ? n : 1);
+    memset(queue, 0, sizeof(int) * n);
+    for (i = 0; i < n; i++)
+    {
+        for (jj = csr->row_index[i]; jj < csr->row_index[i + 1]; jj++)
+        {
+            v = csr->col_index[jj];
+            rows[row_start[v] + queue[v]++] = i;
+        }
+    }
+
+    g.csr = csr;
+    g.row_start = row_start;
+    g.rows = rows;
+    g.degree = degree;
+
+    keys = ALLOCV_N(int64_t, keys_v, n > 0 ? n : 1);
+    added_keys = ALLOCV_N(int64_t, added_v, n > 0 ? n : 1);
+    placed = ALLOCV_N(char, placed_v, n > 0 ? n : 1);
+    mark = ALLOCV_N(int, mark_v, n > 0 ? n : 1);
+    order = ALLOCV_N(int, order_v, n > 0 ? n : 1);
+    memset(placed, 0, n);
+    for (i = 0; i < n; i++)
+    {
+        mark[i] = -1;
+        keys[i] = rcm_key(&g, i);
+    }
+    qsort(keys, n, sizeof(int64_t), rcm_key_cmp);
+
+    for (k = 0; k < n; k++)
+    {
+        root = (int)(keys[k] & 0xffffffff);
+        if (placed[root])
+        {
+            continue;
+        }
+
+        // move the root to the lowest degree node of its deepest level
+        // while that makes the component deeper
+        depth = rcm_bfs(&g, root, placed, mark, stamp++, queue, &count, &last);
+        for (search = 0; search < RCM_MAX_ROOT_SEARCH && depth > 0; search++)
+        {
+            best = queue[last];
+            for (i = last + 1; i < count; i++)
+            {
+                if (rcm_key(&g, queue[i]) < rcm_key(&g, best))
+                {
+                    best = queue[i];
+                }
+            }
+            new_depth = rcm_bfs(&g, best, placed, mark, stamp++, queue, &count, &last);
+            if (new_depth <= depth)
+            {
+                break;
+            }
+            root = best;
+            depth = new_depth;
+        }
+
+        // Cuthill-McKee, order doubles as the queue
+        head = pos;
+        order[pos++] = root;
+        placed[root] = 1;
+        while (head < pos)
+        {
+            u = order[head++];
+            added = 0;
+            for (jj = csr->row_index[u]; jj < csr->row_index[u + 1]; jj++)
+            {
+                v = csr->col_index[jj];
+                if (!placed[v])
+                {
+                    placed[v] = 1;
+                    added_keys[added++] = rcm_key(&g, v);
+                }
+            }
+            for (jj = row_start[u]; jj < row_start[u + 1]; jj++)
+            {
+                v = rows[jj];
+                if (!placed[v])
+                {
+                    placed[v] = 1;
+                    added_keys[added++] = rcm_key(&g, v);
+                }
+            }
+            qsort(added_keys, added, sizeof(int64_t), rcm_key_cmp);
+            for (i = 0; i < added; i++)
+            {
+                order[pos++] = (int)(added_keys[i] & 0xffffffff);
+            }
+        }
+    }
+
+    result = rb_ary_new_capa(n);
+    for (i = 0; i < n; i++)
+    {
+        rb_ary_store(result, i, INT2NUM(order[n - 1 - i]));
+    }
+
+    ALLOCV_END(row_start_v);
+    ALLOCV_END(rows_v);
+    ALLOCV_END(degree_v);
+    ALLOCV_END(keys_v);
+    ALLOCV_END(added_v);
+    ALLOCV_END(placed_v);
+    ALLOCV_END(mark_v);
+    ALLOCV_END(queue_v);
+    ALLOCV_END(order_v);
+
+    return result;
+}
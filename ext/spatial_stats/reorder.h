@@ -0,0 +1,6 @@
+#ifndef REORDER
+#define REORDER
+
+VALUE csr_matrix_permute(VALUE self, VALUE perm_v);
+VALUE csr_matrix_rcm(VALUE self);
+#endif
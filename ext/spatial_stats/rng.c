@@ -0,0 +1,71 @@
+#include "rng.h"
+
+static uint64_t splitmix64(uint64_t *x)
+{
+    uint64_t z = (*x += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+/**
+ *  Seed the generator by expanding seed with splitmix64, as recommended
+ *  by the xoshiro authors.
+ */
+void xoshiro256_seed(xoshiro256_state *state, uint64_t seed)
+{
+    int i;
+
+    for (i = 0; i < 4; i++)
+    {
+        state->s[i] = splitmix64(&seed);
+    }
+}
+
+/**
+ *  Seed the stream numbered counter of seed. The key mixes both with
+ *  splitmix64 instead of adding them, so the streams of seed + 1 are
+ *  not the streams of seed shifted by one counter.
+ */
+void xoshiro256_seed_stream(xoshiro256_state *state, uint64_t seed, uint64_t counter)
+{
+    uint64_t key = splitmix64(&seed) ^ counter;
+
+    xoshiro256_seed(state, splitmix64(&key));
+}
+
+/**
+ *  Advance the generator by 2^128 calls to next. Used to create
+ *  non-overlapping streams for each thread.
+ */
+void xoshiro256_jump(xoshiro256_state *state)
+{
+    static const uint64_t JUMP[] = {0x180ec6d33cfd0abaULL, 0xd5a61266f0c9392cULL,
+                                    0xa9582618e03fc9aaULL, 0x39abdc4529b1661cULL};
+    uint64_t s0 = 0;
+    uint64_t s1 = 0;
+    uint64_t s2 = 0;
+    uint64_t s3 = 0;
+    int i;
+    int b;
+
+    for (i = 0; i < 4; i++)
+    {
+        for (b = 0; b < 64; b++)
+        {
+            if (JUMP[i] & ((uint64_t)1 << b))
+            {
+                s0 ^= state->s[0];
+                s1 ^= state->s[1];
+                s2 ^= state->s[2];
+                s3 ^= state->s[3];
+            }
+            xoshiro256_next(state);
+        }
+    }
+
+    state->s[0] = s0;
+    state->s[1] = s1;
+    state->s[2] = s2;
+    state->s[3] = s3;
+}
@@ -0,0 +1,54 @@
+#ifndef RNG
+#define RNG
+
+#include <stdint.h>
+
+// xoshiro256** generator.
+// @see https://prng.di.unimi.it/xoshiro256starstar.c
+typedef struct xoshiro256_state
+{
+    uint64_t s[4];
+} xoshiro256_state;
+
+void xoshiro256_seed(xoshiro256_state *state, uint64_t seed);
+void xoshiro256_seed_stream(xoshiro256_state *state, uint64_t seed, uint64_t counter);
+void xoshiro256_jump(xoshiro256_state *state);
+
+static inline uint64_t xoshiro256_rotl(const uint64_t x, int k)
+{
+    return (x << k) | (x >> (64 - k));
+}
+
+static inline uint64_t xoshiro256_next(xoshiro256_state *state)
+{
+    uint64_t *s = state->s;
+    const uint64_t result = xoshiro256_rotl(s[1] * 5, 7) * 9;
+    const uint64_t t = s[1] << 17;
+
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+
+    s[2] ^= t;
+
+    s[3] = xoshiro256_rotl(s[3], 45);
+
+    return result;
+}
+
+// uniform integer in [0, range), range must be > 0.
+// rejects the values that would bias the modulo.
+static inline uint64_t xoshiro256_bounded(xoshiro256_state *state, uint64_t range)
+{
+    uint64_t r;
+    uint64_t threshold = (0 - range) % range;
+
+    do
+    {
+        r = xoshiro256_next(state);
+    } while (r < threshold);
+
+    return r % range;
+}
+#endif
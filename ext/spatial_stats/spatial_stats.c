@@ -1,5 +1,10 @@
 #include <ruby.h>
 #include "csr_matrix.h"
+#include "csr_file.h"
+#include "local_stats.h"
+#include "permutation.h"
+#include "point_index.h"
+#include "reorder.h"
 
 /**
  * Document-class: SpatialStats::Weights::CSRMatrix
@@ -19,14 +24,46 @@ void Init_spatial_stats()
 
     rb_define_alloc_func(csr_matrix_class, csr_matrix_alloc);
     rb_define_method(csr_matrix_class, "initialize", csr_matrix_initialize, 2);
+    rb_define_singleton_method(csr_matrix_class, "from_coo", csr_matrix_from_coo, 4);
+    rb_define_singleton_method(csr_matrix_class, "knn_pairs", csr_matrix_knn_pairs, 3);
+    rb_define_singleton_method(csr_matrix_class, "band_pairs", csr_matrix_band_pairs, 3);
+    rb_define_singleton_method(csr_matrix_class, "hilbert_order", csr_matrix_hilbert_order, 2);
     rb_define_method(csr_matrix_class, "values", csr_matrix_values, 0);
     rb_define_method(csr_matrix_class, "col_index", csr_matrix_col_index, 0);
     rb_define_method(csr_matrix_class, "row_index", csr_matrix_row_index, 0);
-    rb_define_method(csr_matrix_class, "mulvec", csr_matrix_mulvec, 1);
+    rb_define_method(csr_matrix_class, "mulvec", csr_matrix_mulvec, -1);
     rb_define_method(csr_matrix_class, "dot_row", csr_matrix_dot_row, 2);
+    rb_define_method(csr_matrix_class, "mulmat", csr_matrix_mulmat, -1);
     rb_define_method(csr_matrix_class, "coordinates", csr_matrix_coordinates, 0);
+    rb_define_method(csr_matrix_class, "shape", csr_matrix_shape, 0);
+    rb_define_method(csr_matrix_class, "diagonal", csr_matrix_diagonal, 0);
+    rb_define_method(csr_matrix_class, "trace", csr_matrix_trace, 0);
+    rb_define_method(csr_matrix_class, "row_sums", csr_matrix_row_sums, 0);
+    rb_define_method(csr_matrix_class, "row_standardize", csr_matrix_row_standardize, 0);
+    rb_define_method(csr_matrix_class, "inverse_distance", csr_matrix_inverse_distance, 1);
+    rb_define_method(csr_matrix_class, "kernel", csr_matrix_kernel, 2);
+    rb_define_method(csr_matrix_class, "window", csr_matrix_window, -1);
+    rb_define_method(csr_matrix_class, "row_block", csr_matrix_row_block, 2);
+    rb_define_method(csr_matrix_class, "moran_moments", csr_matrix_moran_moments, 0);
+    rb_define_method(csr_matrix_class, "transpose", csr_matrix_transpose, 0);
+    rb_define_method(csr_matrix_class, "symmetric?", csr_matrix_symmetric, 0);
+    rb_define_method(csr_matrix_class, "symmetrize", csr_matrix_symmetrize, -1);
+    rb_define_method(csr_matrix_class, "splice", csr_matrix_splice, 4);
+    rb_define_method(csr_matrix_class, "values_type", csr_matrix_values_type, 0);
+    rb_define_method(csr_matrix_class, "astype", csr_matrix_astype, 1);
+    rb_define_method(csr_matrix_class, "memory_stats", csr_matrix_memory_stats, 0);
+    rb_define_method(csr_matrix_class, "permute", csr_matrix_permute, 1);
+    rb_define_method(csr_matrix_class, "rcm", csr_matrix_rcm, 0);
+    rb_define_method(csr_matrix_class, "dump", csr_matrix_dump, -1);
+    rb_define_singleton_method(csr_matrix_class, "load", csr_matrix_load, -1);
+    rb_define_method(csr_matrix_class, "copy_binary", csr_matrix_copy_binary, -1);
+    rb_define_method(csr_matrix_class, "local_mc", csr_matrix_local_mc, -1);
+    rb_define_method(csr_matrix_class, "local_mc_sequential", csr_matrix_local_mc_sequential, -1);
+    rb_define_method(csr_matrix_class, "global_mc", csr_matrix_global_mc, -1);
+    rb_define_method(csr_matrix_class, "local_stats", csr_matrix_local_stats, -1);
 
     rb_define_attr(csr_matrix_class, "m", 1, 0);
     rb_define_attr(csr_matrix_class, "n", 1, 0);
     rb_define_attr(csr_matrix_class, "nnz", 1, 0);
+    rb_define_attr(csr_matrix_class, "keys", 1, 0);
 }
\ No newline at end of file
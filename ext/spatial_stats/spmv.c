@@ -0,0 +1,224 @@
+#include <ruby.h>
+#include <stdint.h>
+#include "csr_matrix.h"
+#include "spmv.h"
+
+// Rows of a matrix from Distant.knn all have k entries, so its arrays
+// are an ELLPACK layout with no padding. For these lengths the row
+// loops below are compiled with a constant length, which the compiler
+// unrolls, and row_index is not read. Other lengths, and matrices with
+// rows of different lengths, use the CSR loop.
+#define SPMV_MAX_UNROLLED 12
+
+static inline void spmv_uniform_float64(const csr_matrix *csr, int k,
+                                        const double *x, double *y)
+{
+    const double *values = csr->values;
+    const int *col_index = csr->col_index;
+    int i;
+    int j;
+    double tmp;
+
+    for (i = 0; i < csr->n; i++)
+    {
+        tmp = 0;
+        for (j = 0; j < k; j++)
+        {
+            tmp += values[j] * x[col_index[j]];
+        }
+        y[i] = tmp;
+        values += k;
+        col_index += k;
+    }
+}
+
+static inline void spmv_uniform_float32(const csr_matrix *csr, int k,
+                                        const double *x, double *y)
+{
+    const float *values = csr->values32;
+    const int *col_index = csr->col_index;
+    int i;
+    int j;
+    double tmp;
+
+    for (i = 0; i < csr->n; i++)
+    {
+        tmp = 0;
+        for (j = 0; j < k; j++)
+        {
+            tmp += values[j] * x[col_index[j]];
+        }
+        y[i] = tmp;
+        values += k;
+        col_index += k;
+    }
+}
+
+// binary rows, every weight is w, 1 or 1 / k once standardized.
+// Multiplying by 1 is exact, so binary sums match gathering x alone.
+static inline void spmv_uniform_binary(const csr_matrix *csr, int k, double w,
+                                       const double *x, double *y)
+{
+    const int *col_index = csr->col_index;
+    int i;
+    int j;
+    double tmp;
+
+    for (i = 0; i < csr->n; i++)
+    {
+        tmp = 0;
+        for (j = 0; j < k; j++)
+        {
+            tmp += w * x[col_index[j]];
+        }
+        y[i] = tmp;
+        col_index += k;
+    }
+}
+
+static inline void spmv_uniform(const csr_matrix *csr, int k,
+                                const double *x, double *y)
+{
+    switch (csr->values_type)
+    {
+    case CSR_VALUES_FLOAT64:
+        spmv_uniform_float64(csr, k, x, y);
+        break;
+    case CSR_VALUES_FLOAT32:
+        spmv_uniform_float32(csr, k, x, y);
+        break;
+    case CSR_VALUES_BINARY:
+        spmv_uniform_binary(csr, k, 1, x, y);
+        break;
+    case CSR_VALUES_BINARY_STANDARDIZED:
+        spmv_uniform_binary(csr, k, 1.0 / (double)k, x, y);
+        break;
+    }
+}
+
+/**
+ *  Number of entries in every row of the matrix, or 0 if rows have
+ *  different numbers of entries. It is computed on the first call and
+ *  kept, so call it while holding the GVL before csr_matrix_spmv runs
+ *  on native threads.
+ */
+int64_t csr_matrix_row_length(csr_matrix *csr)
+{
+    int64_t k;
+    int i;
+
+    if (csr->row_length < 0)
+    {
+        k = csr->n > 0 ? csr->row_index[1] - csr->row_index[0] : 0;
+        for (i = 1; i < csr->n && k > 0; i++)
+        {
+            if (csr->row_index[i + 1] - csr->row_index[i] != k)
+            {
+                k = 0;
+            }
+        }
+        csr->row_length = k;
+    }
+    return csr->row_length;
+}
+
+/**
+ *  sum_j(w_ij * x[j]) over row i, with a loop for each values type.
+ *  Binary rows only gather x, and standardized binary rows scale each
+ *  entry by 1 / their length like stored standardized values would.
+ */
+double csr_matrix_row_dot(const csr_matrix *csr, int i, const double *x)
+{
+    int64_t start = csr->row_index[i];
+    int64_t stop = csr->row_index[i + 1];
+    int64_t jj;
+    double w;
+    double tmp = 0;
+
+    switch (csr->values_type)
+    {
+    case CSR_VALUES_FLOAT64:
+        for (jj = start; jj < stop; jj++)
+        {
+            tmp += csr->values[jj] * x[csr->col_index[jj]];
+        }
+        break;
+    case CSR_VALUES_FLOAT32:
+        for (jj = start; jj < stop; jj++)
+        {
+            tmp += csr->values32[jj] * x[csr->col_index[jj]];
+        }
+        break;
+    case CSR_VALUES_BINARY:
+        for (jj = start; jj < stop; jj++)
+        {
+            tmp += x[csr->col_index[jj]];
+        }
+        break;
+    case CSR_VALUES_BINARY_STANDARDIZED:
+        w = stop > start ? 1.0 / (double)(stop - start) : 0;
+        for (jj = start; jj < stop; jj++)
+        {
+            tmp += w * x[csr->col_index[jj]];
+        }
+        break;
+    }
+    return tmp;
+}
+
+/**
+ *  y = W * x, x of length m and y of length n. Rows of the length
+ *  csr_matrix_row_length found, if it was called, run an unrolled loop
+ *  for that length. Every row sums its entries in order, so the result
+ *  is the same as csr_matrix_row_dot on each row.
+ */
+void csr_matrix_spmv(const csr_matrix *csr, const double *x, double *y)
+{
+    int i;
+
+    switch (csr->row_length > SPMV_MAX_UNROLLED ? 0 : csr->row_length)
+    {
+    case 1:
+        spmv_uniform(csr, 1, x, y);
+        break;
+    case 2:
+        spmv_uniform(csr, 2, x, y);
+        break;
+    case 3:
+        spmv_uniform(csr, 3, x, y);
+        break;
+    case 4:
+        spmv_uniform(csr, 4, x, y);
+        break;
+    case 5:
+        spmv_uniform(csr, 5, x, y);
+        break;
+    case 6:
+        spmv_uniform(csr, 6, x, y);
+        break;
+    case 7:
+        spmv_uniform(csr, 7, x, y);
+        break;
+    case 8:
+        spmv_uniform(csr, 8, x, y);
+        break;
+    case 9:
+        spmv_uniform(csr, 9, x, y);
+        break;
+    case 10:
+        spmv_uniform(csr, 10, x, y);
+        break;
+    case 11:
+        spmv_uniform(csr, 11, x, y);
+        break;
+    case 12:
+        spmv_uniform(csr, 12, x, y);
+        break;
+    default:
+        for (i = 0; i < csr->n; i++)
+        {
+            y[i] = csr_matrix_row_dot(csr, i, x);
+        }
+        break;
+    }
+}
@@ -0,0 +1,7 @@
+#ifndef SPMV
+#define SPMV
+
+int64_t csr_matrix_row_length(csr_matrix *csr);
+double csr_matrix_row_dot(const csr_matrix *csr, int i, const double *x);
+void csr_matrix_spmv(const csr_matrix *csr, const double *x, double *y);
+#endif
@@ -19,4 +19,31 @@ module SpatialStats
   #   # klass.extend(SpatialStats::Queries::Weights)
   # end
   # Your code goes here...
+
+  class << self
+    ##
+    # Number of native threads used by permutation tests. The GVL is
+    # released while they run. Each observation or permutation draws
+    # from its own stream of the seed, so results depend only on the
+    # seed and not on the thread count. Seeded results differ from
+    # 1.0.3 and earlier.
+    #
+    # @example
+    #   SpatialStats.threads = 4
+    #
+    # @return [Integer]
+    def threads
+      @threads ||= 1
+    end
+
+    ##
+    # Set the number of threads used by permutation tests.
+    #
+    # @param [Integer] count of threads, must be >= 1
+    def threads=(count)
+      raise ArgumentError, 'threads must be >= 1' if count.to_i < 1
+
+      @threads = count.to_i
+    end
+  end
 end
@@ -25,7 +25,8 @@ module SpatialStats
       ##
       # A new instance of BivariateMoran, from vector and weights.
       #
-      # @param [Array] x observations of dataset
+      # @param [Array, Numo::DFloat] x observations of dataset
+      # @param [Array, Numo::DFloat] y observations of dataset
       # @param [WeightsMatrix] weights to define relationships between observations
       #
       # @return [BivariateMoran]
@@ -74,10 +75,10 @@ module SpatialStats
         w_sum = n.to_f
         e = expectation
 
-        wij = weights.sparse.coordinates
+        moments = weights.sparse.moran_moments
 
-        s1 = s1_calc(wij)
-        s2 = s2_calc(n, wij, weights.sparse.row_index)
+        s1 = moments[:s1]
+        s2 = moments[:s2]
         s3 = s3_calc(n, x)
 
         s4 = (n**2 - 3 * n + 3) * s1 - n * s2 + 3 * (w_sum**2)
@@ -122,8 +123,7 @@ module SpatialStats
       #
       # @return [Array]
       def x
-        @x ||= SpatialStats::Queries::Variables.query_field(@scope, @x_field)
-                                               .standardize
+        @x ||= field_matrix[true, 0].to_a
       end
 
       ##
@@ -131,49 +131,29 @@ module SpatialStats
       #
       # @return [Array]
       def y
-        @y ||= SpatialStats::Queries::Variables.query_field(@scope, @y_field)
-                                               .standardize
+        @y ||= field_matrix[true, 1].to_a
       end
 
       private
 
-      def stat_mc(perms)
-        x_arr = Numo::DFloat.cast(x)
-        lag = w.dot(perms.transpose)
-        x_arr.dot(lag) / (x_arr**2).sum
+      # x and y, standardized, from one query
+      def field_matrix
+        @field_matrix ||= SpatialStats::Queries::Variables
+                          .query_fields(@scope, [@x_field, @y_field], standardize: true)
       end
 
-      def s3_calc(n, zs)
-        numerator = (1.0 / n) * zs.sum { |v| v**4 }
-        denominator = ((1.0 / n) * zs.sum { |v| v**2 })**2
-        numerator / denominator
+      def mc_factors
+        x
       end
 
-      def s2_calc(n, wij, row_index)
-        s2 = 0
-        wij_arr = wij.to_a # for row slicing
-        (0..n - 1).each do |idx|
-          row = wij_arr[row_index[idx]..(row_index[idx + 1] - 1)]
-          left_term = 0
-          right_term = 0
-
-          row.each do |coords, val|
-            left_term += val
-            right_term += wij[coords.reverse] || 0
-          end
-          s2 += (left_term + right_term)**2
-        end
-        s2
+      def mc_values
+        y
       end
 
-      def s1_calc(wij)
-        s1 = 0
-        wij.each do |coords, val|
-          # (wij + wji)**2
-          wji = wij[coords.reverse] || 0
-          s1 += (val + wji)**2
-        end
-        s1 / 2
+      def s3_calc(n, zs)
+        numerator = (1.0 / n) * zs.sum { |v| v**4 }
+        denominator = ((1.0 / n) * zs.sum { |v| v**2 })**2
+        numerator / denominator
       end
     end
   end
@@ -60,10 +60,10 @@ module SpatialStats
         w_sum = n # standardized weights
         e = expectation
 
-        wij = weights.sparse.coordinates
+        moments = weights.sparse.moran_moments
 
-        s1 = s1_calc(wij)
-        s2 = s2_calc(n, wij, weights.sparse.row_index)
+        s1 = moments[:s1]
+        s2 = moments[:s2]
         s3 = s3_calc(n, z)
 
         s4 = (n**2 - 3 * n + 3) * s1 - n * s2 + 3 * (w_sum**2)
@@ -115,10 +115,8 @@ module SpatialStats
 
       private
 
-      def stat_mc(perms)
-        z_arr = Numo::DFloat.cast(z)
-        lag = w.dot(perms.transpose)
-        z_arr.dot(lag) / (z_arr**2).sum
+      def mc_factors
+        z
       end
 
       def s3_calc(n, zs)
@@ -126,34 +124,6 @@ module SpatialStats
         denominator = ((1.0 / n) * zs.sum { |v| v**2 })**2
         numerator / denominator
       end
-
-      # use row_index to take slices of wij
-      def s2_calc(n, wij, row_index)
-        s2 = 0
-        wij_arr = wij.to_a # for row slicing
-        (0..n - 1).each do |idx|
-          row = wij_arr[row_index[idx]..(row_index[idx + 1] - 1)]
-          left_term = 0
-          right_term = 0
-
-          row.each do |coords, val|
-            left_term += val
-            right_term += wij[coords.reverse] || 0
-          end
-          s2 += (left_term + right_term)**2
-        end
-        s2
-      end
-
-      def s1_calc(wij)
-        s1 = 0
-        wij.each do |coords, val|
-          # (wij + wji)**2
-          wji = wij[coords.reverse] || 0
-          s1 += (val + wji)**2
-        end
-        s1 / 2
-      end
     end
   end
 end
@@ -1,5 +1,7 @@
 # frozen_string_literal: true
 
+require 'spatial_stats/utils/permutation'
+
 module SpatialStats
   module Global
     ##
@@ -8,6 +10,8 @@ module SpatialStats
     # and will raise a NotImplementedError on those that are specific
     # for each type of statistic.
     class Stat
+      include SpatialStats::Utils::Permutation
+
       def initialize(scope, field, weights)
         @scope = scope
         @field = field
@@ -18,7 +22,10 @@ module SpatialStats
       ##
       # A new instance of Stat, from vector and weights.
       #
-      # @param [Array] x observations of dataset
+      # Columns of +Queries::Variables.query_fields+ can be passed directly,
+      # ex. +Moran.from_observations(matrix[true, 0], weights)+.
+      #
+      # @param [Array, Numo::DFloat] x observations of dataset
       # @param [WeightsMatrix] weights to define relationships between observations
       #
       # @return [Stat]
@@ -55,52 +62,90 @@ module SpatialStats
       end
 
       def x=(values)
-        @x = values.standardize
+        @x = values.to_a.standardize
       end
       alias z= x=
 
       def y=(values)
-        @y = values.standardize
+        @y = values.to_a.standardize
       end
 
       def mc(permutations, seed)
-        rng = gen_rng(seed)
-        shuffles = []
-        permutations.times do
-          shuffles << x.shuffle(random: rng)
-        end
-        shuffles = Numo::DFloat.cast(shuffles)
+        permutation_mc(x, permutations, seed)
+      end
 
-        # r is the number of equal to or more extreme samples
-        # one sided
+      def mc_bv(permutations, seed)
+        # in multivariate, hold x and shuffle y
+        permutation_mc(y, permutations, seed)
+      end
+
+      ##
+      # Sequential permutation test, following Besag and Clifford.
+      # Permutations run in batches until +alpha * (permutations + 1)+ of
+      # them are at least as extreme as +#stat+, at which point the stat
+      # cannot be significant at +alpha+, or until +permutations+ are run.
+      #
+      # A stopped test has a p-value of count / permutations used, otherwise
+      # it is the same p-value as +mc+ would give. Permutations are the
+      # same ones +mc+ runs for the seed, so the result does not depend on
+      # the batch size.
+      #
+      # @see https://doi.org/10.1093/biomet/78.2.301
+      #
+      # @param [Integer] permutations most to run.
+      # @param [Integer, Random] seed used in random number generator for shuffles, or a rng to draw it from.
+      # @param [Float] alpha significance level the decision is made at.
+      #
+      # @return [Hash] of the +:p+ value and +:permutations+ used
+      def mc_sequential(permutations = 9999, seed = nil, alpha: 0.05)
+        seed = mc_seed(seed)
+        stop = mc_stop(permutations, alpha)
         stat_orig = stat.round(5)
-        # r = 0
+        count = 0
+        used = 0
+        batch = 99
+
+        while used < permutations && count < stop
+          size = [batch, permutations - used].min
+          stat_new = weights.sparse.global_mc(weights.permute(mc_factors),
+                                              weights.permute(mc_values), size,
+                                              seed, SpatialStats.threads, used, weights.permutation)
+          stat_new.each do |v|
+            used += 1
+            count += 1 if stat_orig.positive? ? v >= stat_orig : v <= stat_orig
+            break if count >= stop
+          end
+          batch *= 2
+        end
 
-        # compute new stat values
-        stat_new = stat_mc(shuffles)
+        { p: sequential_p(count, used, permutations, stop), permutations: used }
+      end
 
-        r = if stat_orig.positive?
-              (stat_new >= stat_orig).count
-            else
-              (stat_new <= stat_orig).count
-            end
+      private
 
-        (r + 1.0) / (permutations + 1.0)
+      def mc_factors
+        raise NotImplementedError, 'private method mc_factors not defined'
       end
 
-      def mc_bv(permutations, seed)
-        # in multivariate, hold x and shuffle y
-        rng = gen_rng(seed)
-        shuffles = []
-        permutations.times do
-          shuffles << y.shuffle(random: rng)
-        end
-        shuffles = Numo::DFloat.cast(shuffles)
+      # values that are shuffled in +mc_sequential+, the same as +mc+ uses.
+      def mc_values
+        x
+      end
+
+      # Shuffles +values+ +permutations+ times and computes the stat for
+      # each in the C extension, split across +SpatialStats.threads+.
+      # Every permutation has its own stream derived from the seed, so
+      # results do not depend on the number of threads.
+      def permutation_mc(values, permutations, seed)
+        stat_new = Numo::DFloat.cast(
+          weights.sparse.global_mc(weights.permute(mc_factors), weights.permute(values),
+                                   permutations, mc_seed(seed), SpatialStats.threads, 0,
+                                   weights.permutation)
+        )
 
         # r is the number of equal to or more extreme samples
+        # one sided
         stat_orig = stat.round(5)
-        stat_new = stat_mc(shuffles)
-
         r = if stat_orig.positive?
               (stat_new >= stat_orig).count
             else
@@ -109,24 +154,6 @@ module SpatialStats
 
         (r + 1.0) / (permutations + 1.0)
       end
-
-      private
-
-      def stat_mc(_shuffles)
-        raise NotImplementedError, 'private method stat_mc not defined'
-      end
-
-      def w
-        @w ||= weights.dense
-      end
-
-      def gen_rng(seed)
-        if seed
-          Random.new(seed)
-        else
-          Random.new
-        end
-      end
     end
   end
 end
@@ -26,8 +26,8 @@ module SpatialStats
       ##
       # A new instance of BivariateMoran, from vector and weights.
       #
-      # @param [Array] x observations of dataset
-      # @param [Array] y observations of dataset
+      # @param [Array, Numo::DFloat] x observations of dataset
+      # @param [Array, Numo::DFloat] y observations of dataset
       # @param [WeightsMatrix] weights to define relationships between observations
       #
       # @return [BivariateMoran]
@@ -47,9 +47,7 @@ module SpatialStats
       #
       # @return [Array] of correlations for each observation.
       def stat
-        x.each_with_index.map do |_xi, idx|
-          stat_i(idx)
-        end
+        local_stats[:stat]
       end
       alias i stat
 
@@ -81,42 +79,10 @@ module SpatialStats
       end
 
       ##
-      # Determines what quadrant an observation is in. Based on its value
-      # compared to its neighbors. This does not work for all stats, since
-      # it requires that values be negative.
-      #
-      # In a standardized array of z, high values are values greater than 0
-      # and it's neighbors are determined by the spatial lag and if that is
-      # positive then it's neighbors would be high, low otherwise.
-      #
-      # Quadrants are:
-      # [HH] a high value surrounded by other high values
-      # [LH] a low value surrounded by high values
-      # [LL] a low value surrounded by low values
-      # [HL] a high value surrounded by low values
+      # Quadrant of each observation, from the sign of x and of the
+      # lagged y. See +Stat#quads+ for the labels.
       #
       # @return [Array] of labels
-      def quads
-        # https://github.com/pysal/esda/blob/master/esda/moran.py#L925
-        z_lag = SpatialStats::Utils::Lag.neighbor_average(weights, y)
-        zp = x.map(&:positive?)
-        lp = z_lag.map(&:positive?)
-
-        # hh = zp & lp
-        # lh = zp ^ true & lp
-        # ll = zp ^ true & lp ^ true
-        # hl = zp next to lp ^ true
-        hh = zp.each_with_index.map { |v, idx| v & lp[idx] }
-        lh = zp.each_with_index.map { |v, idx| (v ^ true) & lp[idx] }
-        ll = zp.each_with_index.map { |v, idx| (v ^ true) & (lp[idx] ^ true) }
-        hl = zp.each_with_index.map { |v, idx| v & (lp[idx] ^ true) }
-
-        # now zip lists and map them to proper terms
-        quad_terms = %w[HH LH LL HL]
-        hh.zip(lh, ll, hl).map do |feature|
-          quad_terms[feature.index(true)]
-        end
-      end
       alias groups quads
 
       ##
@@ -136,34 +102,44 @@ module SpatialStats
       end
 
       def x
-        @x ||= SpatialStats::Queries::Variables.query_field(@scope, @x_field)
-                                               .standardize
+        @x ||= field_matrix[true, 0].to_a
       end
 
       def y
-        @y ||= SpatialStats::Queries::Variables.query_field(@scope, @y_field)
-                                               .standardize
+        @y ||= field_matrix[true, 1].to_a
       end
 
       private
 
-      def mc_i(wi, perms, idx)
-        y_lag_i = (wi * perms).sum(1)
-        x[idx] * y_lag_i
+      # x and y, standardized, from one query
+      def field_matrix
+        @field_matrix ||= SpatialStats::Queries::Variables
+                          .query_fields(@scope, [@x_field, @y_field], standardize: true)
       end
 
-      def mc_observation_calc(stat_i_orig, stat_i_new, _permutations)
-        # Since moran can be positive or negative, go by this definition
-        if stat_i_orig.positive?
-          (stat_i_new >= stat_i_orig).count
-        else
-          (stat_i_new <= stat_i_orig).count
-        end
+      def mc_kind
+        :moran
+      end
+
+      def mc_factors
+        # i is computed as xi * lag of permuted y
+        x
+      end
+
+      def mc_values
+        y
       end
 
       def y_lag
         @y_lag ||= SpatialStats::Utils::Lag.neighbor_sum(weights, y)
       end
+
+      # y is the lagged variable, unlike the univariate stats
+      def local_stats
+        @local_stats ||= weights.unpermute(
+          weights.sparse.local_stats(mc_kind, weights.permute(mc_factors), weights.permute(y))
+        )
+      end
     end
   end
 end
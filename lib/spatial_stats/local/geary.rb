@@ -26,9 +26,7 @@ module SpatialStats
       #
       # @return [Array] the C value for each observation
       def stat
-        z.each_with_index.map do |_zi, idx|
-          stat_i(idx)
-        end
+        local_stats[:stat]
       end
       alias c stat
 
@@ -63,30 +61,16 @@ module SpatialStats
 
       private
 
-      def stat_i(idx)
-        # TODO: maybe don't even use stat_i
-        # just form all of the modified zs and then
-        # pass it to a loop of mulvec all implemented in c ext
-        zi = z.map { |val| (z[idx] - val)**2 }
-        weights.sparse.dot_row(zi, idx)
-      end
-
-      def mc_i(wi, perms, idx)
-        zi = (z[idx] - perms)**2
-        (wi * zi).sum(1)
+      def mc_kind
+        # Geary cannot be negative, so the tail is chosen by comparing
+        # to the mean of the permuted values like GeoDa. This is
+        # inclusive on both tails, not just the lower tail.
+        :geary
       end
 
-      def mc_observation_calc(stat_i_orig, stat_i_new, _permutations)
-        # Geary cannot be negative, so we have to use this technique from
-        # GeoDa to determine p values. Note I slightly modified it to be inclusive
-        # on both tails not just the lower tail.
-        # https://github.com/GeoDaCenter/geoda/blob/master/Explore/LocalGearyCoordinator.cpp#L981        mean = stat_i_new.mean
-        mean = stat_i_new.mean
-        if stat_i_orig <= mean
-          (stat_i_new <= stat_i_orig).count
-        else
-          (stat_i_new >= stat_i_orig).count
-        end
+      def mc_factors
+        # c is computed as the lag of (zi - permuted z)**2
+        z
       end
     end
   end
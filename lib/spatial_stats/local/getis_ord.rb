@@ -32,12 +32,40 @@ module SpatialStats
       #
       # @return [Array] of autocorrelations for each observation.
       def stat
-        x.each_with_index.map do |_x_val, idx|
-          stat_i(idx)
-        end
+        local_stats[:stat]
       end
       alias g stat
 
+      ##
+      # Expected value of G for each observation under randomization.
+      # This is the row sum of the weights over the number of values that
+      # are randomized, n - 1 for G and n for G*.
+      #
+      # @see https://doi.org/10.1111/j.1538-4632.1995.tb00912.x
+      #
+      # @return [Array] of expectations for each observation
+      def expectation
+        local_stats[:expectation]
+      end
+
+      ##
+      # Variance of G for each observation under randomization.
+      #
+      # @see https://doi.org/10.1111/j.1538-4632.1995.tb00912.x
+      #
+      # @return [Array] of variances for each observation
+      def variance
+        local_stats[:variance]
+      end
+
+      ##
+      # Z-score for each observation of the statistic.
+      #
+      # @return [Array] of the number of deviations from the mean
+      def z_score
+        local_stats[:z_score]
+      end
+
       ##
       # Computes the groups each observation belongs to.
       # Potential groups for G are:
@@ -48,13 +76,8 @@ module SpatialStats
       #
       # @return [Array] groups for each observation
       def groups
-        z.standardize.map do |val|
-          if val.positive?
-            'H'
-          else
-            'L'
-          end
-        end
+        group_terms = %w[H L]
+        local_stats[:quads].map { |code| group_terms[code] }
       end
 
       ##
@@ -74,7 +97,7 @@ module SpatialStats
       # @return [Boolean] of star
       def star?
         if @star.nil?
-          @star = weights.dense.trace.positive?
+          @star = weights.sparse.trace.positive?
         else
           @star
         end
@@ -82,26 +105,16 @@ module SpatialStats
 
       private
 
-      def stat_i(idx)
-        x_lag[idx] / denominators[idx]
-      end
-
-      def mc_i(wi, perms, idx)
-        x_lag_i = (wi * perms).sum(1)
-        x_lag_i / denominators[idx]
-      end
-
-      def mc_observation_calc(stat_i_orig, stat_i_new, permutations)
-        # GetisOrd cannot be negative, so we have to use this technique from
+      def mc_kind
+        # GetisOrd cannot be negative, so we use the technique from
         # ESDA to determine if we should select p or 1-p.
         # https://github.com/pysal/esda/blob/master/esda/getisord.py#L388
-        num_larger = (stat_i_new >= stat_i_orig).count
-        is_low = (permutations - num_larger) < num_larger
-        if is_low
-          permutations - num_larger
-        else
-          num_larger
-        end
+        :getis_ord
+      end
+
+      def mc_factors
+        # g is computed as the lag of permuted x / denominator
+        denominators
       end
 
       def calc_weights
@@ -119,19 +132,22 @@ module SpatialStats
 
       def denominators
         @denominators ||= begin
-          n = w.shape[0]
+          total = x.sum
           if star?
-            [x.sum] * n
+            [total] * weights.n
           else
-            # add everything but i
-            (0..n - 1).each.map do |idx|
-              terms = x.dup
-              terms.delete_at(idx)
-              terms.sum
-            end
+            # sum of everything but i
+            x.map { |xi| total - xi }
           end
         end
       end
+
+      def local_stats
+        kind = star? ? :getis_ord_star : :getis_ord
+        @local_stats ||= weights.unpermute(
+          weights.sparse.local_stats(kind, weights.permute(denominators), weights.permute(x))
+        )
+      end
     end
   end
 end
@@ -27,9 +27,7 @@ module SpatialStats
       #
       # @return [Array] of autocorrelations for each observation.
       def stat
-        z.each_with_index.map do |_z_val, idx|
-          stat_i(idx)
-        end
+        local_stats[:stat]
       end
       alias i stat
 
@@ -55,16 +53,15 @@ module SpatialStats
       # @return [Array] of variances for each observation
       def variance
         # formula is A - B - (E[I])**2
-        exp = expectation
-
-        vars = []
-        a_terms = a_calc
-        b_terms = b_calc
+        local_stats[:variance]
+      end
 
-        a_terms.each_with_index do |a_term, idx|
-          vars << (a_term - b_terms[idx] - (exp**2))
-        end
-        vars
+      ##
+      # Z-score for each observation of the statistic.
+      #
+      # @return [Array] of the number of deviations from the mean
+      def z_score
+        local_stats[:z_score]
       end
 
       ##
@@ -104,71 +101,15 @@ module SpatialStats
 
       private
 
-      def stat_i(idx)
-        sum_term = z_lag[idx]
-        (z[idx] / si2) * sum_term
-      end
-
-      def mc_i(wi, perms, idx)
-        # compute i for a single index given DFloat of neighbor weights
-        # and DFloat of neighbor z perms
-        z_lag_i = (wi * perms).sum(1)
-        z[idx] * z_lag_i
-      end
-
-      def mc_observation_calc(stat_i_orig, stat_i_new, _permutations)
-        # Since moran can be positive or negative, go by this definition
-        if stat_i_orig.positive?
-          (stat_i_new >= stat_i_orig).count
-        else
-          (stat_i_new <= stat_i_orig).count
-        end
-      end
-
-      def si2
-        # @si2 ||= z.sample_variance
-        # we standardize so sample_variance is 1
-        1.0
-      end
-
-      # https://pro.arcgis.com/en/pro-app/tool-reference/spatial-statistics/h-local-morans-i-additional-math.htm
-      # TODO: sparse
-      def a_calc
-        n = weights.n
-        b2i = b2i_calc
-
-        wts = weights.sparse.values
-        row_index = weights.sparse.row_index
-
-        a_terms = []
-
-        (0..n - 1).each do |idx|
-          row_range = row_index[idx]..(row_index[idx + 1] - 1)
-          wt = wts[row_range]
-          sigma_term = wt.sum { |v| v**2 }
-          a_terms << (n - b2i) * sigma_term / (n - 1)
-        end
-        a_terms
-      end
-
-      def b_calc
-        n = weights.n
-        b2i = b2i_calc
-        b_terms = []
-
-        # technically, the formula is Sigma k (sigma h (wik * wih))
-        # since we use row standardized matricies, this is always 1
-        # for each row
-        # this also means that all b_terms will be the same.
-        sigma_term = 1.0
-        b_terms << sigma_term * (2 * b2i - n) / ((n - 1) * (n - 2))
-        b_terms * n
+      def mc_kind
+        # Since moran can be positive or negative, the tail is
+        # determined by the sign of the original stat.
+        :moran
       end
 
-      def b2i_calc
-        numerator = z.sum { |v| v**4 }
-        denominator = z.sum { |v| v**2 }
-        numerator / (denominator**2)
+      def mc_factors
+        # i is computed as zi * lag of permuted z
+        z
       end
     end
   end
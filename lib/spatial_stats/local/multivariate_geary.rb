@@ -27,6 +27,36 @@ module SpatialStats
       end
       attr_accessor :scope, :fields, :weights
 
+      ##
+      # A new instance of MultivariateGeary, from a matrix and weights.
+      # Each column is standardized.
+      #
+      # @example
+      #   matrix = SpatialStats::Queries::Variables.query_fields(scope, fields)
+      #   SpatialStats::Local::MultivariateGeary.from_observations(matrix, weights)
+      #
+      # @param [Numo::DFloat, Array] x n x k matrix, with the attributes of each observation in a row
+      # @param [WeightsMatrix] weights to define relationships between observations
+      #
+      # @return [MultivariateGeary]
+      def self.from_observations(x, weights)
+        matrix = Numo::DFloat.cast(x)
+        raise ArgumentError, 'Data size != weights.n' if matrix.shape[0] != weights.n
+
+        instance = new(nil, nil, weights.standardize)
+        instance.x = matrix
+        instance
+      end
+
+      ##
+      # Set the n x k attribute matrix.
+      #
+      # @param [Numo::DFloat, Array] values n x k matrix, standardized by column
+      def x=(values)
+        @local_stats = nil
+        @field_matrix = Numo::DFloat.cast(values).standardize
+      end
+
       ##
       # Computes the stat for MultivariateGeary.
       #
@@ -34,11 +64,7 @@ module SpatialStats
       #
       # @return [Array] of C values for each observation.
       def stat
-        m = fields.size
-        gearys = fields.map do |field|
-          Geary.new(scope, field, weights).stat
-        end
-        gearys.transpose.map { |x| x.reduce(:+) / m }
+        local_stats[:stat].to_a
       end
       alias c stat
 
@@ -56,45 +82,9 @@ module SpatialStats
       # @return [Array] of p-values
       def mc(permutations = 99, seed = nil)
         # in this case, one tuple of vals is held constant, then
-        # the rest are shuffled, so for crand we will pass in an arr
-        # of indices, which will return a list of new orders for the fields.
-        # They will then be shuffled corresponding to the new indices.
-        rng = gen_rng(seed)
-        rids = crand(permutations, rng)
-
-        n_1 = weights.n - 1
-        sparse = weights.sparse
-        row_index = sparse.row_index
-        ws = sparse.values
-        wc = weights.wc
-        stat_orig = stat
-
-        ids = (0..n_1).to_a
-        observations = Array.new(weights.n)
-        (0..n_1).each do |idx|
-          idsi = ids.dup
-          idsi.delete_at(idx)
-          idsi.shuffle!(random: rng)
-          idsi = Numo::Int32.cast(idsi)
-          sample = rids[idsi[rids[true, 0..wc[idx] - 1]]]
-
-          # account for case where there are no neighbors
-          row_range = row_index[idx]..(row_index[idx + 1] - 1)
-          if row_range.size.zero?
-            observations[idx] = permutations
-            next
-          end
-
-          wi = Numo::DFloat.cast(ws[row_range])
-          stat_i_new = mc_i(wi, sample, idx)
-          stat_i_orig = stat_orig[idx]
-          observations[idx] = mc_observation_calc(stat_i_orig, stat_i_new,
-                                                  permutations)
-        end
-
-        observations.map do |ri|
-          (ri + 1.0) / (permutations + 1.0)
-        end
+        # the rest are shuffled, so the neighbors of each observation
+        # are sampled as whole rows of the attribute matrix.
+        conditional_mc(field_matrix, permutations, seed)
       end
 
       def groups
@@ -103,43 +93,31 @@ module SpatialStats
 
       private
 
-      def mc_i(wi, perms, idx)
-        m = fields.size
-        permutations = perms.shape[0]
-
-        cs = Numo::DFloat.zeros(m, permutations)
-        (0..m - 1).each do |mi|
-          z = field_data[mi]
-          zs = matrix_field_data[mi, true][perms]
-          c = (z[idx] - zs)**2
+      def mc_kind
+        # same tails as univariate Geary
+        :multivariate_geary
+      end
 
-          cs[mi, true] = (wi * c).sum(1)
-        end
-        cs.mean(0)
+      def mc_factors
+        field_matrix
       end
 
-      def mc_observation_calc(stat_i_orig, stat_i_new, _permutations)
-        # Geary cannot be negative, so we have to use this technique from
-        # GeoDa to determine p values. Note I slightly modified it to be inclusive
-        # on both tails not just the lower tail.
-        # https://github.com/GeoDaCenter/geoda/blob/master/Explore/LocalGearyCoordinator.cpp#L981        mean = stat_i_new.mean
-        mean = stat_i_new.mean
-        if stat_i_orig <= mean
-          (stat_i_new <= stat_i_orig).count
-        else
-          (stat_i_new >= stat_i_orig).count
-        end
+      def mc_values
+        field_matrix
       end
 
-      def field_data
-        @field_data ||= fields.map do |field|
-          SpatialStats::Queries::Variables.query_field(@scope, field)
-                                          .standardize
+      def local_stats
+        @local_stats ||= begin
+          matrix = weights.permute(field_matrix)
+          weights.unpermute(weights.sparse.local_stats(mc_kind, matrix, matrix))
         end
       end
 
-      def matrix_field_data
-        @matrix_field_data ||= Numo::DFloat.cast(field_data)
+      # n x k matrix, with the standardized attributes of each
+      # observation in a row.
+      def field_matrix
+        @field_matrix ||= SpatialStats::Queries::Variables
+                          .query_fields(@scope, fields, standardize: true)
       end
     end
   end
@@ -1,5 +1,7 @@
 # frozen_string_literal: true
 
+require 'spatial_stats/utils/permutation'
+
 module SpatialStats
   module Local
     ##
@@ -8,6 +10,8 @@ module SpatialStats
     # and will raise a NotImplementedError on those that are specific
     # for each type of statistic.
     class Stat
+      include SpatialStats::Utils::Permutation
+
       # Base class for local stats
       def initialize(scope, field, weights)
         @scope = scope
@@ -19,7 +23,10 @@ module SpatialStats
       ##
       # A new instance of Stat, from vector and weights.
       #
-      # @param [Array] x observations of dataset
+      # Columns of +Queries::Variables.query_fields+ can be passed directly,
+      # ex. +Moran.from_observations(matrix[true, 0], weights)+.
+      #
+      # @param [Array, Numo::DFloat] x observations of dataset
       # @param [WeightsMatrix] weights to define relationships between observations
       #
       # @return [Stat]
@@ -44,12 +51,14 @@ module SpatialStats
       end
 
       def x=(values)
-        @x = values.standardize
+        @local_stats = nil
+        @x = values.to_a.standardize
       end
       alias z= x=
 
       def y=(values)
-        @y = values.standardize
+        @local_stats = nil
+        @y = values.to_a.standardize
       end
 
       ##
@@ -77,6 +86,9 @@ module SpatialStats
       # sparse so the amount of shuffling/multiplication that is done
       # is reduced drastically.
       #
+      # +mc+ samples each observation's neighbors natively instead, so this
+      # is only needed to reproduce results with +CSRMatrix#local_mc+.
+      #
       # @see https://github.com/pysal/esda/blob/master/esda/moran.py#L893
       #
       # @return [Numo::Int32] matrix of shape perms x wc_max + 1
@@ -110,7 +122,7 @@ module SpatialStats
       # @see https://geodacenter.github.io/glossary.html#perm
       #
       # @param [Integer] permutations to run. Last digit should be 9 to produce round numbers.
-      # @param [Integer] seed used in random number generator for shuffles.
+      # @param [Integer, Random] seed used in random number generator for shuffles, or a rng to draw it from.
       #
       # @return [Array] of p-values
       def mc(permutations = 99, seed = nil)
@@ -118,43 +130,7 @@ module SpatialStats
         # but for each item, hold its value in place and shuffle
         # its neighbors. Then we will only test for that item instead
         # of the entire set. This will be done for each item.
-        rng = gen_rng(seed)
-        rids = crand(permutations, rng)
-
-        n_1 = weights.n - 1
-        sparse = weights.sparse
-        row_index = sparse.row_index
-        ws = sparse.values
-        wc = weights.wc
-        stat_orig = stat
-
-        arr = Numo::DFloat.cast(x)
-        ids = (0..n_1).to_a
-        observations = Array.new(weights.n)
-        (0..n_1).each do |idx|
-          idsi = ids.dup
-          idsi.delete_at(idx)
-          idsi.shuffle!(random: rng)
-          idsi = Numo::Int32.cast(idsi)
-          sample = arr[idsi[rids[true, 0..wc[idx] - 1]]]
-
-          # account for case where there are no neighbors
-          row_range = row_index[idx]..(row_index[idx + 1] - 1)
-          if row_range.size.zero?
-            observations[idx] = permutations
-            next
-          end
-
-          wi = Numo::DFloat.cast(ws[row_range])
-          stat_i_new = mc_i(wi, sample, idx)
-          stat_i_orig = stat_orig[idx]
-          observations[idx] = mc_observation_calc(stat_i_orig, stat_i_new,
-                                                  permutations)
-        end
-
-        observations.map do |ri|
-          (ri + 1.0) / (permutations + 1.0)
-        end
+        conditional_mc(x, permutations, seed)
       end
 
       ##
@@ -166,47 +142,50 @@ module SpatialStats
       # @see https://geodacenter.github.io/glossary.html#perm
       #
       # @param [Integer] permutations to run. Last digit should be 9 to produce round numbers.
-      # @param [Integer] seed used in random number generator for shuffles.
+      # @param [Integer, Random] seed used in random number generator for shuffles, or a rng to draw it from.
       #
       # @return [Array] of p-values
       def mc_bv(permutations, seed)
-        rng = gen_rng(seed)
-        rids = crand(permutations, rng)
-
-        n_1 = weights.n - 1
-        sparse = weights.sparse
-        row_index = sparse.row_index
-        ws = sparse.values
-        wc = weights.wc
-        stat_orig = stat
-
-        arr = Numo::DFloat.cast(y)
-        ids = (0..n_1).to_a
-        observations = Array.new(weights.n)
-        (0..n_1).each do |idx|
-          idsi = ids.dup
-          idsi.delete_at(idx)
-          idsi.shuffle!(random: rng)
-          idsi = Numo::Int32.cast(idsi)
-          sample = arr[idsi[rids[true, 0..wc[idx] - 1]]]
-
-          # account for case where there are no neighbors
-          row_range = row_index[idx]..(row_index[idx + 1] - 1)
-          if row_range.size.zero?
-            observations[idx] = permutations
-            next
-          end
-
-          wi = Numo::DFloat.cast(ws[row_range])
-          stat_i_new = mc_i(wi, sample, idx)
-          stat_i_orig = stat_orig[idx]
-          observations[idx] = mc_observation_calc(stat_i_orig, stat_i_new,
-                                                  permutations)
-        end
+        conditional_mc(y, permutations, seed)
+      end
 
-        observations.map do |ri|
-          (ri + 1.0) / (permutations + 1.0)
+      ##
+      # Sequential permutation test, following Besag and Clifford. Each
+      # observation is permuted until +alpha * (permutations + 1)+ of its
+      # permutations are at least as extreme as +#stat+, at which point it
+      # cannot be significant at +alpha+, or until +permutations+ are run.
+      # Most observations stop early, so the permutations go to the ones
+      # near the threshold.
+      #
+      # Stopped observations have a p-value of count / permutations used,
+      # the others the same p-value as +mc+ would give. Geary's tail is
+      # chosen from its expected value rather than the mean of the
+      # permutations, since it has to be known before permuting.
+      #
+      # @see https://doi.org/10.1093/biomet/78.2.301
+      #
+      # @example
+      #   moran.mc_sequential(9999, 1234, alpha: 0.01)
+      #   # => {p: [0.4326, 0.0021, ...], permutations: [231, 9999, ...]}
+      #
+      # @param [Integer] permutations most to run for an observation.
+      # @param [Integer, Random] seed used in random number generator for shuffles, or a rng to draw it from.
+      # @param [Float] alpha significance level the decision is made at.
+      #
+      # @return [Hash] of +:p+ values and +:permutations+ used for each observation
+      def mc_sequential(permutations = 9999, seed = nil, alpha: 0.05)
+        stop = mc_stop(permutations, alpha)
+        result = weights.unpermute(
+          weights.sparse.local_mc_sequential(mc_kind, weights.permute(mc_factors),
+                                             weights.permute(mc_values), weights.permute(stat),
+                                             permutations, mc_seed(seed), stop,
+                                             SpatialStats.threads, weights.permutation)
+        )
+
+        p_vals = result[:counts].each_with_index.map do |count, idx|
+          sequential_p(count, result[:permutations][idx], permutations, stop)
         end
+        { p: p_vals, permutations: result[:permutations] }
       end
 
       ##
@@ -227,24 +206,8 @@ module SpatialStats
       # @return [Array] of labels
       def quads
         # https://github.com/pysal/esda/blob/master/esda/moran.py#L925
-        z_lag = SpatialStats::Utils::Lag.neighbor_average(weights, z)
-        zp = z.map(&:positive?)
-        lp = z_lag.map(&:positive?)
-
-        # hh = zp & lp
-        # lh = zp ^ true & lp
-        # ll = zp ^ true & lp ^ true
-        # hl = zp next to lp ^ true
-        hh = zp.each_with_index.map { |v, idx| v & lp[idx] }
-        lh = zp.each_with_index.map { |v, idx| (v ^ true) & lp[idx] }
-        ll = zp.each_with_index.map { |v, idx| (v ^ true) & (lp[idx] ^ true) }
-        hl = zp.each_with_index.map { |v, idx| v & (lp[idx] ^ true) }
-
-        # now zip lists and map them to proper terms
         quad_terms = %w[HH LH LL HL]
-        hh.zip(lh, ll, hl).map do |feature|
-          quad_terms[feature.index(true)]
-        end
+        local_stats[:quads].map { |code| quad_terms[code] }
       end
 
       ##
@@ -252,7 +215,7 @@ module SpatialStats
       # in a hash array.
       #
       # @param [Integer] permutations to run. Last digit should be 9 to produce round numbers.
-      # @param [Integer] seed used in random number generator for shuffles.
+      # @param [Integer, Random] seed used in random number generator for shuffles, or a rng to draw it from.
       #
       # @return [Array]
       def summary(permutations = 99, seed = nil)
@@ -265,27 +228,45 @@ module SpatialStats
 
       private
 
-      def stat_i
-        raise NotImplementedError, 'method stat_i not defined'
+      def mc_kind
+        raise NotImplementedError, 'method mc_kind not defined'
       end
 
-      def mc_i
-        raise NotImplementedError, 'method mc_i not defined'
+      def mc_factors
+        raise NotImplementedError, 'method mc_factors not defined'
       end
 
-      def mc_observation_calc(_stat_i_orig, _stat_i_new, _permutations)
-        raise NotImplementedError, 'method mc_observation_calc not defined'
+      # values that are sampled for the neighbors in +mc_sequential+,
+      # the same as +mc+ uses.
+      def mc_values
+        x
       end
 
-      def w
-        @w ||= weights.dense
+      # The stat, quadrants and, for moran, variance and z-score of every
+      # observation, computed in one pass over the weights by the C
+      # extension. Uses the same +mc_kind+ and +mc_factors+ as +mc+.
+      # Inputs and results are in keys order, see +WeightsMatrix#permute+.
+      def local_stats
+        @local_stats ||= weights.unpermute(
+          weights.sparse.local_stats(mc_kind, weights.permute(mc_factors), weights.permute(x))
+        )
       end
 
-      def gen_rng(seed = nil)
-        if seed
-          Random.new(seed)
-        else
-          Random.new
+      # Runs the conditional randomization in the C extension. Each
+      # observation holds its value while +values+ is sampled for its
+      # neighbors. The stat specific parts are defined by +mc_kind+ and
+      # +mc_factors+ in each subclass.
+      #
+      # Each observation samples exactly as many neighbors as it has, so
+      # memory does not grow with the largest row like +crand+ does.
+      def conditional_mc(values, permutations, seed)
+        observations = weights.unpermute(
+          weights.sparse.local_mc(mc_kind, weights.permute(mc_factors), weights.permute(values),
+                                  weights.permute(stat), permutations, mc_seed(seed),
+                                  SpatialStats.threads, weights.permutation)
+        )
+        observations.map do |ri|
+          (ri + 1.0) / (permutations + 1.0)
         end
       end
     end
@@ -32,6 +32,22 @@ module Numo
       self.class.cast(standardized)
     end
 
+    ##
+    # Transform each column so that the mean is 0 and the variance is 1,
+    # using the sample standard deviation like +Enumerable#standardize+.
+    # A 1-D NArray is treated as one column.
+    #
+    # @ example
+    #
+    #   Numo::DFloat [[1, 0], [2, 2], [3, 4]].standardize
+    #   Numo::DFloat [[-1, -1], [0, 0], [1, 1]]
+    #
+    # @return [Numo::NArray]
+    def standardize
+      deviations = self - mean(axis: 0)
+      deviations / Numo::NMath.sqrt((deviations**2).sum(axis: 0) / (shape[0] - 1))
+    end
+
     ##
     # For a 2-D, n x n NArray, if the trace is 0, add an n x n eye matrix to the matrix
     # and return the result.
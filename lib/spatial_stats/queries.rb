@@ -2,6 +2,7 @@
 
 require 'spatial_stats/queries/variables'
 require 'spatial_stats/queries/weights'
+require 'spatial_stats/queries/lag'
 
 module SpatialStats
   # The Queries module contains the ActiveRecord/PostGIS interface for the gem.
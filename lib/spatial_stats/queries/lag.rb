@@ -0,0 +1,108 @@
+# frozen_string_literal: true
+
+module SpatialStats
+  module Queries
+    ##
+    # Lag computes spatial lags inside Postgres. The weights are copied to
+    # a temporary table with binary COPY and joined with the scope, so the
+    # field is never read into Ruby and the lag can be written to a table
+    # instead of sent back.
+    module Lag
+      ##
+      # Sum of the neighbor values of field for every observation in the
+      # scope, weighted by the weights. Rows of the weights must follow
+      # the primary key order of the scope, like the weights builders.
+      #
+      # With +into+ the lags are written to a new table with the primary
+      # key and +lag+ columns, and nothing is returned but its name.
+      #
+      # @example
+      #   weights = SpatialStats::Weights::Contiguous.rook(scope, :geom)
+      #   SpatialStats::Queries::Lag.neighbor_sum(scope, :value, weights)
+      #   # => [2.0, 4.0, ...]
+      #   SpatialStats::Queries::Lag.neighbor_sum(scope, :value, weights, into: 'value_lags')
+      #   # => "value_lags"
+      #
+      # @param [ActiveRecord::Relation] scope you want to query
+      # @param [Symbol, String] field that is lagged
+      # @param [WeightsMatrix] weights of the scope
+      # @param [String, nil] into name of a table to write the lags to
+      # @param [Integer] batch_size rows of weights to copy at a time
+      #
+      # @return [Array, String] lags in primary key order, or the table name
+      def self.neighbor_sum(scope, field, weights, into: nil, batch_size: Weights.batch_size)
+        connection = scope.klass.connection
+        table = "spatial_stats_weights_#{object_id}_#{Thread.current.object_id}"
+
+        connection.transaction do
+          connection.execute(<<-SQL)
+            CREATE TEMPORARY TABLE #{table}
+            (i_idx integer, j_idx integer, weight double precision)
+            ON COMMIT DROP
+          SQL
+          copy(connection, table, weights, batch_size)
+
+          sql = lag_sql(scope, field, table)
+          result = if into
+                     connection.execute("CREATE TABLE #{connection.quote_table_name(into)} AS #{sql}")
+                     into
+                   else
+                     connection.select_rows(sql).map { |row| row[1].to_f }
+                   end
+          connection.execute("DROP TABLE #{table}")
+          result
+        end
+      end
+
+      ##
+      # SQL selecting the primary key and the lag of field for every
+      # observation in the scope, from a table of weights with i_idx,
+      # j_idx and weight columns indexed in primary key order.
+      #
+      # @param [ActiveRecord::Relation] scope you want to query
+      # @param [Symbol, String] field that is lagged
+      # @param [String] table holding the weights
+      #
+      # @return [String]
+      def self.lag_sql(scope, field, table)
+        klass = scope.klass
+        column = klass.connection.quote_column_name(field)
+        primary_key = klass.quoted_primary_key
+        klass.sanitize_sql_array([<<-SQL, scope: scope])
+          WITH idx AS (
+            SELECT scope.#{primary_key} AS id,
+            CAST(scope.#{column} AS double precision) AS field,
+            row_number() OVER (ORDER BY scope.#{primary_key} ASC) - 1 AS idx
+            FROM (:scope) AS scope
+          )
+          SELECT a.id AS #{primary_key}, COALESCE(SUM(w.weight * b.field), 0) AS lag
+          FROM idx AS a
+            LEFT JOIN #{table} AS w ON w.i_idx = a.idx
+            LEFT JOIN idx AS b ON b.idx = w.j_idx
+          GROUP BY a.id, a.idx
+          ORDER BY a.idx
+        SQL
+      end
+
+      # Stream the weights to the table batch_size rows at a time, so the
+      # COPY data is never built for the whole matrix at once. Reordered
+      # weights are written with the index of each observation.
+      def self.copy(connection, table, weights, batch_size)
+        sparse = weights.sparse
+        labels = weights.permutation&.pack('l*')
+        raw = connection.raw_connection
+        raw.copy_data("COPY #{table} (i_idx, j_idx, weight) FROM STDIN (FORMAT binary)") do
+          start = 0
+          loop do
+            stop = [start + batch_size, sparse.n].min
+            raw.put_copy_data(sparse.copy_binary(start, stop, labels))
+            break if stop == sparse.n
+
+            start = stop
+          end
+        end
+      end
+      private_class_method :copy
+    end
+  end
+end
@@ -3,8 +3,8 @@
 module SpatialStats
   module Queries
     ##
-    # Variables includes a method to query a field from a given scope and
-    # keep it in a consistent order with how weights are queried.
+    # Variables includes methods to query fields from a given scope and
+    # keep them in a consistent order with how weights are queried.
     module Variables
       ##
       # Query the given field for a scope and order by primary key
@@ -30,6 +30,53 @@ module SpatialStats
         SQL
         variables.map(&:field)
       end
+
+      ##
+      # Query several fields for a scope in one round trip, ordered by
+      # primary key like +query_field+. Rows are read with +select_rows+,
+      # so no record is built per observation.
+      #
+      # With +standardize: true+ each column is transformed in SQL to
+      # (x - mean)/stdev, with the sample standard deviation, the same as
+      # +Enumerable#standardize+. A column with no variance is all NaN,
+      # as +Enumerable#standardize+ gives.
+      #
+      # NULL values, which +query_field+ returns as nil, are NaN. The mean
+      # and deviation of a standardized column skip them.
+      #
+      # @example
+      #   scope = County.all
+      #   fields = %i[avg_income population]
+      #   SpatialStats::Queries::Variables.query_fields(scope, fields)
+      #   # => Numo::DFloat#shape=[3,2] [[30023, 1200], [23400, 3400], ...]
+      #
+      # @param [ActiveRecord::Relation] scope you want to query
+      # @param [Array] fields you want to query from the scope
+      # @param [Boolean] standardize each field in the query
+      #
+      # @return [Numo::DFloat] n x k matrix, with a column for each field
+      def self.query_fields(scope, fields, standardize: false)
+        klass = scope.klass
+        connection = ActiveRecord::Base.connection
+        primary_key = klass.quoted_primary_key
+        columns = fields.map do |field|
+          column = "CAST(scope.#{connection.quote_column_name(field)} AS double precision)"
+          if standardize
+            "(#{column} - AVG(#{column}) OVER ()) / " \
+              "NULLIF(STDDEV_SAMP(#{column}) OVER (), 0)"
+          else
+            column
+          end
+        end
+
+        rows = connection.select_rows(klass.sanitize_sql_array([<<-SQL, scope: scope]))
+          WITH scope as (:scope)
+          SELECT #{columns.join(', ')} FROM scope
+          ORDER BY scope.#{primary_key} ASC
+        SQL
+        data = rows.flatten.map { |v| v.nil? ? Float::NAN : v.to_f }.pack('d*')
+        Numo::DFloat.from_binary(data, [rows.size, fields.size])
+      end
     end
   end
 end
@@ -7,6 +7,18 @@ module SpatialStats
     # to determine neighbors and weights based on different weighting
     # schemes/formulas.
     module Weights
+      class << self
+        ##
+        # Number of rows fetched at a time by +neighbor_indices+.
+        #
+        # @return [Integer]
+        attr_writer :batch_size
+
+        def batch_size
+          @batch_size ||= 50_000
+        end
+      end
+
       ##
       # Compute inverse distance weighted, k nearest neighbors weights
       # for a given scope and geometry.
@@ -23,39 +35,8 @@ module SpatialStats
       #
       # @return [Hash]
       def self.idw_knn(scope, column, k, alpha = 1)
-        klass = scope.klass
-        column = ActiveRecord::Base.connection.quote_column_name(column)
-        primary_key = klass.quoted_primary_key
-        neighbors = klass.find_by_sql([<<-SQL, scope: scope, k: k])
-          WITH scope as (:scope)
-          SELECT neighbors.*
-          FROM scope AS a
-            CROSS JOIN LATERAL (
-            SELECT a.#{primary_key} as i_id, b.#{primary_key} as j_id,
-            ST_Distance(a.#{column}, b.#{column}) as distance
-            FROM scope as b
-            WHERE a.#{primary_key} <> b.#{primary_key}
-            ORDER BY a.#{column} <-> b.#{column}
-            LIMIT :k
-          ) AS neighbors
-        SQL
-
-        # if the lowest distance is <1, then we need to scale
-        # every distance by the factor that makes the lowest 1
-        min_dist = neighbors.map(&:distance).min
-        scale = if min_dist < 1
-                  1 / min_dist
-                else
-                  1
-                end
-
-        neighbors.map do |neighbor|
-          # formula is 1/(d^alpha)
-          weight = 1.0 / ((scale * neighbor.distance)**alpha)
-          hash = neighbor.as_json.symbolize_keys
-          hash[:weight] = weight
-          hash
-        end
+        neighbors = scope.klass.find_by_sql(knn_sql(scope, column, k, distance: true))
+        idw(neighbors, alpha)
       end
 
       ##
@@ -74,37 +55,10 @@ module SpatialStats
       #
       # @return [Hash]
       def self.idw_band(scope, column, bandwidth, alpha = 1)
-        klass = scope.klass
-        column = ActiveRecord::Base.connection.quote_column_name(column)
-        primary_key = klass.quoted_primary_key
-        neighbors = klass.find_by_sql([<<-SQL, scope: scope, bandwidth: bandwidth])
-          WITH neighbors AS (
-            WITH scope AS (:scope)
-            SELECT a.#{primary_key} as i_id, b.#{primary_key} as j_id,
-            ST_DWithin(a.#{column}, b.#{column}, :bandwidth) as is_neighbor,
-            ST_Distance(a.#{column}, b.#{column}) as distance
-            FROM scope as a, scope as b
-            ORDER BY i_id
-          )
-          SELECT * FROM neighbors WHERE is_neighbor = 't' AND i_id <> j_id
-        SQL
-
-        # if the lowest distance is <1, then we need to scale
-        # every distance by the factor that makes the lowest 1
-        min_dist = neighbors.map(&:distance).min
-        scale = if min_dist < 1
-                  1 / min_dist
-                else
-                  1
-                end
-
-        neighbors.map do |neighbor|
-          # formula is 1/(d^alpha)
-          weight = 1.0 / ((scale * neighbor.distance)**alpha)
-          hash = neighbor.as_json.symbolize_keys
-          hash[:weight] = weight
-          hash
-        end
+        neighbors = scope.klass.find_by_sql(
+          distance_band_sql(scope, column, bandwidth, distance: true)
+        )
+        idw(neighbors, alpha)
       end
 
       ##
@@ -116,21 +70,7 @@ module SpatialStats
       #
       # @return [Hash]
       def self.knn(scope, column, k)
-        klass = scope.klass
-        column = ActiveRecord::Base.connection.quote_column_name(column)
-        primary_key = klass.quoted_primary_key
-        klass.find_by_sql([<<-SQL, scope: scope, k: k])
-          WITH scope as (:scope)
-          SELECT neighbors.*
-          FROM scope AS a
-            CROSS JOIN LATERAL (
-            SELECT a.#{primary_key} as i_id, b.#{primary_key} as j_id
-            FROM scope as b
-            WHERE a.#{primary_key} <> b.#{primary_key}
-            ORDER BY a.#{column} <-> b.#{column}
-            LIMIT :k
-          ) AS neighbors
-        SQL
+        scope.klass.find_by_sql(knn_sql(scope, column, k))
       end
 
       ##
@@ -144,19 +84,7 @@ module SpatialStats
       #
       # @return [Hash]
       def self.distance_band_neighbors(scope, column, bandwidth)
-        klass = scope.klass
-        column = ActiveRecord::Base.connection.quote_column_name(column)
-        primary_key = klass.quoted_primary_key
-        klass.find_by_sql([<<-SQL, scope: scope, distance: bandwidth])
-          WITH neighbors AS (
-            WITH scope AS (:scope)
-            SELECT a.#{primary_key} as i_id, b.#{primary_key} as j_id,
-            ST_DWithin(a.#{column}, b.#{column}, :distance) as is_neighbor
-            FROM scope as a, scope as b
-            ORDER BY i_id
-          )
-          SELECT * FROM neighbors WHERE is_neighbor = 't' AND i_id <> j_id
-        SQL
+        scope.klass.find_by_sql(distance_band_sql(scope, column, bandwidth))
       end
 
       ##
@@ -190,8 +118,8 @@ module SpatialStats
 
       ##
       # Generic function to compute contiguity neighbor weights for a
-      # given scope. Takes any valid DE-9IM pattern and computes the
-      # neighbors based off of that.
+      # given scope. Takes any valid DE-9IM pattern that implies the
+      # geometries intersect and computes the neighbors based off of that.
       #
       # @see https://en.wikipedia.org/wiki/DE-9IM
       #
@@ -201,20 +129,246 @@ module SpatialStats
       #
       # @return [Hash]
       def self._contiguity_neighbors(scope, column, pattern)
+        scope.klass.find_by_sql(contiguity_sql(scope, column, pattern))
+      end
+
+      ##
+      # Stream the neighbor pairs of a query into packed buffers of row
+      # indices, ready for +CSRMatrix.from_coo+. Indices follow the primary
+      # key order of the scope, the same order as +Variables.query_field+.
+      #
+      # Pairs are sorted by row, then column. Rows are read from a server
+      # side cursor +batch_size+ at a time, so no ActiveRecord object is
+      # created per pair and memory stays proportional to the number of
+      # pairs.
+      #
+      # @example
+      #   sql = SpatialStats::Queries::Weights.contiguity_sql(scope, :geom, 'F***1****')
+      #   pairs = SpatialStats::Queries::Weights.neighbor_indices(scope, sql)
+      #   CSRMatrix.from_coo(pairs[:i_idx], pairs[:j_idx], 1, scope.count)
+      #
+      # @param [ActiveRecord::Relation] scope the pairs were queried from
+      # @param [String] pairs_sql selecting i_id, j_id and optionally distance
+      # @param [Boolean] distance also stream the distance column
+      # @param [Integer] batch_size rows to fetch at a time
+      #
+      # @return [Hash] of packed int32 +:i_idx+ and +:j_idx+, and packed double +:distance+ if requested
+      def self.neighbor_indices(scope, pairs_sql, distance: false, batch_size: self.batch_size)
         klass = scope.klass
-        column = ActiveRecord::Base.connection.quote_column_name(column)
         primary_key = klass.quoted_primary_key
-        klass.find_by_sql([<<-SQL, scope: scope])
-          WITH neighbors AS (
-            WITH scope AS (:scope)
-            SELECT a.#{primary_key} as i_id, b.#{primary_key} as j_id,
-            ST_RELATE(a.#{column}, b.#{column}, \'#{pattern}\') as is_neighbor
-            FROM scope as a, scope as b
-            ORDER BY i_id
+        sql = <<-SQL
+          WITH pairs AS (#{pairs_sql}),
+          idx AS (
+            SELECT scope.#{primary_key} AS id,
+            row_number() OVER (ORDER BY scope.#{primary_key} ASC) - 1 AS idx
+            FROM (#{scope.to_sql}) AS scope
           )
-          SELECT * FROM neighbors WHERE is_neighbor = 't'
+          SELECT a.idx, b.idx#{', pairs.distance' if distance}
+          FROM pairs
+            JOIN idx AS a ON a.id = pairs.i_id
+            JOIN idx AS b ON b.id = pairs.j_id
+          ORDER BY a.idx, b.idx
+        SQL
+
+        result = { i_idx: String.new, j_idx: String.new }
+        result[:distance] = String.new if distance
+
+        each_batch(klass.connection, sql, batch_size) do |rows|
+          result[:i_idx] << rows.map { |row| row[0].to_i }.pack('l*')
+          result[:j_idx] << rows.map { |row| row[1].to_i }.pack('l*')
+          result[:distance] << rows.map { |row| row[2].to_f }.pack('d*') if distance
+        end
+        result
+      end
+
+      ##
+      # Query the x and y coordinates of a point column, ordered by primary
+      # key like +neighbor_indices+, for the native +CSRMatrix.knn_pairs+
+      # and +CSRMatrix.band_pairs+. Null geometries are NaN, so they get
+      # no neighbors.
+      #
+      # With +centroid: true+ the coordinates are the centroids of any
+      # geometry, like polygons for +WeightsMatrix#reorder(:hilbert)+.
+      #
+      # @param [ActiveRecord::Relation] scope you want to query
+      # @param [Symbol, String] column that contains the point geometry
+      # @param [Boolean] centroid query the centroid of each geometry
+      #
+      # @return [Hash] of packed double +:x+ and +:y+
+      def self.point_coordinates(scope, column, centroid: false)
+        klass = scope.klass
+        connection = klass.connection
+        column = "scope.#{connection.quote_column_name(column)}"
+        column = "ST_Centroid(#{column})" if centroid
+        primary_key = klass.quoted_primary_key
+        rows = connection.select_rows(klass.sanitize_sql_array([<<-SQL, scope: scope]))
+          SELECT ST_X(#{column}), ST_Y(#{column})
+          FROM (:scope) AS scope
+          ORDER BY scope.#{primary_key} ASC
         SQL
+
+        coordinates = rows.map do |row|
+          row.map { |value| value.nil? ? Float::NAN : value.to_f }
+        end
+        {
+          x: coordinates.map(&:first).pack('d*'),
+          y: coordinates.map(&:last).pack('d*')
+        }
+      end
+
+      ##
+      # SQL selecting the i_id and j_id of k nearest neighbors, and their
+      # distance if requested.
+      #
+      # The scope is joined as two subqueries instead of a CTE, which
+      # Postgres would materialize, so the lateral +<->+ order can walk a
+      # GiST index on the geometry column.
+      #
+      # @param [ActiveRecord::Relation] scope you want to query
+      # @param [Symbol, String] column that contains the geometry
+      # @param [Integer] k neighbors to find
+      # @param [Boolean] distance select the distance between neighbors
+      #
+      # @return [String]
+      def self.knn_sql(scope, column, k, distance: false)
+        klass = scope.klass
+        column = ActiveRecord::Base.connection.quote_column_name(column)
+        primary_key = klass.quoted_primary_key
+        distance_sql = ", ST_Distance(a.#{column}, b.#{column}) as distance" if distance
+        klass.sanitize_sql_array([<<-SQL, scope: scope, k: k])
+          SELECT neighbors.*
+          FROM (:scope) AS a
+            CROSS JOIN LATERAL (
+            SELECT a.#{primary_key} as i_id, b.#{primary_key} as j_id#{distance_sql}
+            FROM (:scope) as b
+            WHERE a.#{primary_key} <> b.#{primary_key}
+            ORDER BY a.#{column} <-> b.#{column}
+            LIMIT :k
+          ) AS neighbors
+        SQL
+      end
+
+      ##
+      # SQL selecting the i_id and j_id of neighbors in a distance band,
+      # and their distance if requested.
+      #
+      # The pairs come from a join on +ST_DWithin+, which a GiST index on
+      # the geometry column can answer, so only pairs in the band are
+      # compared instead of every pair in the scope.
+      #
+      # @param [ActiveRecord::Relation] scope you want to query
+      # @param [Symbol, String] column that contains the geometry
+      # @param [Numeric] bandwidth to find neighbors in
+      # @param [Boolean] distance select the distance between neighbors
+      # @param [Array, nil] ids only select pairs where either key is in ids
+      #
+      # @return [String]
+      def self.distance_band_sql(scope, column, bandwidth, distance: false, ids: nil)
+        klass = scope.klass
+        column = ActiveRecord::Base.connection.quote_column_name(column)
+        primary_key = klass.quoted_primary_key
+        distance_sql = ",\nST_Distance(a.#{column}, b.#{column}) as distance" if distance
+        klass.sanitize_sql_array([<<-SQL, scope: scope, distance: bandwidth, ids: ids])
+          SELECT a.#{primary_key} as i_id, b.#{primary_key} as j_id#{distance_sql}
+          FROM (:scope) AS a
+            JOIN (:scope) AS b
+            ON ST_DWithin(a.#{column}, b.#{column}, :distance)
+          WHERE a.#{primary_key} <> b.#{primary_key}
+            #{ids_sql(primary_key, ids)}
+          ORDER BY i_id
+        SQL
+      end
+
+      ##
+      # SQL selecting the i_id and j_id of neighbors that match a DE-9IM
+      # pattern.
+      #
+      # The join is on +ST_Intersects+, which a GiST index can answer, and
+      # +ST_Relate+ only runs on the pairs that intersect. The pattern must
+      # imply the geometries intersect, like the rook and queen patterns.
+      #
+      # @param [ActiveRecord::Relation] scope you want to query
+      # @param [Symbol, String] column that contains the geometry
+      # @param [String] pattern to describe neighbor relation
+      # @param [Array, nil] ids only select pairs where either key is in ids
+      #
+      # @return [String]
+      def self.contiguity_sql(scope, column, pattern, ids: nil)
+        klass = scope.klass
+        column = ActiveRecord::Base.connection.quote_column_name(column)
+        primary_key = klass.quoted_primary_key
+        klass.sanitize_sql_array([<<-SQL, scope: scope, ids: ids])
+          SELECT a.#{primary_key} as i_id, b.#{primary_key} as j_id
+          FROM (:scope) AS a
+            JOIN (:scope) AS b
+            ON ST_Intersects(a.#{column}, b.#{column})
+          WHERE ST_Relate(a.#{column}, b.#{column}, \'#{pattern}\')
+            #{ids_sql(primary_key, ids)}
+          ORDER BY i_id
+        SQL
+      end
+
+      # Restrict a self join of scope as a and b to the pairs that touch
+      # ids, so only their rows and columns are queried. The ids are bound
+      # by the caller as :ids.
+      def self.ids_sql(primary_key, ids)
+        return '' if ids.nil?
+
+        "AND (a.#{primary_key} IN (:ids) OR b.#{primary_key} IN (:ids))"
+      end
+      private_class_method :ids_sql
+
+      ##
+      # Inverse distance weights, 1/(d**alpha). If the lowest distance
+      # is < 1, every distance is scaled by the factor that makes the
+      # lowest 1.
+      #
+      # @param [Array, Numo::DFloat] distances between neighbors
+      # @param [Integer] alpha number used in inverse calculations (usually 1 or 2)
+      #
+      # @return [Array, Numo::DFloat] weights, the same type as distances
+      def self.idw_weights(distances, alpha)
+        return distances if distances.size.zero?
+
+        min_dist = distances.min
+        scale = if min_dist < 1
+                  1 / min_dist
+                else
+                  1
+                end
+
+        if distances.is_a?(Array)
+          distances.map { |distance| 1.0 / ((scale * distance)**alpha) }
+        else
+          1.0 / ((distances * scale)**alpha)
+        end
+      end
+
+      def self.idw(neighbors, alpha)
+        weights = idw_weights(neighbors.map(&:distance), alpha)
+
+        neighbors.each_with_index.map do |neighbor, idx|
+          hash = neighbor.as_json.symbolize_keys
+          hash[:weight] = weights[idx]
+          hash
+        end
+      end
+      private_class_method :idw
+
+      def self.each_batch(connection, sql, batch_size)
+        cursor = "spatial_stats_#{object_id}_#{Thread.current.object_id}"
+        connection.transaction do
+          connection.execute("DECLARE #{cursor} NO SCROLL CURSOR FOR #{sql}")
+          loop do
+            rows = connection.select_rows("FETCH FORWARD #{Integer(batch_size)} FROM #{cursor}")
+            break if rows.empty?
+
+            yield rows
+          end
+          connection.execute("CLOSE #{cursor}")
+        end
       end
+      private_class_method :each_batch
     end
   end
 end
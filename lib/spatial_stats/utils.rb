@@ -1,6 +1,7 @@
 # frozen_string_literal: true
 
 require 'spatial_stats/utils/lag'
+require 'spatial_stats/utils/permutation'
 
 module SpatialStats
   ##
@@ -6,29 +6,68 @@ module SpatialStats
     ##
     # Lag includes methdos for computing spatially lagged variables under
     # different contexts.
+    #
+    # Every method also takes a field and +scope:+ instead of a vector, to
+    # compute the lag inside Postgres with +Queries::Lag+, and +into:+ to
+    # write it to a table there instead of returning it.
+    #
+    # The variables can also be an n x k Numo::DFloat, one variable per
+    # column. All k lags are computed with +CSRMatrix#mulmat+, which
+    # walks the weights once for up to 64 columns instead of once per
+    # variable, and are returned as an n x k Numo::DFloat.
+    #
+    # With +block_size:+ the lag is computed +block_size+ rows at a
+    # time with +CSRMatrix#row_block+, reading only the values of the
+    # halo of each block. Variables can then also be a callable that
+    # takes the halo indices and returns their values, so neither the
+    # weights, when loaded with mmap, nor the variables need to be held
+    # in memory at once.
+    #
+    # @example
+    #   weights = SpatialStats::Weights::Contiguous.rook(scope, :geom)
+    #   SpatialStats::Utils::Lag.neighbor_average(weights, :value, scope: scope, into: 'value_lags')
+    #
+    #   fields = SpatialStats::Queries::Variables.query_fields(scope, %i[income age])
+    #   SpatialStats::Utils::Lag.neighbor_average(weights, fields)
+    #
+    #   weights = SpatialStats::Weights::WeightsMatrix.load('tmp/weights.csr')
+    #   SpatialStats::Utils::Lag.neighbor_sum(weights, ->(ids) { values.values_at(*ids) }, block_size: 100_000)
     module Lag
       ##
       # Dot product of the row_standardized input matrix
       # by the input vector, variables.
       #
       # @param [WeightsMatrix] matrix holding target weights.
-      # @param [Array] variables vector multiplying the matrix
+      # @param [Array, Numo::DFloat, Symbol, #call] variables vector or n x k matrix multiplying the matrix, or a field of scope
+      # @param [ActiveRecord::Relation, nil] scope to lag the field of inside Postgres
+      # @param [String, nil] into table to write the lag of the field to
+      # @param [Integer, nil] block_size rows to lag at a time
       #
-      # @return [Array] resultant vector
-      def self.neighbor_average(matrix, variables)
+      # @return [Array, Numo::DFloat, String] resultant vector or n x k matrix, the same type as variables, or the table name
+      def self.neighbor_average(matrix, variables, scope: nil, into: nil, block_size: nil)
         matrix = matrix.standardize
-        neighbor_sum(matrix, variables)
+        neighbor_sum(matrix, variables, scope: scope, into: into, block_size: block_size)
       end
 
       ##
       # Dot product of the input matrix by the input vector, variables.
       #
       # @param [WeightsMatrix] matrix holding target weights.
-      # @param [Array] variables vector multiplying the matrix
+      # @param [Array, Numo::DFloat, Symbol, #call] variables vector or n x k matrix multiplying the matrix, or a field of scope
+      # @param [ActiveRecord::Relation, nil] scope to lag the field of inside Postgres
+      # @param [String, nil] into table to write the lag of the field to
+      # @param [Integer, nil] block_size rows to lag at a time
       #
-      # @return [Array] resultant vector
-      def self.neighbor_sum(matrix, variables)
-        matrix.sparse.mulvec(variables)
+      # @return [Array, Numo::DFloat, String] resultant vector or n x k matrix, the same type as variables, or the table name
+      def self.neighbor_sum(matrix, variables, scope: nil, into: nil, block_size: nil)
+        if scope
+          return SpatialStats::Queries::Lag.neighbor_sum(scope, variables, matrix, into: into)
+        end
+        return block_sum(matrix, variables, block_size) if block_size
+
+        variables = matrix.permute(variables)
+        lags = columns?(variables) ? matrix.sparse.mulmat(variables) : matrix.sparse.mulvec(variables)
+        matrix.unpermute(lags)
       end
 
       ##
@@ -36,12 +75,15 @@ module SpatialStats
       # the input vector, variables.
       #
       # @param [WeightsMatrix] matrix holding target weights.
-      # @param [Array] variables vector multiplying the matrix
+      # @param [Array, Numo::DFloat, Symbol, #call] variables vector or n x k matrix multiplying the matrix, or a field of scope
+      # @param [ActiveRecord::Relation, nil] scope to lag the field of inside Postgres
+      # @param [String, nil] into table to write the lag of the field to
+      # @param [Integer, nil] block_size rows to lag at a time
       #
-      # @return [Array] resultant vector
-      def self.window_average(matrix, variables)
+      # @return [Array, Numo::DFloat, String] resultant vector or n x k matrix, the same type as variables, or the table name
+      def self.window_average(matrix, variables, scope: nil, into: nil, block_size: nil)
         matrix = matrix.window.standardize
-        window_sum(matrix, variables)
+        neighbor_sum(matrix, variables, scope: scope, into: into, block_size: block_size)
       end
 
       ##
@@ -49,13 +91,60 @@ module SpatialStats
       # the input vector, variables.
       #
       # @param [WeightsMatrix] matrix holding target weights.
-      # @param [Array] variables vector multiplying the matrix
+      # @param [Array, Numo::DFloat, Symbol, #call] variables vector or n x k matrix multiplying the matrix, or a field of scope
+      # @param [ActiveRecord::Relation, nil] scope to lag the field of inside Postgres
+      # @param [String, nil] into table to write the lag of the field to
+      # @param [Integer, nil] block_size rows to lag at a time
       #
-      # @return [Array] resultant vector
-      def self.window_sum(matrix, variables)
-        matrix = matrix.window
-        matrix.sparse.mulvec(variables)
+      # @return [Array, Numo::DFloat, String] resultant vector or n x k matrix, the same type as variables, or the table name
+      def self.window_sum(matrix, variables, scope: nil, into: nil, block_size: nil)
+        neighbor_sum(matrix.window, variables, scope: scope, into: into, block_size: block_size)
+      end
+
+      # Lag the rows of sparse block_size at a time, gathering the values
+      # of each block's halo from variables. The halo of reordered weights
+      # is mapped back to keys order, so variables are indexed the same.
+      # Rows of a block with no neighbors have no halo and keep a 0 lag.
+      def self.block_sum(matrix, variables, block_size)
+        raise ArgumentError, 'block_size must be >= 1' unless block_size >= 1
+
+        sparse = matrix.sparse
+        lags = if columns?(variables)
+                 Numo::DFloat.zeros(sparse.n, variables.shape[1])
+               else
+                 Array.new(sparse.n, 0.0)
+               end
+        (0...sparse.n).step(block_size) do |start|
+          stop = [start + block_size, sparse.n].min
+          block, halo = sparse.row_block(start, stop)
+          next if halo.empty?
+
+          halo = matrix.permutation.values_at(*halo) if matrix.permutation
+          values = if variables.respond_to?(:call)
+                     variables.call(halo)
+                   elsif columns?(variables)
+                     variables[halo, true]
+                   elsif variables.is_a?(Numo::NArray)
+                     variables[halo]
+                   else
+                     variables.values_at(*halo)
+                   end
+          if columns?(values)
+            lags = Numo::DFloat.zeros(sparse.n, values.shape[1]) unless lags.is_a?(Numo::NArray)
+            lags[start...stop, true] = block.mulmat(values)
+          else
+            lags[start...stop] = block.mulvec(values).to_a
+          end
+        end
+        lags = matrix.unpermute(lags)
+        variables.is_a?(Numo::NArray) && !lags.is_a?(Numo::NArray) ? Numo::DFloat.cast(lags) : lags
+      end
+
+      # whether variables hold one variable per column
+      def self.columns?(variables)
+        variables.is_a?(Numo::NArray) && variables.ndim == 2
       end
+      private_class_method :block_sum, :columns?
     end
   end
 end
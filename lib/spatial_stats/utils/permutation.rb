@@ -0,0 +1,34 @@
+# frozen_string_literal: true
+
+module SpatialStats
+  module Utils
+    ##
+    # Permutation holds the seeding and the Besag-Clifford stopping rule
+    # shared by the permutation tests of the local and global stats.
+    # Its methods are private to the stats that include it.
+    module Permutation
+      private
+
+      # The native streams are seeded from an Integer, a random one
+      # when no seed is given. A Random is drawn from once, so batches
+      # of a sequential test can offset the same seed.
+      def mc_seed(seed)
+        seed = seed.rand(2**64) if seed.is_a?(Random)
+        seed || Random.new_seed
+      end
+
+      # count at which a sequential test can no longer be significant
+      def mc_stop(permutations, alpha)
+        [(alpha * (permutations + 1)).floor, 1].max
+      end
+
+      def sequential_p(count, used, permutations, stop)
+        if count >= stop
+          count.to_f / used
+        else
+          (count + 1.0) / (permutations + 1.0)
+        end
+      end
+    end
+  end
+end
@@ -3,6 +3,7 @@
 require 'spatial_stats/weights/contiguous'
 require 'spatial_stats/weights/distant'
 require 'spatial_stats/weights/weights_matrix'
+require 'spatial_stats/weights/cache'
 
 module SpatialStats
   ##
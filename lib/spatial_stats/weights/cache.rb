@@ -0,0 +1,172 @@
+# frozen_string_literal: true
+
+require 'digest'
+require 'fileutils'
+
+module SpatialStats
+  module Weights
+    ##
+    # Cache stores built weights matrices so the same weights are not
+    # queried again for every statistic. Entries are keyed by the SQL of
+    # the scope, the weights method and its parameters, and kept in memory.
+    # If a +directory+ is set, entries are also written there with
+    # +WeightsMatrix#dump+ and memory mapped on load, so other processes
+    # and restarts can reuse them. Weights loaded from a file get back
+    # their +distances+, written next to them, and the +pairs_query+ of
+    # their method, so they can be updated and reweighted like the
+    # weights that were built.
+    #
+    # @example
+    #   SpatialStats::Weights::Cache.directory = Rails.root.join('tmp/weights')
+    #   SpatialStats::Weights::Cache.max_age = 1.day
+    #
+    #   weights = SpatialStats::Weights::Cache.fetch(scope, :queen, :geom)
+    #   weights = SpatialStats::Weights::Cache.fetch(scope, :knn, :geom, 8)
+    #   weights = SpatialStats::Weights::Cache.fetch(scope, :knn, :position, 8, native: true)
+    module Cache
+      BUILDERS = {
+        rook: Contiguous,
+        queen: Contiguous,
+        distance_band: Distant,
+        knn: Distant,
+        idw_band: Distant,
+        idw_knn: Distant
+      }.freeze
+
+      @entries = {}
+      @lock = Mutex.new
+
+      class << self
+        ##
+        # Directory where weights are written to and loaded from. If nil,
+        # weights are only cached in memory.
+        #
+        # @return [String, Pathname, nil]
+        attr_accessor :directory
+
+        ##
+        # Default number of seconds an entry is valid for. If nil, entries
+        # are valid until they are invalidated.
+        #
+        # @return [Numeric, nil]
+        attr_accessor :max_age
+      end
+
+      ##
+      # Cached weights for the scope, method and parameters. If there is
+      # no valid entry, the weights are built with the matching method of
+      # +Contiguous+ or +Distant+ and cached.
+      #
+      # @param [ActiveRecord::Relation] scope to query
+      # @param [Symbol] method of weights, ex. +:queen+ or +:knn+
+      # @param [Array] params passed to the weights method after scope
+      # @param [Numeric, nil] max_age in seconds, overrides +Cache.max_age+
+      # @param [Hash] options keywords passed to the weights method, ex. +native: true+
+      #
+      # @return [WeightsMatrix]
+      def self.fetch(scope, method, *params, max_age: self.max_age, **options)
+        builder = BUILDERS[method.to_sym]
+        raise ArgumentError, "Unknown weights method #{method}" unless builder
+
+        key = key(scope, method, params, options)
+        weights = read(key, max_age) do |loaded|
+          loaded.pairs_query = builder.pairs_query(method.to_sym, scope, *params, **options)
+        end
+        return weights if weights
+
+        weights = builder.public_send(method, scope, *params, **options)
+        write(key, weights)
+        weights
+      end
+
+      ##
+      # Remove the entry for the scope, method and parameters from memory
+      # and +directory+.
+      #
+      # @param [ActiveRecord::Relation] scope to query
+      # @param [Symbol] method of weights
+      # @param [Array] params passed to the weights method after scope
+      # @param [Hash] options keywords passed to the weights method
+      def self.invalidate(scope, method, *params, **options)
+        key = key(scope, method, params, options)
+        @lock.synchronize { @entries.delete(key) }
+
+        path = path(key)
+        FileUtils.rm_f([path, distances_path(path)]) if path
+      end
+
+      ##
+      # Remove every entry from memory and +directory+.
+      def self.clear
+        @lock.synchronize { @entries.clear }
+        return unless directory
+
+        FileUtils.rm_f(Dir.glob(File.join(directory.to_s, '*.{weights,distances}')))
+      end
+
+      ##
+      # Digest that identifies an entry.
+      #
+      # @param [ActiveRecord::Relation] scope to query
+      # @param [Symbol] method of weights
+      # @param [Array] params passed to the weights method after scope
+      # @param [Hash] options keywords passed to the weights method
+      #
+      # @return [String]
+      def self.key(scope, method, params, options = {})
+        parts = [scope.to_sql, method.to_s, params.map(&:to_s)]
+        parts << options.sort.map { |name, value| [name.to_s, value.to_s] } unless options.empty?
+        Digest::SHA256.hexdigest(parts.inspect)
+      end
+
+      # The entry in memory, or the one in +directory+, which is yielded
+      # to restore what the file does not hold before it is cached.
+      def self.read(key, max_age)
+        entry = @lock.synchronize { @entries[key] }
+        return entry[:weights] if entry && fresh?(entry[:created_at], max_age)
+
+        path = path(key)
+        return unless path && File.exist?(path) && fresh?(File.mtime(path), max_age)
+
+        weights = WeightsMatrix.load(path)
+        distances = distances_path(path)
+        weights.distances = CSRMatrix.load(distances) if File.exist?(distances)
+        yield weights
+        @lock.synchronize do
+          @entries[key] = { weights: weights, created_at: File.mtime(path) }
+        end
+        weights
+      end
+      private_class_method :read
+
+      def self.write(key, weights)
+        @lock.synchronize do
+          @entries[key] = { weights: weights, created_at: Time.now }
+        end
+
+        path = path(key)
+        return unless path
+
+        FileUtils.mkdir_p(directory.to_s)
+        weights.distances&.dump(distances_path(path))
+        weights.dump(path)
+      end
+      private_class_method :write
+
+      def self.path(key)
+        File.join(directory.to_s, "#{key}.weights") if directory
+      end
+      private_class_method :path
+
+      def self.distances_path(path)
+        path.sub(/\.weights\z/, '.distances')
+      end
+      private_class_method :distances_path
+
+      def self.fresh?(created_at, max_age)
+        max_age.nil? || Time.now - created_at < max_age
+      end
+      private_class_method :fresh?
+    end
+  end
+end
@@ -7,6 +7,9 @@ module SpatialStats
     # coniguous weights queries and formats the result properly to utilize
     # a weights matrix.
     module Contiguous
+      # DE-9IM pattern of the neighbors of each method
+      PATTERNS = { rook: 'F***1****', queen: 'F***T****' }.freeze
+
       ##
       # Compute rook weights matrix for a scope.
       #
@@ -15,26 +18,7 @@ module SpatialStats
       #
       # @return [WeightsMatrix]
       def self.rook(scope, field)
-        neighbors = SpatialStats::Queries::Weights
-                    .rook_contiguity_neighbors(scope, field)
-
-        # get keys to make sure we have consistent dimensions when
-        # some entries don't have neighbors.
-        # define a new hash that has all the keys from scope
-        keys = SpatialStats::Queries::Variables.query_field(scope, scope.klass.primary_key)
-
-        neighbors = neighbors.group_by(&:i_id)
-        missing_neighbors = Hash[(keys - neighbors.keys).map { |key| [key, []] }]
-        neighbors = neighbors.merge(missing_neighbors)
-
-        weights = neighbors.transform_values do |value|
-          value.map do |neighbor|
-            hash = { id: neighbor[:j_id] }
-            hash[:weight] = 1
-            hash
-          end
-        end
-        SpatialStats::Weights::WeightsMatrix.new(weights)
+        from_pairs(scope, :rook, field)
       end
 
       ##
@@ -45,27 +29,42 @@ module SpatialStats
       #
       # @return [WeightsMatrix]
       def self.queen(scope, field)
-        neighbors = SpatialStats::Queries::Weights
-                    .queen_contiguity_neighbors(scope, field)
-
-        # get keys to make sure we have consistent dimensions when
-        # some entries don't have neighbors.
-        # define a new hash that has all the keys from scope
-        keys = SpatialStats::Queries::Variables.query_field(scope, scope.klass.primary_key)
-
-        neighbors = neighbors.group_by(&:i_id)
-        missing_neighbors = Hash[(keys - neighbors.keys).map { |key| [key, []] }]
-        neighbors = neighbors.merge(missing_neighbors)
+        from_pairs(scope, :queen, field)
+      end
 
-        weights = neighbors.transform_values do |value|
-          value.map do |neighbor|
-            hash = { id: neighbor[:j_id] }
-            hash[:weight] = 1
-            hash
-          end
+      ##
+      # Query of the neighbor pairs that include some keys, which
+      # +WeightsMatrix#update+ calls. Set on the weights built by +rook+
+      # and +queen+, and restored by +Cache+ on weights loaded from a file.
+      #
+      # @param [Symbol] method of weights, +:rook+ or +:queen+
+      # @param [ActiveRecord::Relation] scope to query
+      # @param [Symbol, String] field with geometry in it
+      #
+      # @return [Proc] taking the keys and returning their pairs like +Queries::Weights.neighbor_indices+
+      def self.pairs_query(method, scope, field)
+        pattern = PATTERNS.fetch(method.to_sym)
+        lambda do |ids|
+          sql = SpatialStats::Queries::Weights
+                .contiguity_sql(scope, field, pattern, ids: ids)
+          SpatialStats::Queries::Weights.neighbor_indices(scope, sql)
         end
-        SpatialStats::Weights::WeightsMatrix.new(weights)
       end
+
+      # Stream the neighbor pairs into packed row indices, so rows follow
+      # the order of the keys and line up with queried variables. Entries
+      # without neighbors still get an empty row.
+      def self.from_pairs(scope, method, field)
+        sql = SpatialStats::Queries::Weights
+              .contiguity_sql(scope, field, PATTERNS.fetch(method))
+        keys = SpatialStats::Queries::Variables.query_field(scope, scope.klass.primary_key)
+        pairs = SpatialStats::Queries::Weights.neighbor_indices(scope, sql)
+        sparse = CSRMatrix.from_coo(pairs[:i_idx], pairs[:j_idx], 1, keys.size)
+        weights = SpatialStats::Weights::WeightsMatrix.from_sparse(keys, sparse)
+        weights.pairs_query = pairs_query(method, scope, field)
+        weights
+      end
+      private_class_method :from_pairs
     end
   end
 end
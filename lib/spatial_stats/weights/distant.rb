@@ -5,6 +5,20 @@ module SpatialStats
     # Distant weights module includes methods that provide an interface to
     # distance-based weights queries and formats the result properly to utilize
     # a weights matrix.
+    #
+    # For point columns, +native: true+ queries the coordinates once and
+    # finds the neighbors with a grid index in the C extension, instead of
+    # joining the scope with itself in PostGIS. Distances are planar, so
+    # the geometries should be in a projected SRID.
+    #
+    # The weights keep the distance of every pair in
+    # +WeightsMatrix#distances+, so other inverse distance or kernel
+    # weights can be derived without querying again.
+    #
+    # @example
+    #   weights = SpatialStats::Weights::Distant.knn(scope, :position, 8)
+    #   weights.inverse_distance(2)
+    #   weights.kernel(:bisquare, 500)
     module Distant
       ##
       # Compute distance band weights matrix for a scope.
@@ -12,29 +26,12 @@ module SpatialStats
       # @param [ActiveRecord::Relation] scope to query
       # @param [Symbol, String] field with geometry in it
       # @param [Numeric] bandwidth of distance band
+      # @param [Boolean] native find the neighbors of points in the C extension
       #
       # @return [WeightsMatrix]
-      def self.distance_band(scope, field, bandwidth)
-        neighbors = SpatialStats::Queries::Weights
-                    .distance_band_neighbors(scope, field, bandwidth)
-
-        # get keys to make sure we have consistent dimensions when
-        # some entries don't have neighbors.
-        # define a new hash that has all the keys from scope
-        keys = SpatialStats::Queries::Variables.query_field(scope, scope.klass.primary_key)
-
-        neighbors = neighbors.group_by(&:i_id)
-        missing_neighbors = Hash[(keys - neighbors.keys).map { |key| [key, []] }]
-        neighbors = neighbors.merge(missing_neighbors)
-
-        weights = neighbors.transform_values do |value|
-          value.map do |neighbor|
-            hash = { id: neighbor[:j_id] }
-            hash[:weight] = 1
-            hash
-          end
-        end
-        SpatialStats::Weights::WeightsMatrix.new(weights)
+      def self.distance_band(scope, field, bandwidth, native: false)
+        pairs = band_pairs(scope, field, bandwidth, native: native)
+        from_pairs(scope, pairs, nil, pairs_query(:distance_band, scope, field, bandwidth))
       end
 
       ##
@@ -43,90 +40,123 @@ module SpatialStats
       # @param [ActiveRecord::Relation] scope to query
       # @param [Symbol, String] field with geometry in it
       # @param [Integer] k neighbors to find
+      # @param [Boolean] native find the neighbors of points in the C extension
       #
       # @return [WeightsMatrix]
-      def self.knn(scope, field, k)
-        neighbors = SpatialStats::Queries::Weights
-                    .knn(scope, field, k)
-
-        # get keys to make sure we have consistent dimensions when
-        # some entries don't have neighbors.
-        # define a new hash that has all the keys from scope
-        keys = SpatialStats::Queries::Variables.query_field(scope, scope.klass.primary_key)
-
-        neighbors = neighbors.group_by(&:i_id)
-        missing_neighbors = Hash[(keys - neighbors.keys).map { |key| [key, []] }]
-        neighbors = neighbors.merge(missing_neighbors)
-
-        weights = neighbors.transform_values do |value|
-          value.map do |neighbor|
-            hash = { id: neighbor[:j_id] }
-            hash[:weight] = 1
-            hash
-          end
-        end
-        SpatialStats::Weights::WeightsMatrix.new(weights)
+      def self.knn(scope, field, k, native: false)
+        from_pairs(scope, knn_pairs(scope, field, k, native: native))
       end
 
       ##
       # Compute idw, distance band weights matrix for a scope.
       #
+      # Raises an ArgumentError if two points in the band are at the same
+      # position, since their inverse distance is not finite.
+      #
       # @param [ActiveRecord::Relation] scope to query
       # @param [Symbol, String] field with geometry in it
       # @param [Numeric] bandwidth of distance band
       # @param [Numeric] alpha used in weighting calculation (usually 1 or 2)
+      # @param [Boolean] native find the neighbors of points in the C extension
       #
       # @return [WeightsMatrix]
-      def self.idw_band(scope, field, bandwidth, alpha = 1)
-        neighbors = SpatialStats::Queries::Weights
-                    .idw_band(scope, field, bandwidth, alpha)
-
-        # get keys to make sure we have consistent dimensions when
-        # some entries don't have neighbors.
-        # define a new hash that has all the keys from scope
-        keys = SpatialStats::Queries::Variables.query_field(scope, scope.klass.primary_key)
-        neighbors = neighbors.group_by { |pair| pair[:i_id] }
-        missing_neighbors = Hash[(keys - neighbors.keys).map { |key| [key, []] }]
-        neighbors = neighbors.merge(missing_neighbors)
-
-        # only keep j_id and weight
-        weights = neighbors.transform_values do |value|
-          value.map do |neighbor|
-            { weight: neighbor[:weight], id: neighbor[:j_id] }
-          end
-        end
-        SpatialStats::Weights::WeightsMatrix.new(weights)
+      def self.idw_band(scope, field, bandwidth, alpha = 1, native: false)
+        pairs = band_pairs(scope, field, bandwidth, native: native)
+        from_pairs(scope, pairs, alpha)
       end
 
       ##
       # Compute idw, knn weights matrix for a scope.
       #
+      # Raises an ArgumentError if a point and one of its neighbors are at
+      # the same position, since their inverse distance is not finite.
+      #
       # @param [ActiveRecord::Relation] scope to query
       # @param [Symbol, String] field with geometry in it
       # @param [Integer] k neighbors to find
       # @param [Numeric] alpha used in weighting calculation (usually 1 or 2)
+      # @param [Boolean] native find the neighbors of points in the C extension
       #
       # @return [WeightsMatrix]
-      def self.idw_knn(scope, field, k, alpha = 1)
-        neighbors = SpatialStats::Queries::Weights
-                    .idw_knn(scope, field, k, alpha)
+      def self.idw_knn(scope, field, k, alpha = 1, native: false)
+        pairs = knn_pairs(scope, field, k, native: native)
+        from_pairs(scope, pairs, alpha)
+      end
 
-        # get keys to make sure we have consistent dimensions when
-        # some entries don't have neighbors.
-        # define a new hash that has all the keys from scope
-        keys = SpatialStats::Queries::Variables.query_field(scope, scope.klass.primary_key)
-        neighbors = neighbors.group_by { |pair| pair[:i_id] }
-        missing_neighbors = Hash[(keys - neighbors.keys).map { |key| [key, []] }]
-        neighbors = neighbors.merge(missing_neighbors)
+      ##
+      # Query of the neighbor pairs that include some keys, which
+      # +WeightsMatrix#update+ calls. Only distance band weights have one,
+      # since the other methods weight or pick a pair by more than its two
+      # geometries. Set by +distance_band+, and restored by +Cache+ on
+      # weights loaded from a file.
+      #
+      # @param [Symbol] method of weights, ex. +:distance_band+
+      # @param [ActiveRecord::Relation] scope to query
+      # @param [Symbol, String] field with geometry in it
+      # @param [Array] params passed to the weights method after field
+      #
+      # @return [Proc, nil] taking the keys and returning their pairs like +Queries::Weights.neighbor_indices+
+      def self.pairs_query(method, scope, field, *params, **_options)
+        return unless method.to_sym == :distance_band
 
-        # only keep j_id and weight
-        weights = neighbors.transform_values do |value|
-          value.map do |neighbor|
-            { weight: neighbor[:weight], id: neighbor[:j_id] }
-          end
+        bandwidth = params.first
+        lambda do |ids|
+          sql = SpatialStats::Queries::Weights
+                .distance_band_sql(scope, field, bandwidth, ids: ids)
+          SpatialStats::Queries::Weights.neighbor_indices(scope, sql)
         end
-        SpatialStats::Weights::WeightsMatrix.new(weights)
       end
+
+      # Neighbor pairs in a distance band, from PostGIS or the native grid
+      # index, in the format of +Queries::Weights.neighbor_indices+.
+      def self.band_pairs(scope, field, bandwidth, native: false)
+        if native
+          coordinates = SpatialStats::Queries::Weights.point_coordinates(scope, field)
+          return CSRMatrix.band_pairs(coordinates[:x], coordinates[:y], bandwidth)
+        end
+
+        sql = SpatialStats::Queries::Weights
+              .distance_band_sql(scope, field, bandwidth, distance: true)
+        SpatialStats::Queries::Weights.neighbor_indices(scope, sql, distance: true)
+      end
+      private_class_method :band_pairs
+
+      # k nearest neighbor pairs, from PostGIS or the native grid index, in
+      # the format of +Queries::Weights.neighbor_indices+.
+      def self.knn_pairs(scope, field, k, native: false)
+        if native
+          coordinates = SpatialStats::Queries::Weights.point_coordinates(scope, field)
+          return CSRMatrix.knn_pairs(coordinates[:x], coordinates[:y], k)
+        end
+
+        sql = SpatialStats::Queries::Weights
+              .knn_sql(scope, field, k, distance: true)
+        SpatialStats::Queries::Weights.neighbor_indices(scope, sql, distance: true)
+      end
+      private_class_method :knn_pairs
+
+      # Build the weights from packed neighbor pairs, so rows follow the
+      # order of the keys and line up with queried variables. Entries
+      # without neighbors still get an empty row. The distances are kept
+      # and if alpha is given the pairs are weighted by inverse distance
+      # with +CSRMatrix#inverse_distance+. The pairs_query from
+      # +pairs_query+, if any, lets the weights be refreshed with
+      # +WeightsMatrix#update+.
+      def self.from_pairs(scope, pairs, alpha = nil, pairs_query = nil)
+        keys = SpatialStats::Queries::Variables.query_field(scope, scope.klass.primary_key)
+        distances = CSRMatrix.from_coo(pairs[:i_idx], pairs[:j_idx], pairs[:distance], keys.size)
+
+        sparse = if alpha
+                   distances.inverse_distance(alpha)
+                 else
+                   CSRMatrix.from_coo(pairs[:i_idx], pairs[:j_idx], 1, keys.size)
+                 end
+        matrix = SpatialStats::Weights::WeightsMatrix.from_sparse(keys, sparse)
+        matrix.distances = distances
+        matrix.pairs_query = pairs_query
+        matrix
+      end
+      private_class_method :from_pairs
     end
   end
 end
@@ -19,7 +19,123 @@ module SpatialStats
         @keys = weights.keys
         @n = keys.size
       end
-      attr_accessor :keys, :weights, :n
+      attr_accessor :keys, :n
+      attr_writer :weights
+
+      ##
+      # A new instance of WeightsMatrix from coordinate lists of neighbor
+      # keys. The CSR representation is built directly in the C extension,
+      # so no nested hash is created unless +weights+ is called.
+      #
+      # @example
+      #   keys = [1, 2, 3]
+      #   wm = WeightsMatrix.from_coo(keys, [1, 2, 2, 3], [2, 1, 3, 2])
+      #   wm.weights
+      #   # => {1 => [{id: 2, weight: 1.0}], 2 => [{id: 1, weight: 1.0},
+      #   #     {id: 3, weight: 1.0}], 3 => [{id: 2, weight: 1.0}]}
+      #
+      # @param [Array] keys of every observation, defining the row order
+      # @param [Array] i_ids key of the observation for each pair
+      # @param [Array] j_ids key of the neighbor for each pair
+      # @param [Array, Numeric] values weight of each pair, or one weight for every pair
+      #
+      # @return [WeightsMatrix]
+      def self.from_coo(keys, i_ids, j_ids, values = 1)
+        lookup = keys.each_with_index.to_h
+        i_idx = i_ids.map { |key| lookup.fetch(key) }
+        j_idx = j_ids.map { |key| lookup.fetch(key) }
+
+        from_sparse(keys, CSRMatrix.from_coo(i_idx, j_idx, values, keys.size))
+      end
+
+      ##
+      # A new instance of WeightsMatrix backed by an existing CSRMatrix.
+      # Row and column i of +sparse+ correspond to +keys[i]+, or to
+      # +keys[permutation[i]]+ when the rows were reordered.
+      #
+      # @param [Array] keys of every observation
+      # @param [CSRMatrix] sparse weights with n equal to keys.size
+      # @param [Array, nil] permutation observation of each row of sparse, see +#reorder+
+      #
+      # @return [WeightsMatrix]
+      def self.from_sparse(keys, sparse, permutation: nil)
+        raise ArgumentError, 'keys.size != sparse.n' if keys.size != sparse.n
+        if permutation && permutation.size != keys.size
+          raise ArgumentError, 'keys.size != permutation.size'
+        end
+
+        instance = new({})
+        instance.keys = keys
+        instance.n = keys.size
+        instance.weights = nil
+        instance.sparse = sparse
+        instance.permutation = permutation
+        instance
+      end
+
+      ##
+      # Hash of format +{key: [{id: neighbor_key, weight: 1}]}+ that
+      # describes the relations between neighbors. Built from the CSR
+      # representation when the matrix was created with +from_coo+.
+      #
+      # @return [Hash]
+      def weights
+        @weights ||= begin
+          values = sparse.values
+          col_index = sparse.col_index
+          row_index = sparse.row_index
+          row_keys = permute(keys)
+          rows = permutation ? inverse_permutation : (0...n)
+
+          keys.zip(rows).to_h do |key, i|
+            neighbors = (row_index[i]...row_index[i + 1]).map do |jj|
+              { id: row_keys[col_index[jj]], weight: values[jj] }
+            end
+            [key, neighbors]
+          end
+        end
+      end
+
+      ##
+      # Read weights written by +#dump+. With +mmap: true+ the CSR arrays
+      # are mapped read only, so forked processes that load the same file
+      # share one copy in memory. The file holds no +pairs_query+ or
+      # +distances+, see +Cache+ for weights that keep them.
+      #
+      # @example
+      #   weights = WeightsMatrix.load('tmp/rook.weights')
+      #
+      # @param [String] path of the file
+      # @param [Boolean] mmap map the file instead of reading it
+      #
+      # @return [WeightsMatrix]
+      def self.load(path, mmap: true)
+        sparse = CSRMatrix.load(path, mmap: mmap)
+        raise ArgumentError, "#{path} has no keys" if sparse.keys.nil?
+
+        if sparse.keys.is_a?(Hash)
+          return from_sparse(sparse.keys[:keys], sparse,
+                             permutation: sparse.keys[:permutation])
+        end
+        from_sparse(sparse.keys, sparse)
+      end
+
+      ##
+      # Write the weights and keys to a binary file that can be read with
+      # +WeightsMatrix.load+, so they do not need to be queried again.
+      # Reordered weights are written with their permutation.
+      #
+      # @example
+      #   SpatialStats::Weights::Contiguous.rook(scope, :geom)
+      #                                    .dump('tmp/rook.weights')
+      #
+      # @param [String] path of the file
+      #
+      # @return [WeightsMatrix] self
+      def dump(path)
+        sparse.dump(path, permutation ? { keys: keys, permutation: permutation } : keys)
+        self
+      end
 
       ##
       # Equality operator
@@ -45,10 +161,11 @@ module SpatialStats
       def dense
         @dense ||= begin
           mat = Numo::DFloat.zeros(n, n)
+          key_lookup = keys.each_with_index.to_h
           keys.each_with_index do |key, i|
             neighbors = weights[key]
             neighbors.each do |neighbor|
-              j = keys.index(neighbor[:id])
+              j = key_lookup[neighbor[:id]]
               weight = neighbor[:weight]
 
               # assign the weight to row and column
@@ -67,6 +184,180 @@ module SpatialStats
       def sparse
         @sparse ||= CSRMatrix.new(weights, n)
       end
+      attr_writer :sparse
+
+      ##
+      # Observation of each row of +sparse+, as an index into +keys+, for
+      # weights from +#reorder+. nil when the rows follow +keys+.
+      #
+      # @return [Array, nil]
+      attr_accessor :permutation
+
+      ##
+      # Weights with the rows and columns of +sparse+ reordered, so the
+      # neighbors of an observation are stored close to it and products
+      # gather from nearby memory instead of all over the vector. Useful
+      # when the primary keys do not follow space, for large weights.
+      #
+      # +:rcm+ orders by reverse Cuthill-McKee on the neighbor graph,
+      # +:hilbert+ along a Hilbert curve through +coordinates+, in the
+      # format of +Queries::Weights.point_coordinates+. Keys keep their
+      # order, the statistics and lags permute their inputs to the rows
+      # of +sparse+ with +#permute+ and their results back with
+      # +#unpermute+, so they line up with queried variables as before.
+      #
+      # Permutation tests pass +permutation+ to the kernels, which draw
+      # from streams numbered by key, so seeded p-values do not depend
+      # on the order.
+      #
+      # @example
+      #   weights = SpatialStats::Weights::Contiguous.queen(scope, :geom).reorder
+      #   coordinates = SpatialStats::Queries::Weights.point_coordinates(scope, :geom, centroid: true)
+      #   weights = SpatialStats::Weights::Contiguous.queen(scope, :geom).reorder(:hilbert, coordinates: coordinates)
+      #
+      # @param [Symbol] method +:rcm+ or +:hilbert+
+      # @param [Hash] coordinates +:x+ and +:y+ of each observation in keys order, for +:hilbert+
+      #
+      # @return [WeightsMatrix]
+      def reorder(method = :rcm, coordinates: nil)
+        order = case method.to_sym
+                when :rcm
+                  rcm = sparse.rcm
+                  permutation ? permutation.values_at(*rcm) : rcm
+                when :hilbert
+                  raise ArgumentError, 'hilbert reordering needs coordinates' unless coordinates
+
+                  CSRMatrix.hilbert_order(coordinates[:x], coordinates[:y])
+                else
+                  raise ArgumentError, "unknown reordering #{method}, use :rcm or :hilbert"
+                end
+        reordered(order)
+      end
+
+      ##
+      # Values of each observation in keys order, reordered to the rows of
+      # +sparse+. The rows of an n x k +Numo::NArray+ are reordered.
+      # Returns values itself when the weights are not reordered.
+      #
+      # @param [Array, Numo::NArray, String] values in keys order, a String packed with pack('d*')
+      #
+      # @return [Array, Numo::NArray, String] values in row order
+      def permute(values)
+        return values unless permutation
+
+        reindex(values, permutation)
+      end
+
+      ##
+      # Inverse of +#permute+, values of each row of +sparse+ back in keys
+      # order. Every value of a Hash, like the result of
+      # +CSRMatrix#local_stats+, is reordered.
+      #
+      # @param [Array, Numo::NArray, String, Hash] values in row order
+      #
+      # @return [Array, Numo::NArray, String, Hash] values in keys order
+      def unpermute(values)
+        return values unless permutation
+        return values.transform_values { |v| unpermute(v) } if values.is_a?(Hash)
+
+        reindex(values, inverse_permutation)
+      end
+
+      ##
+      # Callable that takes keys and returns the neighbor pairs that include
+      # any of them, in the format of +Queries::Weights.neighbor_indices+.
+      # Set by the rook, queen and distance band builders, and used by
+      # +#update+.
+      #
+      # @return [Proc, nil]
+      attr_accessor :pairs_query
+
+      ##
+      # Weights with the neighbors of some observations queried again,
+      # after their geometries changed. Only the pairs that include a
+      # changed key are queried, which covers the rows of the changed keys
+      # and their entries in the rows of old and new neighbors. They are
+      # spliced into the CSR arrays in one pass and every other entry is
+      # kept, so the query grows with the number of changed keys instead
+      # of n**2.
+      #
+      # Only weights where a pair depends on nothing but its two
+      # geometries can be updated, which are rook, queen and distance
+      # band weights. The keys of the scope must stay the same, added or
+      # removed observations need a rebuild. The result keeps no
+      # +distances+. This matrix is not modified.
+      #
+      # @example
+      #   weights = SpatialStats::Weights::Contiguous.queen(scope, :geom)
+      #   # parcels 12 and 40 are redrawn
+      #   weights = weights.update([12, 40])
+      #
+      # @param [Array] changed_ids keys of the observations that changed
+      #
+      # @return [WeightsMatrix]
+      def update(changed_ids)
+        raise ArgumentError, 'weights without a pairs_query cannot be updated' unless pairs_query
+        return self if changed_ids.empty?
+
+        lookup = keys.each_with_index.to_h
+        rows = changed_ids.map { |key| lookup.fetch(key) }
+        pairs = pairs_query.call(changed_ids)
+        i_idx = pairs[:i_idx]
+        j_idx = pairs[:j_idx]
+        if permutation
+          rows = inverse_permutation.values_at(*rows)
+          i_idx = inverse_permutation.values_at(*indices(i_idx))
+          j_idx = inverse_permutation.values_at(*indices(j_idx))
+        end
+
+        updated = self.class.from_sparse(
+          keys, sparse.splice(rows, i_idx, j_idx, 1), permutation: permutation
+        )
+        updated.pairs_query = pairs_query
+        updated
+      end
+
+      ##
+      # Distance of every pair, with the same rows and columns as +sparse+.
+      # Kept by the distance weights builders so +#inverse_distance+ and
+      # +#kernel+ do not need to query again. Not written by +#dump+.
+      #
+      # @return [CSRMatrix, nil]
+      attr_accessor :distances
+
+      ##
+      # Inverse distance weights, 1/(d**alpha), from +distances+. If the
+      # lowest distance is < 1, every distance is scaled by the factor
+      # that makes the lowest 1, same as the idw builders. Raises an
+      # ArgumentError if a pair is at distance 0, like coincident points.
+      #
+      # @example
+      #   weights = SpatialStats::Weights::Distant.knn(scope, :position, 8)
+      #   weights.inverse_distance(2)
+      #
+      # @param [Numeric] alpha number used in inverse calculations (usually 1 or 2)
+      #
+      # @return [WeightsMatrix]
+      def inverse_distance(alpha = 1)
+        from_distances(distances!.inverse_distance(alpha))
+      end
+
+      ##
+      # Kernel weights from +distances+, see +CSRMatrix#kernel+. The
+      # triangular and bisquare kernels drop the pairs that are at least
+      # bandwidth apart.
+      #
+      # @example
+      #   weights = SpatialStats::Weights::Distant.distance_band(scope, :position, 1000)
+      #   weights.kernel(:gaussian, 250)
+      #
+      # @param [Symbol] kind of kernel, +:triangular+, +:bisquare+ or +:gaussian+
+      # @param [Numeric] bandwidth distances are scaled by
+      #
+      # @return [WeightsMatrix]
+      def kernel(kind, bandwidth)
+        from_distances(distances!.kernel(kind.to_sym, bandwidth))
+      end
 
       ##
       # Compute the cardinalities of each neighbor into an array
@@ -75,49 +366,86 @@ module SpatialStats
       def wc
         @wc ||= begin
           row_index = sparse.row_index
-          (0..n - 1).map do |idx|
+          unpermute((0..n - 1).map do |idx|
             row_index[idx + 1] - row_index[idx]
-          end
+          end)
         end
       end
 
       ##
       # Row standardized version of the weights matrix.
       # Will return a new version of the weights matrix with standardized
-      # weights.
+      # weights. The standardization is computed once in the C extension
+      # and memoized, this matrix is not modified.
       #
       # @return [WeightsMatrix]
       def standardize
-        new_weights = weights
-
-        new_weights.transform_values do |neighbors|
-          sum = neighbors.reduce(0.0) { |acc, neighbor| acc + neighbor[:weight] }
-
-          neighbors.map do |neighbor|
-            hash = neighbor
-            hash[:weight] /= sum
-          end
-        end
-
-        self.class.new(new_weights)
+        @standardize ||= self.class.from_sparse(keys, sparse.row_standardize,
+                                                permutation: permutation)
       end
 
       ##
       # Windowed version of the weights matrix.
       # If a row already has an entry for itself, it will be skipped.
+      # The diagonal is inserted natively with +CSRMatrix#window+, rows
+      # are not sorted again or rebuilt from the weights hash.
+      # The result is memoized, this matrix is not modified.
       #
       # @return [WeightsMatrix]
       def window
-        new_weights = weights
+        @window ||= self.class.from_sparse(keys, sparse.window(permutation),
+                                           permutation: permutation)
+      end
 
-        new_weights.each do |key, neighbors|
-          unless neighbors.find { |neighbor| neighbor[:id] == key }
-            new_neighbors = (neighbors << { id: key, weight: 1 })
-            new_weights[key] = new_neighbors.sort_by { |neighbor| neighbor[:id] }
-          end
+      protected
+
+      # Weights with sparse permuted so row r is observation order[r]. The
+      # permutation is relative to the current rows, which may already be
+      # reordered.
+      def reordered(order)
+        relative = permutation ? inverse_permutation.values_at(*order) : order
+        matrix = self.class.from_sparse(keys, sparse.permute(relative), permutation: order)
+        matrix.distances = distances&.permute(relative)
+        matrix.pairs_query = pairs_query
+        matrix
+      end
+
+      private
+
+      def distances!
+        raise ArgumentError, 'weights were not built with distances' unless distances
+
+        distances
+      end
+
+      def from_distances(sparse)
+        matrix = self.class.from_sparse(keys, sparse, permutation: permutation)
+        matrix.distances = distances
+        matrix
+      end
+
+      # row of sparse for each observation
+      def inverse_permutation
+        @inverse_permutation ||= begin
+          inverse = Array.new(n)
+          permutation.each_with_index { |key_idx, row| inverse[key_idx] = row }
+          inverse
         end
+      end
+
+      def reindex(values, order)
+        if values.is_a?(Numo::NArray)
+          values.ndim == 2 ? values[order, true] : values[order]
+        elsif values.is_a?(String)
+          values.unpack('d*').values_at(*order).pack('d*')
+        else
+          values.to_a.values_at(*order)
+        end
+      end
 
-        self.class.new(new_weights)
+      # indices of a pairs query, packed with pack('l*') or an Array
+      def indices(idx)
+        idx.is_a?(String) ? idx.unpack('l*') : idx.to_a
       end
     end
   end
@@ -82,16 +82,57 @@ class GlobalMoranTest < ActiveSupport::TestCase
     moran = SpatialStats::Global::Moran.new(@poly_scope, :value, @weights)
     seed = 123_456
     p_val = moran.mc(999, seed)
-    expected = 0.01
+    expected = 0.004
 
     assert_in_delta(expected, p_val, 0.005)
   end
 
+  def test_mc_sequential
+    moran = SpatialStats::Global::Moran.new(@poly_scope, :value, @weights)
+    seed = 123_456
+    result = moran.mc_sequential(999, seed, alpha: 0.05)
+
+    # significant, so every permutation runs and the p-value matches mc
+    assert_equal(999, result[:permutations])
+    assert_in_delta(moran.mc(999, seed), result[:p], 1e-10)
+  end
+
+  def test_mc_reorder
+    moran = SpatialStats::Global::Moran.new(@poly_scope, :value, @weights)
+    reordered = SpatialStats::Global::Moran.new(@poly_scope, :value, @weights.reorder(:rcm))
+
+    assert_in_delta(moran.mc(99, 1), reordered.mc(99, 1), 1e-10)
+    assert_equal(moran.mc_sequential(99, 1)[:permutations],
+                 reordered.mc_sequential(99, 1)[:permutations])
+  end
+
+  def test_mc_sequential_random
+    moran = SpatialStats::Global::Moran.new(@poly_scope, :value, @weights)
+    result = moran.mc_sequential(999, Random.new(1), alpha: 0.05)
+
+    # a Random is drawn from once, the same as mc does
+    assert_equal(result, moran.mc_sequential(999, Random.new(1), alpha: 0.05))
+    assert_in_delta(moran.mc(999, Random.new(1)), result[:p], 1e-10)
+  end
+
+  def test_mc_threads
+    SpatialStats.threads = 4
+    moran = SpatialStats::Global::Moran.new(@poly_scope, :value, @weights)
+    seed = 123_456
+    p_val = moran.mc(999, seed)
+    expected = 0.004
+
+    assert_in_delta(expected, p_val, 0.005)
+    assert_equal(p_val, moran.mc(999, seed))
+  ensure
+    SpatialStats.threads = 1
+  end
+
   def test_summary
     moran = SpatialStats::Global::Moran.new(@poly_scope, :value, @weights)
     seed = 123_456
     summary = moran.summary(999, seed)
-    expected = { stat: -1.0, p: 0.01 }
+    expected = { stat: -1.0, p: 0.004 }
 
     assert_in_delta(expected[:stat], summary[:stat], 1e-5)
     assert_in_delta(expected[:p], summary[:p], 1e-5)
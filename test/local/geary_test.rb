@@ -62,7 +62,7 @@ class LocalGearyTest < ActiveSupport::TestCase
     seed = 123_456
     p_vals = geary.mc(999, seed)
 
-    expected = [0.216, 0.165, 0.224, 0.184, 0.02, 0.17, 0.224, 0.195, 0.215]
+    expected = [0.189, 0.19, 0.219, 0.174, 0.012, 0.178, 0.207, 0.187, 0.183]
 
     expected.each_with_index do |v, i|
       assert_in_delta(v, p_vals[i], 0.0005)
@@ -85,7 +85,7 @@ class LocalGearyTest < ActiveSupport::TestCase
     seed = 123_456
     p_vals = geary.mc(999, seed)
 
-    expected = [0.343, 0.187, 0.355, 0.721, 0.477, 0.712, 0.457, 0.109, 0.468]
+    expected = [0.381, 0.203, 0.371, 0.724, 0.471, 0.71, 0.446, 0.135, 0.464]
     expected.each_with_index do |v, i|
       assert_in_delta(v, p_vals[i], 0.0005)
     end
@@ -58,6 +58,36 @@ class LocalGetisOrdTest < ActiveSupport::TestCase
     end
   end
 
+  def test_expectation
+    g = SpatialStats::Local::GetisOrd.new(@poly_scope, :value, @weights)
+    assert_equal([0.125] * 9, g.expectation)
+
+    g = SpatialStats::Local::GetisOrd.new(@poly_scope, :value, @weights, true)
+    g.expectation.each do |v|
+      assert_in_delta(1.0 / 9, v, 1e-10)
+    end
+  end
+
+  def test_variance
+    g = SpatialStats::Local::GetisOrd.new(@poly_scope, :value, @weights)
+    # corner with 2 neighbors, the other 8 values have mean 0.5
+    # and variance 0.25, so 0.25 * (8 * 0.5 - 1) / (7 * 8**2 * 0.5**2)
+    expected = [0.006696, 0.0062, 0.006696, 0.0062, 0.002232,
+                0.0062, 0.006696, 0.0062, 0.006696]
+    g.variance.each_with_index do |v, idx|
+      assert_in_delta(expected[idx], v, 1e-5)
+    end
+  end
+
+  def test_z_score
+    g = SpatialStats::Local::GetisOrd.new(@poly_scope, :value, @weights, true)
+    expected = [0.8944, -0.9899, 0.8944, -0.9899, 2.2627,
+                -0.9899, 0.8944, -0.9899, 0.8944]
+    g.z_score.each_with_index do |v, idx|
+      assert_in_delta(expected[idx], v, 1e-4)
+    end
+  end
+
   def test_stat_clustered
     # replace bottom 2 rows values with 1, top row with 0
     values = [1, 1, 1, 1, 1, 1, 0, 0, 0]
@@ -88,7 +118,7 @@ class LocalGetisOrdTest < ActiveSupport::TestCase
     seed = 123_456
     p_vals = g.mc(999, seed)
 
-    expected = [0.216, 0.001, 0.224, 0.001, 0.02, 0.001, 0.224, 0.001, 0.215]
+    expected = [0.189, 0.001, 0.219, 0.001, 0.012, 0.001, 0.207, 0.001, 0.183]
 
     expected.each_with_index do |v, i|
       assert_in_delta(v, p_vals[i], 0.0005)
@@ -111,7 +141,7 @@ class LocalGetisOrdTest < ActiveSupport::TestCase
     seed = 123_456
     p_vals = g.mc(999, seed)
 
-    expected = [0.343, 0.187, 0.355, 0.28, 0.477, 0.289, 0.031, 0.001, 0.039]
+    expected = [0.381, 0.203, 0.371, 0.277, 0.471, 0.291, 0.034, 0.001, 0.042]
     expected.each_with_index do |v, i|
       assert_in_delta(v, p_vals[i], 0.0005)
     end
@@ -127,6 +127,16 @@ class LocalMoranTest < ActiveSupport::TestCase
     assert_equal(expected, quads)
   end
 
+  def test_reordered_weights
+    moran = SpatialStats::Local::Moran.new(@poly_scope, :value, @weights)
+    reordered = SpatialStats::Local::Moran.new(@poly_scope, :value, @weights.reorder)
+
+    moran.stat.zip(reordered.stat).each do |expected, actual|
+      assert_in_delta(expected, actual, 1e-12)
+    end
+    assert_equal(moran.quads, reordered.quads)
+  end
+
   def test_crand
     # test value will be held in crand
     moran = SpatialStats::Local::Moran.new(@poly_scope, :value, @weights)
@@ -140,13 +150,36 @@ class LocalMoranTest < ActiveSupport::TestCase
     moran = SpatialStats::Local::Moran.new(@poly_scope, :value, @weights)
     seed = 123_456
     p_vals = moran.mc(999, seed)
-    expected = [0.216, 0.165, 0.224, 0.184, 0.02, 0.17, 0.224, 0.195, 0.215]
+    expected = [0.189, 0.19, 0.219, 0.174, 0.012, 0.178, 0.207, 0.187, 0.183]
 
     expected.each_with_index do |v, i|
       assert_in_delta(v, p_vals[i], 0.0005)
     end
   end
 
+  def test_mc_sequential
+    moran = SpatialStats::Local::Moran.new(@poly_scope, :value, @weights)
+    seed = 123_456
+    result = moran.mc_sequential(999, seed, alpha: 0.05)
+    p_vals = moran.mc(999, seed)
+
+    # only the observation near the threshold runs every permutation
+    assert_equal([245, 210, 212, 274, 999, 228, 234, 246, 269], result[:permutations])
+    assert_in_delta(p_vals[4], result[:p][4], 1e-10)
+    result[:p].each_with_index do |p_val, i|
+      assert_equal(p_vals[i] <= 0.05, p_val <= 0.05)
+    end
+  end
+
+  def test_mc_reorder
+    moran = SpatialStats::Local::Moran.new(@poly_scope, :value, @weights)
+    reordered = SpatialStats::Local::Moran.new(@poly_scope, :value, @weights.reorder(:rcm))
+
+    # observations draw from the streams of their keys, not their rows
+    assert_equal(moran.mc(99, 1), reordered.mc(99, 1))
+    assert_equal(moran.mc_sequential(99, 1), reordered.mc_sequential(99, 1))
+  end
+
   def test_summary
     moran = SpatialStats::Local::Moran.new(@poly_scope, :value, @weights)
     seed = 123_456
@@ -28,12 +28,22 @@ class LocalMultivariateGearyTest < ActiveSupport::TestCase
     end
   end
 
+  def test_from_observations
+    matrix = Numo::DFloat.cast([@values, @second_values]).transpose
+    geary = SpatialStats::Local::MultivariateGeary.from_observations(matrix, @weights)
+    expected = SpatialStats::Local::MultivariateGeary.new(@poly_scope, %i[value second_value], @weights)
+
+    geary.stat.each_with_index do |v, idx|
+      assert_in_delta(expected.stat[idx], v, 1e-10)
+    end
+  end
+
   def test_mc
     geary = SpatialStats::Local::MultivariateGeary.new(@poly_scope, %i[value second_value], @weights)
     seed = 123_456
     p_vals = geary.mc(999, seed)
 
-    expected = [0.185, 0.313, 0.345, 0.318, 0.21, 0.339, 0.32, 0.452, 0.571]
+    expected = [0.507, 0.35, 0.615, 0.186, 0.14, 0.329, 0.522, 0.335, 0.584]
     expected.each_with_index do |v, i|
       assert_in_delta(v, p_vals[i], 0.0005)
     end
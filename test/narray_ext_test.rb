@@ -20,6 +20,13 @@ class NArrayExtTest < ActiveSupport::TestCase
     assert_equal(expected, result)
   end
 
+  def test_standardize
+    matrix = Numo::DFloat[[1, 0], [2, 2], [3, 4]]
+    expected = Numo::DFloat[[-1, -1], [0, 0], [1, 1]]
+    assert_equal(expected, matrix.standardize)
+    assert_equal(Numo::DFloat[-1, 0, 1], Numo::DFloat[1, 2, 3].standardize)
+  end
+
   def test_window_success
     expected = Numo::DFloat[[1, 1, 0], [1, 1, 1], [0, 1, 1]]
     result = @matrix.window
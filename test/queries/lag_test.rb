@@ -0,0 +1,45 @@
+# frozen_string_literal: true
+
+require 'test_helper'
+
+class LagQueriesTest < ActiveSupport::TestCase
+  def setup
+    polys = Polygon.grid(0, 0, 1, 3)
+    polys.each_with_index do |poly, idx|
+      poly.value = idx
+      poly.save
+    end
+    @scope = Polygon.all
+    @weights = SpatialStats::Weights::Contiguous.rook(@scope, :geom)
+    @values = SpatialStats::Queries::Variables.query_field(@scope, :value)
+  end
+
+  def test_neighbor_sum
+    lags = SpatialStats::Queries::Lag
+           .neighbor_sum(@scope, :value, @weights, batch_size: 2)
+
+    expected = SpatialStats::Utils::Lag.neighbor_sum(@weights, @values)
+    assert_equal(expected, lags)
+  end
+
+  def test_neighbor_sum_into
+    table = SpatialStats::Queries::Lag
+            .neighbor_sum(@scope, :value, @weights.standardize, into: 'polygon_lags')
+
+    rows = Polygon.connection.select_rows('SELECT id, lag FROM polygon_lags ORDER BY id')
+    expected = SpatialStats::Utils::Lag.neighbor_average(@weights, @values)
+    assert_equal('polygon_lags', table)
+    assert_equal(@weights.keys, rows.map { |row| row[0].to_i })
+    assert_equal(expected.map { |v| v.round(6) }, rows.map { |row| row[1].to_f.round(6) })
+  ensure
+    Polygon.connection.execute('DROP TABLE IF EXISTS polygon_lags')
+  end
+
+  def test_lag_scope
+    lags = SpatialStats::Utils::Lag
+           .neighbor_average(@weights, :value, scope: @scope)
+
+    expected = SpatialStats::Utils::Lag.neighbor_average(@weights, @values)
+    assert_equal(expected.map { |v| v.round(6) }, lags.map { |v| v.round(6) })
+  end
+end
@@ -101,4 +101,46 @@ class PointQueryWeightsTest < ActiveSupport::TestCase
       assert_includes(valid_weights, neighbor[:weight].round(3))
     end
   end
+
+  def test_neighbor_indices
+    scope = Point.all
+    sql = SpatialStats::Queries::Weights
+          .distance_band_sql(scope, :position, 1, distance: true)
+    pairs = SpatialStats::Queries::Weights
+            .neighbor_indices(scope, sql, distance: true, batch_size: 5)
+
+    i_idx = pairs[:i_idx].unpack('l*')
+    j_idx = pairs[:j_idx].unpack('l*')
+    distances = pairs[:distance].unpack('d*')
+
+    assert_equal(24, i_idx.size)
+    assert_equal(24, j_idx.size)
+    assert_equal(i_idx.zip(j_idx).sort, i_idx.zip(j_idx))
+    assert(i_idx.all? { |i| (0...9).cover?(i) })
+    assert(distances.all? { |d| d.round(3) == 1.0 })
+
+    ids = SpatialStats::Queries::Variables.query_field(scope, :id)
+    i_idx.zip(j_idx).each do |i, j|
+      p1 = Point.find(ids[i]).position
+      p2 = Point.find(ids[j]).position
+      assert_equal(1.0, p1.distance(p2).round(3))
+    end
+  end
+
+  def test_point_coordinates
+    scope = Point.all
+    coordinates = SpatialStats::Queries::Weights
+                  .point_coordinates(scope, :position)
+
+    x = coordinates[:x].unpack('d*')
+    y = coordinates[:y].unpack('d*')
+    assert_equal(9, x.size)
+
+    ids = SpatialStats::Queries::Variables.query_field(scope, :id)
+    ids.each_with_index do |id, i|
+      position = Point.find(id).position
+      assert_equal(position.x.round(3), x[i].round(3))
+      assert_equal(position.y.round(3), y[i].round(3))
+    end
+  end
 end
@@ -19,4 +19,58 @@ class VariablesQueriesTest < ActiveSupport::TestCase
     expectation = [0.0, 1.0, 2.0, 3.0, 4.0, 5.0, 6.0, 7.0, 8.0]
     assert_equal(expectation, variables)
   end
+
+  def test_query_fields
+    scope = Polygon.all
+    variables = SpatialStats::Queries::Variables
+                .query_fields(scope, %i[value value])
+
+    expectation = [0.0, 1.0, 2.0, 3.0, 4.0, 5.0, 6.0, 7.0, 8.0]
+    assert_equal([9, 2], variables.shape)
+    assert_equal(expectation, variables[true, 0].to_a)
+    assert_equal(expectation, variables[true, 1].to_a)
+  end
+
+  def test_query_fields_standardize
+    scope = Polygon.all
+    variables = SpatialStats::Queries::Variables
+                .query_fields(scope, %i[value], standardize: true)
+
+    expectation = (0..8).to_a.standardize
+    variables[true, 0].to_a.each_with_index do |v, i|
+      assert_in_delta(expectation[i], v, 1e-12)
+    end
+  end
+
+  def test_query_fields_constant
+    scope = Polygon.all
+    scope.update_all(second_value: 1)
+    variables = SpatialStats::Queries::Variables
+                .query_fields(scope, %i[second_value], standardize: true)
+
+    # like [1] * 9, the column has no variance
+    assert(variables[true, 0].to_a.all?(&:nan?))
+    assert(([1] * 9).standardize.all?(&:nan?))
+  end
+
+  def test_query_fields_null
+    scope = Polygon.all
+    Polygon.order(:id).first.update(second_value: nil)
+    Polygon.order(:id).offset(1).each_with_index do |poly, idx|
+      poly.update(second_value: idx)
+    end
+
+    variables = SpatialStats::Queries::Variables
+                .query_fields(scope, %i[second_value])[true, 0].to_a
+    assert(variables.first.nan?)
+    assert_equal((0..7).map(&:to_f), variables.drop(1))
+
+    variables = SpatialStats::Queries::Variables
+                .query_fields(scope, %i[second_value], standardize: true)[true, 0].to_a
+    expectation = (0..7).to_a.standardize
+    assert(variables.first.nan?)
+    variables.drop(1).each_with_index do |v, i|
+      assert_in_delta(expectation[i], v, 1e-12)
+    end
+  end
 end
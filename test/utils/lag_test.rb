@@ -26,6 +26,63 @@ class LaggedVariablesTest < ActiveSupport::TestCase
     assert_equal(expected, result)
   end
 
+  def test_neighbor_sum_narray
+    expected = Numo::DFloat[2, 4, 2]
+    result = SpatialStats::Utils::Lag.neighbor_sum(@matrix,
+                                                   Numo::DFloat.cast(@values))
+    assert_equal(expected, result)
+  end
+
+  def test_neighbor_sum_block_size
+    expected = [2, 4, 2]
+    result = SpatialStats::Utils::Lag.neighbor_sum(@matrix, @values, block_size: 2)
+    assert_equal(expected, result)
+  end
+
+  def test_neighbor_sum_block_size_callable
+    expected = Numo::DFloat[2, 4, 2]
+    values = Numo::DFloat.cast(@values)
+    halos = []
+    lookup = lambda do |halo|
+      halos << halo
+      values[halo]
+    end
+    result = SpatialStats::Utils::Lag.neighbor_sum(@matrix, lookup, block_size: 2)
+
+    assert_equal(expected.to_a, result)
+    assert_equal([[0, 1, 2], [1]], halos)
+    assert_equal(expected, SpatialStats::Utils::Lag.neighbor_sum(@matrix, values, block_size: 1))
+  end
+
+  def test_neighbor_sum_reordered
+    matrix = @matrix.reorder
+
+    assert_equal([2, 4, 2], SpatialStats::Utils::Lag.neighbor_sum(matrix, @values))
+    assert_equal([2, 4, 2], SpatialStats::Utils::Lag.neighbor_sum(matrix, @values, block_size: 2))
+    ids = ->(halo) { @values.values_at(*halo) }
+    assert_equal([2, 4, 2], SpatialStats::Utils::Lag.neighbor_sum(matrix, ids, block_size: 1))
+  end
+
+  def test_neighbor_sum_columns
+    values = Numo::DFloat[[1, 10], [2, 20], [3, 30]]
+    expected = Numo::DFloat[[2, 20], [4, 40], [2, 20]]
+
+    assert_equal(expected, SpatialStats::Utils::Lag.neighbor_sum(@matrix, values))
+    assert_equal(expected, SpatialStats::Utils::Lag.neighbor_sum(@matrix, values, block_size: 2))
+    assert_equal(expected, SpatialStats::Utils::Lag.neighbor_sum(@matrix.reorder, values))
+    assert_equal(expected, SpatialStats::Utils::Lag.neighbor_sum(@matrix.reorder, values, block_size: 1))
+
+    lookup = ->(halo) { values[halo, true] }
+    assert_equal(expected, SpatialStats::Utils::Lag.neighbor_sum(@matrix, lookup, block_size: 2))
+  end
+
+  def test_window_average_columns
+    values = Numo::DFloat[[1, 10], [2, 20], [3, 30]]
+    expected = Numo::DFloat[[3.0 / 2, 30.0 / 2], [6.0 / 3, 60.0 / 3], [5.0 / 2, 50.0 / 2]]
+
+    assert_equal(expected, SpatialStats::Utils::Lag.window_average(@matrix, values))
+  end
+
   def test_neighbor_sum_idw
     weights = {
       1 => [{ id: 2, weight: 0.5 }],
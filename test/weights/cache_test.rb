@@ -0,0 +1,115 @@
+# frozen_string_literal: true
+
+require 'test_helper'
+require 'tmpdir'
+
+class WeightsCacheTest < ActiveSupport::TestCase
+  def setup
+    # create a 3x3 unit square grid
+    grid = Polygon.grid(0, 0, 1, 3)
+    grid.each(&:save)
+    @scope = Polygon.all
+    SpatialStats::Weights::Cache.clear
+  end
+
+  def teardown
+    SpatialStats::Weights::Cache.clear
+    SpatialStats::Weights::Cache.directory = nil
+  end
+
+  def test_fetch
+    weights = SpatialStats::Weights::Cache.fetch(@scope, :rook, :geom)
+    expected = SpatialStats::Weights::Contiguous.rook(@scope, :geom)
+
+    assert_equal(expected, weights)
+    assert_same(weights, SpatialStats::Weights::Cache.fetch(@scope, :rook, :geom))
+  end
+
+  def test_fetch_params
+    rook = SpatialStats::Weights::Cache.fetch(@scope, :rook, :geom)
+    knn = SpatialStats::Weights::Cache.fetch(@scope, :knn, :geom, 3)
+
+    assert_not_same(rook, knn)
+    assert_equal(27, knn.sparse.nnz)
+  end
+
+  def test_fetch_options
+    Polygon.grid(0, 0, 1, 3).each { |cell| Point.create(position: cell.centroid) }
+    points = Point.all
+    sql = SpatialStats::Weights::Cache.fetch(points, :knn, :position, 3)
+    native = SpatialStats::Weights::Cache.fetch(points, :knn, :position, 3, native: true)
+    expected = SpatialStats::Weights::Distant.knn(points, :position, 3, native: true)
+
+    assert_not_same(sql, native)
+    assert_equal(expected, native)
+    assert_same(native, SpatialStats::Weights::Cache.fetch(points, :knn, :position, 3, native: true))
+  end
+
+  def test_invalidate
+    weights = SpatialStats::Weights::Cache.fetch(@scope, :rook, :geom)
+    SpatialStats::Weights::Cache.invalidate(@scope, :rook, :geom)
+
+    assert_not_same(weights, SpatialStats::Weights::Cache.fetch(@scope, :rook, :geom))
+  end
+
+  def test_max_age
+    weights = SpatialStats::Weights::Cache.fetch(@scope, :rook, :geom)
+    refetched = SpatialStats::Weights::Cache.fetch(@scope, :rook, :geom, max_age: 0)
+
+    assert_not_same(weights, refetched)
+  end
+
+  def test_directory
+    Dir.mktmpdir do |dir|
+      SpatialStats::Weights::Cache.directory = dir
+      weights = SpatialStats::Weights::Cache.fetch(@scope, :queen, :geom)
+      assert_equal(1, Dir.children(dir).size)
+
+      # drop the in memory entry so it is loaded from the file
+      SpatialStats::Weights::Cache.instance_variable_get(:@entries).clear
+      loaded = SpatialStats::Weights::Cache.fetch(@scope, :queen, :geom)
+
+      assert_not_same(weights, loaded)
+      assert_equal(weights, loaded)
+    end
+  end
+
+  def test_directory_update
+    Dir.mktmpdir do |dir|
+      SpatialStats::Weights::Cache.directory = dir
+      SpatialStats::Weights::Cache.fetch(@scope, :queen, :geom)
+      SpatialStats::Weights::Cache.instance_variable_get(:@entries).clear
+      loaded = SpatialStats::Weights::Cache.fetch(@scope, :queen, :geom)
+
+      # the pairs query is restored, so loaded weights can be updated
+      corner = Polygon.order(:id).first
+      corner.update!(geom: Polygon.new_from_square(10, 10, 1).geom)
+      rebuilt = SpatialStats::Weights::Contiguous.queen(@scope, :geom)
+
+      assert_equal(rebuilt.sparse.coordinates, loaded.update([corner.id]).sparse.coordinates)
+    end
+  end
+
+  def test_directory_distances
+    Dir.mktmpdir do |dir|
+      SpatialStats::Weights::Cache.directory = dir
+      weights = SpatialStats::Weights::Cache.fetch(@scope, :knn, :geom, 3)
+      assert_equal(2, Dir.children(dir).size)
+
+      SpatialStats::Weights::Cache.instance_variable_get(:@entries).clear
+      loaded = SpatialStats::Weights::Cache.fetch(@scope, :knn, :geom, 3)
+
+      assert_equal(weights.inverse_distance(2), loaded.inverse_distance(2))
+      assert_raises(ArgumentError) { loaded.update([@scope.first.id]) }
+
+      SpatialStats::Weights::Cache.invalidate(@scope, :knn, :geom, 3)
+      assert_empty(Dir.children(dir))
+    end
+  end
+
+  def test_unknown_method
+    assert_raises(ArgumentError) do
+      SpatialStats::Weights::Cache.fetch(@scope, :unknown, :geom)
+    end
+  end
+end
@@ -26,4 +26,21 @@ class ContiguousWeightsTest < ActiveSupport::TestCase
     assert_equal(9, weights.n)
     assert_equal(24, weights.dense.sum)
   end
+
+  def test_queen_update
+    scope = Polygon.all
+    weights = SpatialStats::Weights::Contiguous
+              .queen(scope, :geom)
+
+    # move the corner square away from the grid
+    corner = Polygon.order(:id).first
+    corner.update!(geom: Polygon.new_from_square(10, 10, 1).geom)
+    updated = weights.update([corner.id])
+    rebuilt = SpatialStats::Weights::Contiguous
+              .queen(scope, :geom)
+
+    assert_equal(34, updated.dense.sum)
+    assert_equal(rebuilt.sparse.coordinates, updated.sparse.coordinates)
+    assert_equal(40, weights.dense.sum)
+  end
 end
@@ -1,6 +1,9 @@
 # frozen_string_literal: true
 
+require 'numo/narray'
+require 'objspace'
 require 'test_helper'
+require 'tmpdir'
 
 class CSRMatrixTest < ActiveSupport::TestCase
   def setup
@@ -62,6 +65,34 @@ class CSRMatrixTest < ActiveSupport::TestCase
     assert_equal([0, 1, 2, 3, 3], csr.row_index)
   end
 
+  def test_from_coo
+    csr = SpatialStats::Weights::CSRMatrix.from_coo([2, 0, 1], [0, 2, 1], [0.5, 1, 1], 4)
+
+    assert_equal(4, csr.n)
+    assert_equal(3, csr.nnz)
+    assert_equal([1, 1, 0.5], csr.values)
+    assert_equal([2, 1, 0], csr.col_index)
+    assert_equal([0, 1, 2, 3, 3], csr.row_index)
+  end
+
+  def test_from_coo_narray
+    i_idx = Numo::Int32[0, 1, 2]
+    j_idx = Numo::Int32[2, 1, 0]
+    csr = SpatialStats::Weights::CSRMatrix.from_coo(i_idx, j_idx, 1, @n)
+
+    assert_equal(SpatialStats::Weights::CSRMatrix.new(@weights, @n).coordinates,
+                 csr.coordinates)
+  end
+
+  def test_from_coo_failure
+    assert_raises(ArgumentError) do
+      SpatialStats::Weights::CSRMatrix.from_coo([0], [3], 1, @n)
+    end
+    assert_raises(ArgumentError) do
+      SpatialStats::Weights::CSRMatrix.from_coo([0, 1], [1], 1, @n)
+    end
+  end
+
   def test_mulvec_success
     csr = SpatialStats::Weights::CSRMatrix.new(@weights, @n)
     vec = [1, 2, 3]
@@ -70,6 +101,39 @@ class CSRMatrixTest < ActiveSupport::TestCase
     assert_equal(expected, csr.mulvec(vec))
   end
 
+  def test_mulvec_narray
+    csr = SpatialStats::Weights::CSRMatrix.new(@weights, @n)
+    vec = Numo::DFloat[1, 2, 3]
+    expected = Numo::DFloat[3, 2, 1]
+
+    assert_equal(expected, csr.mulvec(vec))
+  end
+
+  def test_mulvec_packed
+    csr = SpatialStats::Weights::CSRMatrix.new(@weights, @n)
+    vec = [1, 2, 3].pack('d*')
+    expected = [3, 2, 1]
+
+    assert_equal(expected, csr.mulvec(vec).unpack('d*'))
+  end
+
+  def test_mulvec_out
+    csr = SpatialStats::Weights::CSRMatrix.new(@weights, @n)
+    vec = [1, 2, 3]
+    out = Numo::DFloat.zeros(3)
+    expected = Numo::DFloat[3, 2, 1]
+
+    assert_same(out, csr.mulvec(vec, out))
+    assert_equal(expected, out)
+  end
+
+  def test_mulvec_out_failure
+    csr = SpatialStats::Weights::CSRMatrix.new(@weights, @n)
+    vec = [1, 2, 3]
+
+    assert_raises(ArgumentError) { csr.mulvec(vec, Numo::DFloat.zeros(2)) }
+  end
+
   def test_mulvec_failure
     csr = SpatialStats::Weights::CSRMatrix.new(@weights, @n)
     vec = [1, 2, 3, 4]
@@ -77,6 +141,48 @@ class CSRMatrixTest < ActiveSupport::TestCase
     assert_raises(ArgumentError) { csr.mulvec(vec) }
   end
 
+  def test_mulvec_uniform_rows
+    # every row has 2 entries, like kNN weights
+    i_idx = [0, 0, 1, 1, 2, 2]
+    j_idx = [1, 2, 2, 0, 0, 1]
+    values = [0.5, 1.5, 2, -1, 3, 0.25]
+    vec = [1, 2, 3]
+
+    csr = SpatialStats::Weights::CSRMatrix.from_coo(i_idx, j_idx, values, 3)
+    assert_equal([5.5, 5.0, 3.5], csr.mulvec(vec))
+    assert_equal(csr.mulvec(vec).last, csr.dot_row(vec, 2))
+
+    binary = SpatialStats::Weights::CSRMatrix.from_coo(i_idx, j_idx, 1, 3)
+    assert_equal([5.0, 4.0, 3.0], binary.mulvec(vec))
+    assert_equal([2.5, 2.0, 1.5], binary.row_standardize.mulvec(vec))
+    assert_equal([5.0, 4.0, 3.0], binary.astype(:float32).mulvec(vec))
+  end
+
+  def test_mulmat
+    csr = SpatialStats::Weights::CSRMatrix.new(@weights, @n)
+    mat = Numo::DFloat[[1, 4], [2, 5], [3, 6]]
+    expected = Numo::DFloat[[3, 6], [2, 5], [1, 4]]
+
+    assert_equal(expected, csr.mulmat(mat))
+  end
+
+  def test_mulmat_out
+    csr = SpatialStats::Weights::CSRMatrix.new(@weights, @n)
+    mat = [[1, 4], [2, 5], [3, 6]]
+    out = Numo::DFloat.zeros(3, 2)
+    expected = Numo::DFloat[[3, 6], [2, 5], [1, 4]]
+
+    assert_same(out, csr.mulmat(mat, out))
+    assert_equal(expected, out)
+  end
+
+  def test_mulmat_failure
+    csr = SpatialStats::Weights::CSRMatrix.new(@weights, @n)
+
+    assert_raises(ArgumentError) { csr.mulmat(Numo::DFloat[[1, 2], [3, 4]]) }
+    assert_raises(ArgumentError) { csr.mulmat(Numo::DFloat[1, 2, 3]) }
+  end
+
   def test_dot_row_success
     csr = SpatialStats::Weights::CSRMatrix.new(@weights, @n)
     vec = [1, 2, 3]
@@ -86,6 +192,14 @@ class CSRMatrixTest < ActiveSupport::TestCase
     assert_equal(expected, csr.dot_row(vec, 0))
   end
 
+  def test_dot_row_narray
+    csr = SpatialStats::Weights::CSRMatrix.new(@weights, @n)
+    vec = Numo::DFloat[1, 2, 3]
+    expected = 3
+
+    assert_equal(expected, csr.dot_row(vec, 0))
+  end
+
   def test_dot_row_failure
     csr = SpatialStats::Weights::CSRMatrix.new(@weights, @n)
     vec = [1, 2, 3, 4]
@@ -101,6 +215,270 @@ class CSRMatrixTest < ActiveSupport::TestCase
     assert_raises(ArgumentError) { csr.dot_row(vec, idx) }
   end
 
+  def test_shape
+    csr = SpatialStats::Weights::CSRMatrix.new(@weights, @n)
+
+    assert_equal([3, 3], csr.shape)
+  end
+
+  def test_diagonal
+    csr = SpatialStats::Weights::CSRMatrix.new(@weights, @n)
+
+    assert_equal([0, 1, 0], csr.diagonal)
+    assert_equal(1, csr.trace)
+  end
+
+  def test_row_sums
+    weights = @weights.merge('c' => [{ id: 'a', weight: 2 }, { id: 'b', weight: 1 }])
+    csr = SpatialStats::Weights::CSRMatrix.new(weights, @n)
+
+    assert_equal([1, 1, 3], csr.row_sums)
+  end
+
+  def test_row_standardize
+    weights = @weights.merge('c' => [{ id: 'a', weight: 2 }, { id: 'b', weight: 2 }])
+    csr = SpatialStats::Weights::CSRMatrix.new(weights, @n)
+    standardized = csr.row_standardize
+
+    assert_equal([1, 1, 0.5, 0.5], standardized.values)
+    assert_equal(csr.col_index, standardized.col_index)
+    assert_equal(csr.row_index, standardized.row_index)
+    assert_equal([1, 1, 2, 2], csr.values)
+  end
+
+  def test_moran_moments
+    # w01 = 1, w02 = 2, w12 = 3, w20 = 4, not symmetric
+    csr = SpatialStats::Weights::CSRMatrix.from_coo([0, 0, 1, 2], [1, 2, 2, 0], [1, 2, 3, 4], 3)
+    moments = csr.moran_moments
+
+    assert_equal(10, moments[:s0])
+    assert_equal(46, moments[:s1])
+    assert_equal(146, moments[:s2])
+  end
+
+  def test_moran_moments_symmetric
+    csr = SpatialStats::Weights::CSRMatrix.new(@weights, @n)
+    moments = csr.moran_moments
+
+    assert_equal(3, moments[:s0])
+    assert_equal(6, moments[:s1])
+    assert_equal(12, moments[:s2])
+  end
+
+  def test_transpose
+    csr = SpatialStats::Weights::CSRMatrix.from_coo([0, 2, 0], [2, 1, 1], [2, 3, 1], 3)
+    transposed = csr.transpose
+
+    assert_equal(3, transposed.n)
+    assert_equal([1, 3, 2], transposed.values)
+    assert_equal([0, 2, 0], transposed.col_index)
+    assert_equal([0, 0, 2, 3], transposed.row_index)
+  end
+
+  def test_symmetric
+    csr = SpatialStats::Weights::CSRMatrix.new(@weights, @n)
+    assert(csr.symmetric?)
+
+    csr = SpatialStats::Weights::CSRMatrix.from_coo([0, 1], [1, 0], [1, 2], 2)
+    refute(csr.symmetric?)
+
+    csr = SpatialStats::Weights::CSRMatrix.from_coo([0], [1], 1, 2)
+    refute(csr.symmetric?)
+  end
+
+  def test_symmetrize
+    # 0 -> 1, 1 -> 2 and 2 -> 1, like asymmetric knn weights
+    csr = SpatialStats::Weights::CSRMatrix.from_coo([0, 1, 2], [1, 2, 1], [1, 2, 3], 3)
+
+    union = csr.symmetrize
+    assert(union.symmetric?)
+    assert_equal({ [0, 1] => 1, [1, 0] => 1, [1, 2] => 3, [2, 1] => 3 }, union.coordinates)
+
+    intersection = csr.symmetrize(:intersection)
+    assert(intersection.symmetric?)
+    assert_equal({ [1, 2] => 2, [2, 1] => 2 }, intersection.coordinates)
+  end
+
+  def test_symmetrize_failure
+    csr = SpatialStats::Weights::CSRMatrix.new(@weights, @n)
+    assert_raises(ArgumentError) { csr.symmetrize(:average) }
+  end
+
+  def test_splice
+    # path 0 - 1 - 2, then 2 moves next to 0 instead of 1
+    csr = SpatialStats::Weights::CSRMatrix.from_coo([0, 1, 1, 2], [1, 0, 2, 1], 1, 3)
+    spliced = csr.splice([2], [0, 2], [2, 0], [2, 3])
+
+    assert_equal({ [0, 1] => 1, [0, 2] => 2, [1, 0] => 1, [2, 0] => 3 }, spliced.coordinates)
+    assert_equal([0, 2, 3, 4], spliced.row_index)
+    assert_equal(4, csr.nnz)
+  end
+
+  def test_splice_standardized
+    # 0 is next to 1 and 2, then 1 moves away from 0
+    csr = SpatialStats::Weights::CSRMatrix.from_coo([0, 0, 1, 2], [1, 2, 0, 0], 1, 3).row_standardize
+    spliced = csr.splice([1], [1], [2], 1)
+
+    assert_equal(:binary_standardized, spliced.values_type)
+    assert_equal({ [0, 2] => 1.0, [1, 2] => 1.0, [2, 0] => 1.0 }, spliced.coordinates)
+    assert_equal([1.0, 1.0, 1.0], spliced.row_sums)
+    assert_raises(ArgumentError) { csr.splice([1], [1], [2], 2) }
+    assert_raises(ArgumentError) { csr.splice([1], [1], [2], [1.0]) }
+  end
+
+  def test_splice_float32
+    csr = SpatialStats::Weights::CSRMatrix.from_coo([0, 1, 1, 2], [1, 0, 2, 1], [0.5, 0.5, 0.25, 0.25], 3)
+                                          .astype(:float32)
+    spliced = csr.splice([2], [0, 2], [2, 0], [2, 3])
+
+    assert_equal(:float32, spliced.values_type)
+    assert_equal({ [0, 1] => 0.5, [0, 2] => 2, [1, 0] => 0.5, [2, 0] => 3 }, spliced.coordinates)
+  end
+
+  def test_splice_failure
+    csr = SpatialStats::Weights::CSRMatrix.from_coo([0, 1, 1, 2], [1, 0, 2, 1], 1, 3)
+    assert_raises(ArgumentError) { csr.splice([3], [], [], 1) }
+    assert_raises(ArgumentError) { csr.splice([2], [0], [1], 1) }
+    assert_raises(ArgumentError) { csr.splice([2], [2], [0, 1], 1) }
+  end
+
+  def test_knn_pairs
+    # points on a line at 0, 1 and 3, and one without coordinates
+    pairs = SpatialStats::Weights::CSRMatrix.knn_pairs([0, 1, 3, Float::NAN], [0, 0, 0, 0], 1)
+
+    assert_equal([0, 1, 2], pairs[:i_idx].unpack('l*'))
+    assert_equal([1, 0, 1], pairs[:j_idx].unpack('l*'))
+    assert_equal([1.0, 1.0, 2.0], pairs[:distance].unpack('d*'))
+  end
+
+  def test_knn_pairs_ties
+    # 0 is as far from 1 as from 2, the lower index wins
+    pairs = SpatialStats::Weights::CSRMatrix.knn_pairs([0, -1, 1], [0, 0, 0], 1)
+
+    assert_equal([1, 0, 0], pairs[:j_idx].unpack('l*'))
+  end
+
+  def test_band_pairs
+    x = [0.5, 1.5, 2.5] * 3
+    y = [0.5] * 3 + [1.5] * 3 + [2.5] * 3
+    pairs = SpatialStats::Weights::CSRMatrix.band_pairs(x, y, 1)
+    csr = SpatialStats::Weights::CSRMatrix.from_coo(pairs[:i_idx], pairs[:j_idx], 1, 9)
+
+    # same as rook contiguity on a 3x3 grid
+    assert_equal(24, csr.nnz)
+    assert(csr.symmetric?)
+    assert_equal([2, 3, 2, 3, 4, 3, 2, 3, 2], csr.row_sums)
+  end
+
+  def test_point_pairs_failure
+    assert_raises(ArgumentError) { SpatialStats::Weights::CSRMatrix.knn_pairs([0, 1], [0], 1) }
+    assert_raises(ArgumentError) { SpatialStats::Weights::CSRMatrix.knn_pairs([0, 1], [0, 1], 0) }
+    assert_raises(ArgumentError) { SpatialStats::Weights::CSRMatrix.band_pairs([0, 1], [0, 1], -1) }
+  end
+
+  def test_inverse_distance
+    csr = SpatialStats::Weights::CSRMatrix.from_coo([0, 1, 2, 2], [1, 0, 0, 1], [0.5, 0.5, 1, 2], 3)
+
+    assert_equal([1.0, 1.0, 0.5, 0.25], csr.inverse_distance(1).values)
+    assert_equal(csr.row_index, csr.inverse_distance(1).row_index)
+    assert_raises(ArgumentError) do
+      SpatialStats::Weights::CSRMatrix.from_coo([0], [1], [0], 2).inverse_distance(1)
+    end
+  end
+
+  def test_kernel
+    csr = SpatialStats::Weights::CSRMatrix.from_coo([0, 0, 1], [1, 2, 2], [1, 2, 3], 3)
+
+    triangular = csr.kernel(:triangular, 2)
+    assert_equal([0.5], triangular.values)
+    assert_equal([0, 1, 1, 1], triangular.row_index)
+
+    assert_equal([0.87890625, 0.5625, 0.19140625], csr.kernel(:bisquare, 4).values)
+    assert_equal([-0.5, -2, -4.5], csr.kernel(:gaussian, 1).values.map { |v| Math.log(v).round(12) })
+  end
+
+  def test_kernel_failure
+    csr = SpatialStats::Weights::CSRMatrix.from_coo([0], [1], [1], 2)
+    assert_raises(ArgumentError) { csr.kernel(:uniform, 1) }
+    assert_raises(ArgumentError) { csr.kernel(:gaussian, 0) }
+  end
+
+  def test_window
+    csr = SpatialStats::Weights::CSRMatrix.from_coo([0, 1, 1, 2, 2], [1, 2, 0, 2, 0], [1.5, 2, 3, 4, 5], 3)
+    windowed = csr.window
+
+    assert_equal([0, 2, 5, 7], windowed.row_index)
+    assert_equal([0, 1, 1, 2, 0, 2, 0], windowed.col_index)
+    assert_equal([1, 1.5, 1, 2, 3, 4, 5], windowed.values)
+    assert_equal(5, csr.nnz)
+
+    binary = SpatialStats::Weights::CSRMatrix.from_coo([0, 1, 1, 2], [1, 0, 2, 1], 1, 3)
+    assert_equal(:binary, binary.window.values_type)
+    assert_equal([0, 1, 0, 1, 2, 1, 2], binary.window.col_index)
+    assert_equal(:float64, binary.row_standardize.window.values_type)
+    assert_equal([1, 1, 0.5, 1, 0.5, 1, 1], binary.row_standardize.window.values)
+    assert_equal(:float32, binary.astype(:float32).window.values_type)
+  end
+
+  def test_window_labels
+    csr = SpatialStats::Weights::CSRMatrix.from_coo([0, 1], [1, 0], 1, 2)
+
+    assert_equal([0, 1, 0, 1], csr.window.col_index)
+    assert_equal([1, 0, 1, 0], csr.window([1, 0]).col_index)
+  end
+
+  def test_window_failure
+    csr = SpatialStats::Weights::CSRMatrix.from_coo([0, 1, 1, 2], [1, 0, 2, 1], 1, 3)
+    block, = csr.row_block(1, 2)
+
+    assert_raises(ArgumentError) { csr.window([0]) }
+    assert_raises(ArgumentError) { block.window }
+  end
+
+  def test_local_stats
+    # row standardized path 0 - 1 - 2
+    csr = SpatialStats::Weights::CSRMatrix.from_coo([0, 1, 1, 2], [1, 0, 2, 1], [1, 0.5, 0.5, 1], 3)
+    z = [1.0, -0.5, -0.5]
+
+    moran = csr.local_stats(:moran, z, z)
+    assert_equal([-0.5, -0.125, 0.25], moran[:stat])
+    assert_equal([2.0, 1.375, 2.0], moran[:variance])
+    assert_in_delta(0.5303, moran[:z_score][2], 0.0001)
+    assert_equal([3, 1, 2], moran[:quads])
+
+    geary = csr.local_stats(:geary, z, z)
+    assert_equal([2.25, 1.125, 0.0], geary[:stat])
+    refute(geary.key?(:variance))
+
+    getis_ord = csr.local_stats(:getis_ord, [2.0, 4.0, 5.0], [4, 2, 1])
+    assert_equal([1.0, 0.625, 0.4], getis_ord[:stat])
+    assert_equal([0, 1, 1], getis_ord[:quads])
+  end
+
+  def test_local_stats_multivariate_geary
+    csr = SpatialStats::Weights::CSRMatrix.from_coo([0, 1, 1, 2], [1, 0, 2, 1], [1, 0.5, 0.5, 1], 3)
+    z = Numo::DFloat.cast([[1.0, 0.0], [-0.5, 1.0], [-0.5, -1.0]])
+
+    result = csr.local_stats(:multivariate_geary, z, z)
+    assert_equal([1.625, 1.8125, 2.0], result[:stat].to_a)
+    refute(result.key?(:quads))
+
+    assert_raises(ArgumentError) do
+      csr.local_stats(:multivariate_geary, z, Numo::DFloat.zeros(3, 3))
+    end
+  end
+
+  def test_local_stats_out
+    csr = SpatialStats::Weights::CSRMatrix.from_coo([0, 1, 1, 2], [1, 0, 2, 1], [1, 0.5, 0.5, 1], 3)
+    z = Numo::DFloat.cast([1.0, -0.5, -0.5])
+    out = Numo::DFloat.zeros(3)
+
+    result = csr.local_stats(:moran, z, z, stat: out)
+    assert_same(out, result[:stat])
+    assert_equal([-0.5, -0.125, 0.25], out.to_a)
+    assert_kind_of(Numo::DFloat, result[:variance])
+  end
+
   def test_coordinates
     csr = SpatialStats::Weights::CSRMatrix.new(@weights, @n)
     expected = {
@@ -111,4 +489,421 @@ class CSRMatrixTest < ActiveSupport::TestCase
 
     assert_equal(expected, csr.coordinates)
   end
+
+  def test_local_mc
+    csr = SpatialStats::Weights::CSRMatrix.new(@weights, @n)
+    values = [1, 1, 1]
+    rids = Numo::Int32.zeros(9, 2)
+
+    # every permutation ties the original stat
+    result = csr.local_mc(:moran, values, values, values, rids, Random.new(1))
+    assert_equal([9, 9, 9], result)
+  end
+
+  def test_local_mc_neighborless
+    weights = @weights.merge('d' => [])
+    csr = SpatialStats::Weights::CSRMatrix.new(weights, 4)
+    values = [1, 1, 1, 1]
+    rids = Numo::Int32.zeros(9, 2)
+
+    result = csr.local_mc(:getis_ord, values, values, values, rids, Random.new(1))
+    assert_equal(9, result[3])
+  end
+
+  def test_local_mc_failure
+    csr = SpatialStats::Weights::CSRMatrix.new(@weights, @n)
+    values = [1, 1, 1]
+    rids = Numo::Int32.zeros(9, 2)
+
+    assert_raises(ArgumentError) do
+      csr.local_mc(:unknown, values, values, values, rids, Random.new(1))
+    end
+    assert_raises(ArgumentError) do
+      csr.local_mc(:moran, [1, 1], values, values, rids, Random.new(1))
+    end
+  end
+
+  def test_local_mc_threads
+    csr = SpatialStats::Weights::CSRMatrix.new(@weights, @n)
+    values = [1, 1, 1]
+    rids = Numo::Int32.zeros(9, 2)
+
+    result = csr.local_mc(:moran, values, values, values, rids, Random.new(1), 2)
+    assert_equal([9, 9, 9], result)
+    assert_raises(ArgumentError) do
+      csr.local_mc(:moran, values, values, values, rids, Random.new(1), 0)
+    end
+  end
+
+  def test_local_mc_labels
+    csr = SpatialStats::Weights::CSRMatrix.new(@weights, @n)
+    values = [1, 1, 1]
+    rids = Numo::Int32.zeros(9, 2)
+
+    result = csr.local_mc(:moran, values, values, values, rids, Random.new(1), 1, [2, 0, 1])
+    assert_equal([9, 9, 9], result)
+    assert_raises(ArgumentError) do
+      csr.local_mc(:moran, values, values, values, rids, Random.new(1), 1, [0, 1])
+    end
+    assert_raises(ArgumentError) do
+      csr.local_mc(:moran, values, values, values, rids, Random.new(1), 1, [0, 1, 1])
+    end
+    assert_raises(ArgumentError) do
+      csr.global_mc(values, values, 9, Random.new(1), 1, 0, [0, 1, 3])
+    end
+  end
+
+  def test_local_mc_sampled
+    # star, 0 is a neighbor of every other observation
+    n = 6
+    others = (1...n).to_a
+    csr = SpatialStats::Weights::CSRMatrix.from_coo([0] * (n - 1) + others, others + [0] * (n - 1),
+                                                   1, n)
+    values = [-7.0, -4.0, -1.0, 2.0, 5.0, 8.0]
+    stat = csr.mulvec(values).each_with_index.map { |lag, i| lag * values[i] }
+
+    # the hub samples every other observation, so each permutation ties
+    result = csr.local_mc(:moran, values, values, stat, 99, Random.new(1))
+    assert_equal(99, result[0])
+    assert_equal(result, csr.local_mc(:moran, values, values, stat, 99, Random.new(1), 3))
+
+    window = SpatialStats::Weights::CSRMatrix.from_coo([0] * n, (0...n).to_a, 1, n)
+    assert_raises(ArgumentError) do
+      window.local_mc(:moran, values, values, stat, 99, Random.new(1))
+    end
+  end
+
+  def test_local_mc_sequential
+    csr = SpatialStats::Weights::CSRMatrix.new(@weights, @n)
+    values = [1, 1, 1]
+
+    # every permutation ties, so each observation stops at the 5th
+    result = csr.local_mc_sequential(:moran, values, values, values, 99, 1, 5)
+    assert_equal({ counts: [5, 5, 5], permutations: [5, 5, 5] }, result)
+    assert_raises(ArgumentError) do
+      csr.local_mc_sequential(:moran, values, values, values, 99, 1, 0)
+    end
+  end
+
+  def test_global_mc
+    csr = SpatialStats::Weights::CSRMatrix.new(@weights, @n)
+    values = [1, -1, 0]
+
+    result = csr.global_mc(values, values, 9, Random.new(1), 2)
+    assert_equal(9, result.size)
+    assert_equal(result, csr.global_mc(values, values, 9, Random.new(1), 2))
+  end
+
+  def test_global_mc_seed
+    csr = SpatialStats::Weights::CSRMatrix.new(@weights, @n)
+    values = [1, -1, 0]
+
+    # every permutation has its own stream, so threads don't matter
+    result = csr.global_mc(values, values, 9, 1234, 1)
+    assert_equal(result, csr.global_mc(values, values, 9, 1234, 3))
+    assert_equal(result, csr.global_mc(values, values, 9, 1234 + 2**64, 1))
+  end
+
+  def test_global_mc_seed_streams
+    n = 50
+    rows = (0...n).flat_map { |i| [i, i] }
+    cols = (0...n).flat_map { |i| [(i + 1) % n, (i - 1) % n] }
+    csr = SpatialStats::Weights::CSRMatrix.from_coo(rows, cols, 0.5, n)
+    values = Array.new(n) { |i| Math.sin(i) }
+
+    # neighbouring seeds do not share shifted streams
+    result = csr.global_mc(values, values, 99, 1234, 1)
+    shifted = csr.global_mc(values, values, 99, 1235, 1)
+    assert_empty(result & shifted)
+  end
+
+  def test_global_mc_offset
+    csr = SpatialStats::Weights::CSRMatrix.new(@weights, @n)
+    values = [1, -1, 0]
+
+    # batches from an offset continue the permutations of the seed
+    result = csr.global_mc(values, values, 9, 1234, 1)
+    batches = csr.global_mc(values, values, 4, 1234, 2) + csr.global_mc(values, values, 5, 1234, 1, 4)
+    assert_equal(result, batches)
+  end
+
+  def test_global_mc_trapped_signal
+    skip 'no USR1 signal' unless Signal.list.key?('USR1')
+
+    n = 2000
+    rows = (0...n).flat_map { |i| [i, i] }
+    cols = (0...n).flat_map { |i| [(i + 1) % n, (i - 1) % n] }
+    csr = SpatialStats::Weights::CSRMatrix.from_coo(rows, cols, 0.5, n)
+    values = Array.new(n) { |i| Math.sin(i) }
+    expected = csr.global_mc(values, values, 5000, 1234, 2)
+
+    trapped = 0
+    previous = trap('USR1') { trapped += 1 }
+    done = false
+    signaler = Thread.new do
+      until done
+        sleep 0.005
+        Process.kill('USR1', Process.pid)
+      end
+    end
+
+    # a trap that returns resumes the permutations instead of raising
+    result = csr.global_mc(values, values, 5000, 1234, 2)
+    done = true
+    signaler.join
+    assert_operator(trapped, :>, 0)
+    assert_equal(expected, result)
+  ensure
+    trap('USR1', previous || 'DEFAULT') if defined?(previous) && Signal.list.key?('USR1')
+  end
+
+  def test_dump_load
+    csr = SpatialStats::Weights::CSRMatrix.new(@weights, @n)
+
+    Dir.mktmpdir do |dir|
+      path = File.join(dir, 'weights.csr')
+      csr.dump(path, @weights.keys)
+
+      [true, false].each do |mmap|
+        loaded = SpatialStats::Weights::CSRMatrix.load(path, mmap: mmap)
+        assert_equal(csr.values, loaded.values)
+        assert_equal(csr.col_index, loaded.col_index)
+        assert_equal(csr.row_index, loaded.row_index)
+        assert_equal(@weights.keys, loaded.keys)
+        assert_equal([3, 2, 1], loaded.mulvec([1, 2, 3]))
+      end
+    end
+  end
+
+  def test_copy_binary
+    csr = SpatialStats::Weights::CSRMatrix.from_coo([0, 1, 1, 2], [1, 0, 2, 1], [1.5, 2, 3, -4], 3)
+    data = csr.copy_binary
+
+    assert_equal("PGCOPY\n\xFF\r\n\0".b, data[0, 11])
+    assert_equal([-1], data[-2..].unpack('s>'))
+    tuples = data[19...-2].scan(/.{30}/m).map do |tuple|
+      fields = tuple.unpack('s>l>l>l>l>l>G')
+      [fields[0], fields[2], fields[4], fields[6]]
+    end
+    assert_equal([[3, 0, 1, 1.5], [3, 1, 0, 2.0], [3, 1, 2, 3.0], [3, 2, 1, -4.0]], tuples)
+
+    chunks = csr.copy_binary(0, 2) + csr.copy_binary(2, 3)
+    assert_equal(data, chunks)
+    assert_raises(ArgumentError) { csr.copy_binary(2, 1) }
+  end
+
+  def test_load_version1
+    csr = SpatialStats::Weights::CSRMatrix.from_coo([0, 1, 1, 2], [1, 0, 2, 1], [1.5, 2, 3, -4], 3)
+    keys = Marshal.dump(@weights.keys)
+    header = 'SSCSRMAT' + [1, 0x01020304].pack('L2') + [3, 4, keys.bytesize, 0, 0, 0].pack('q6')
+
+    Dir.mktmpdir do |dir|
+      path = File.join(dir, 'weights.csr')
+      File.binwrite(path, header + csr.values.pack('d*') + csr.col_index.pack('l*') +
+                          csr.row_index.pack('l*') + keys)
+
+      [true, false].each do |mmap|
+        loaded = SpatialStats::Weights::CSRMatrix.load(path, mmap: mmap)
+        assert_equal(csr.values, loaded.values)
+        assert_equal(csr.col_index, loaded.col_index)
+        assert_equal(csr.row_index, loaded.row_index)
+        assert_equal(@weights.keys, loaded.keys)
+      end
+    end
+  end
+
+  def test_row_block
+    csr = SpatialStats::Weights::CSRMatrix.from_coo([0, 1, 1, 2, 3], [1, 0, 3, 3, 2], [1, 2, 3, 4, 5], 4)
+    vec = [1, 2, 3, 4]
+    block, halo = csr.row_block(1, 3)
+
+    assert_equal([0, 3], halo)
+    assert_equal([2, 2], block.shape)
+    assert_equal([0, 2, 3], block.row_index)
+    assert_equal([0, 1, 1], block.col_index)
+    assert_equal(csr.mulvec(vec)[1...3], block.mulvec(vec.values_at(*halo)))
+
+    empty, halo = csr.row_block(2, 2)
+    assert_equal([0, 0], empty.shape)
+    assert_equal([], halo)
+  end
+
+  def test_row_block_mmap
+    csr = SpatialStats::Weights::CSRMatrix.from_coo([0, 1, 1, 2, 3], [1, 0, 3, 3, 2], [1, 2, 3, 4, 5], 4)
+    vec = [1, 2, 3, 4]
+
+    Dir.mktmpdir do |dir|
+      path = File.join(dir, 'weights.csr')
+      csr.dump(path)
+      loaded = SpatialStats::Weights::CSRMatrix.load(path, mmap: true)
+
+      lags = [0, 2].flat_map do |start|
+        block, halo = loaded.row_block(start, start + 2)
+        block.mulvec(vec.values_at(*halo))
+      end
+      assert_equal(csr.mulvec(vec), lags)
+      assert_equal(csr.mulvec(vec), loaded.mulvec(vec))
+    end
+  end
+
+  def test_row_block_failure
+    csr = SpatialStats::Weights::CSRMatrix.from_coo([0, 1, 1, 2, 3], [1, 0, 3, 3, 2], [1, 2, 3, 4, 5], 4)
+    block, = csr.row_block(1, 2)
+
+    assert_equal([1, 2], block.shape)
+    assert_raises(ArgumentError) { csr.row_block(3, 2) }
+    assert_raises(ArgumentError) { csr.row_block(0, 5) }
+    assert_raises(ArgumentError) { block.mulvec([1]) }
+    assert_raises(ArgumentError) { block.transpose }
+    assert_raises(ArgumentError) { block.moran_moments }
+  end
+
+  def test_values_type
+    csr = SpatialStats::Weights::CSRMatrix.from_coo([0, 0, 1, 2], [1, 2, 0, 0], 1, 3)
+    assert_equal(:binary, csr.values_type)
+    assert_equal([1.0, 1.0, 1.0, 1.0], csr.values)
+
+    standardized = csr.row_standardize
+    assert_equal(:binary_standardized, standardized.values_type)
+    assert_equal([0.5, 0.5, 1.0, 1.0], standardized.values)
+    assert_equal([2.5, 1.0, 1.0], standardized.mulvec([1, 2, 3]))
+    assert_equal(csr.astype(:float64).row_standardize.mulvec([1, 2, 3]),
+                 standardized.mulvec([1, 2, 3]))
+
+    weighted = SpatialStats::Weights::CSRMatrix.from_coo([0, 1], [1, 0], [0.5, 2], 2)
+    assert_equal(:float64, weighted.values_type)
+  end
+
+  def test_astype
+    csr = SpatialStats::Weights::CSRMatrix.from_coo([0, 0, 1, 2], [1, 2, 0, 0], [0.1, 0.9, 1, 1], 3)
+    float32 = csr.astype(:float32)
+    assert_equal(:float32, float32.values_type)
+    assert_equal(csr.col_index, float32.col_index)
+    float32.mulvec([1, 2, 3]).zip(csr.mulvec([1, 2, 3])).each do |a, b|
+      assert_in_delta(b, a, 1e-6)
+    end
+
+    values = csr.row_standardize.astype(:float32).values
+    assert_in_delta(0.1, values[0], 1e-6)
+    assert_equal(:binary, csr.splice([0], [0], [1], 1).astype(:binary).values_type)
+  end
+
+  def test_astype_failure
+    csr = SpatialStats::Weights::CSRMatrix.from_coo([0, 1], [1, 0], [0.5, 1], 2)
+
+    assert_raises(ArgumentError) { csr.astype(:binary) }
+    assert_raises(ArgumentError) { csr.astype(:int32) }
+  end
+
+  def test_dump_load_values_type
+    binary = SpatialStats::Weights::CSRMatrix.from_coo([0, 0, 1, 2], [1, 2, 0, 0], 1, 3)
+    matrices = [binary, binary.row_standardize, binary.row_standardize.astype(:float32)]
+
+    Dir.mktmpdir do |dir|
+      path = File.join(dir, 'weights.csr')
+      matrices.each do |csr|
+        csr.dump(path)
+
+        [true, false].each do |mmap|
+          loaded = SpatialStats::Weights::CSRMatrix.load(path, mmap: mmap)
+          assert_equal(csr.values_type, loaded.values_type)
+          assert_equal(csr.values, loaded.values)
+          assert_equal(csr.mulvec([1, 2, 3]), loaded.mulvec([1, 2, 3]))
+        end
+      end
+    end
+  end
+
+  def test_permute
+    csr = SpatialStats::Weights::CSRMatrix.from_coo([0, 1, 1, 2], [1, 0, 2, 1], [1.5, 2, 3, -4], 3)
+    perm = [2, 0, 1]
+    permuted = csr.permute(perm)
+
+    assert_equal([0, 1, 2, 4], permuted.row_index)
+    assert_equal([2, 2, 1, 0], permuted.col_index)
+    assert_equal([-4.0, 1.5, 2.0, 3.0], permuted.values)
+    assert_equal(csr.mulvec([1, 2, 3]).values_at(*perm), permuted.mulvec([1, 2, 3].values_at(*perm)))
+
+    binary = SpatialStats::Weights::CSRMatrix.from_coo([0, 1, 1, 2], [1, 0, 2, 1], 1, 3).row_standardize
+    assert_equal(:binary_standardized, binary.permute(perm).values_type)
+    assert_equal([1.0, 1.0, 0.5, 0.5], binary.permute(perm).values)
+  end
+
+  def test_permute_failure
+    csr = SpatialStats::Weights::CSRMatrix.from_coo([0, 1], [1, 0], 1, 2)
+
+    assert_raises(ArgumentError) { csr.permute([0]) }
+    assert_raises(ArgumentError) { csr.permute([0, 0]) }
+    assert_raises(ArgumentError) { csr.permute([0, 2]) }
+  end
+
+  def test_rcm
+    # a path 0 - 2 - 4 - 1 - 3 with scattered labels
+    csr = SpatialStats::Weights::CSRMatrix.from_coo([0, 2, 2, 4, 4, 1, 1, 3], [2, 0, 4, 2, 1, 4, 3, 1], 1, 5)
+    perm = csr.rcm
+
+    assert_equal([0, 1, 2, 3, 4], perm.sort)
+    permuted = csr.permute(perm)
+    bandwidth = (0...5).flat_map do |i|
+      permuted.col_index[permuted.row_index[i]...permuted.row_index[i + 1]].map { |j| (i - j).abs }
+    end.max
+    assert_equal(1, bandwidth)
+    assert_equal([], SpatialStats::Weights::CSRMatrix.from_coo([], [], 1, 0).rcm)
+  end
+
+  def test_hilbert_order
+    order = SpatialStats::Weights::CSRMatrix.hilbert_order([0, 1, 0, 1], [0, 1, 1, 0])
+    assert_equal([0, 2, 1, 3], order)
+
+    order = SpatialStats::Weights::CSRMatrix.hilbert_order([Float::NAN, 1, 0], [0, 1, 0])
+    assert_equal([2, 1, 0], order)
+  end
+
+  def test_copy_binary_labels
+    csr = SpatialStats::Weights::CSRMatrix.from_coo([0, 1, 1, 2], [1, 0, 2, 1], [1.5, 2, 3, -4], 3)
+    perm = [2, 0, 1]
+    data = csr.permute(perm).copy_binary(0, 3, perm)
+
+    tuples = data[19...-2].scan(/.{30}/m).map do |tuple|
+      fields = tuple.unpack('s>l>l>l>l>l>G')
+      [fields[2], fields[4], fields[6]]
+    end
+    assert_equal([[0, 1, 1.5], [1, 0, 2.0], [1, 2, 3.0], [2, 1, -4.0]], tuples.sort)
+    assert_raises(ArgumentError) { csr.copy_binary(0, 3, [0]) }
+  end
+
+  def test_memory_stats
+    csr = SpatialStats::Weights::CSRMatrix.from_coo([0, 1], [1, 0], [0.5, 2], 2)
+    expected = { values: 16, col_index: 8, row_index: 24, heap: 48, mapped: 0, allocations: 1 }
+
+    assert_equal(expected, csr.memory_stats)
+    assert_equal(32, SpatialStats::Weights::CSRMatrix.from_coo([0, 1], [1, 0], 1, 2).memory_stats[:heap])
+    assert_equal(8, csr.astype(:float32).memory_stats[:values])
+    assert_operator(ObjectSpace.memsize_of(csr), :>=, 48)
+  end
+
+  def test_memory_stats_mmap
+    csr = SpatialStats::Weights::CSRMatrix.from_coo([0, 1], [1, 0], [0.5, 2], 2)
+
+    Dir.mktmpdir do |dir|
+      path = File.join(dir, 'weights.csr')
+      csr.dump(path)
+
+      mapped = SpatialStats::Weights::CSRMatrix.load(path, mmap: true)
+      assert_equal(0, mapped.memory_stats[:heap])
+      assert_equal(File.size(path), mapped.memory_stats[:mapped])
+
+      read = SpatialStats::Weights::CSRMatrix.load(path, mmap: false)
+      assert_equal(csr.memory_stats, read.memory_stats)
+    end
+  end
+
+  def test_load_failure
+    Dir.mktmpdir do |dir|
+      path = File.join(dir, 'weights.csr')
+      File.binwrite(path, 'x' * 100)
+
+      assert_raises(ArgumentError) { SpatialStats::Weights::CSRMatrix.load(path) }
+    end
+  end
 end
@@ -59,4 +59,72 @@ class DistantWeightsTest < ActiveSupport::TestCase
     assert_equal(9, weights.n)
     assert_equal(29.0, weights.dense.sum.round)
   end
+
+  def test_idw_coincident_points
+    Point.create(position: Point.first.position)
+    scope = Point.all
+
+    # a pair at distance 0 has no finite inverse distance
+    assert_raises(ArgumentError) do
+      SpatialStats::Weights::Distant.idw_knn(scope, :position, 4, 2)
+    end
+    assert_raises(ArgumentError) do
+      SpatialStats::Weights::Distant.idw_band(scope, :position, 1, 2, native: true)
+    end
+  end
+
+  def test_distance_band_batches
+    scope = Point.all
+    batch_size = SpatialStats::Queries::Weights.batch_size
+    SpatialStats::Queries::Weights.batch_size = 5
+
+    weights = SpatialStats::Weights::Distant
+              .idw_band(scope, :position, Math.sqrt(2), 2)
+
+    assert_equal(9, weights.n)
+    assert_equal(32.0, weights.dense.sum.round)
+  ensure
+    SpatialStats::Queries::Weights.batch_size = batch_size
+  end
+
+  def test_distance_band_native
+    scope = Point.all
+    weights = SpatialStats::Weights::Distant
+              .distance_band(scope, :position, 1)
+    native = SpatialStats::Weights::Distant
+             .distance_band(scope, :position, 1, native: true)
+
+    assert_equal(weights.keys, native.keys)
+    assert_equal(weights.sparse.coordinates, native.sparse.coordinates)
+  end
+
+  def test_knn_native
+    scope = Point.all
+    weights = SpatialStats::Weights::Distant
+              .knn(scope, :position, 4, native: true)
+
+    assert_equal(9, weights.n)
+    assert_equal(36, weights.dense.sum.round)
+  end
+
+  def test_idw_band_native
+    scope = Point.all
+    weights = SpatialStats::Weights::Distant
+              .idw_band(scope, :position, Math.sqrt(2), 2, native: true)
+
+    assert_equal(9, weights.n)
+    assert_equal(32.0, weights.dense.sum.round)
+  end
+
+  def test_knn_distances
+    scope = Point.all
+    weights = SpatialStats::Weights::Distant
+              .knn(scope, :position, 4)
+    idw = SpatialStats::Weights::Distant
+          .idw_knn(scope, :position, 4, 2)
+
+    assert_equal(36, weights.distances.nnz)
+    assert_equal(29.0, weights.inverse_distance(2).dense.sum.round)
+    assert_equal(idw.sparse.coordinates.keys, weights.inverse_distance(2).sparse.coordinates.keys)
+  end
 end
@@ -2,6 +2,7 @@
 
 require 'numo/narray'
 require 'test_helper'
+require 'tmpdir'
 
 class WeightsMatrixTest < ActiveSupport::TestCase
   def setup
@@ -21,6 +22,36 @@ class WeightsMatrixTest < ActiveSupport::TestCase
     assert_equal(@weights, mat.weights)
   end
 
+  def test_from_coo
+    i_ids = [1, 1, 2, 3, 4, 4]
+    j_ids = [2, 4, 1, 4, 1, 3]
+    mat = SpatialStats::Weights::WeightsMatrix.from_coo(@keys, i_ids, j_ids)
+
+    assert_equal(@keys, mat.keys)
+    assert_equal(4, mat.n)
+    assert_equal(@weights, mat.weights)
+    assert_equal([2, 1, 1, 2], mat.wc)
+  end
+
+  def test_from_coo_missing_key
+    assert_raises(KeyError) do
+      SpatialStats::Weights::WeightsMatrix.from_coo(@keys, [1], [5])
+    end
+  end
+
+  def test_dump_load
+    mat = SpatialStats::Weights::WeightsMatrix.new(@weights)
+
+    Dir.mktmpdir do |dir|
+      path = File.join(dir, 'weights.bin')
+      mat.dump(path)
+      loaded = SpatialStats::Weights::WeightsMatrix.load(path)
+
+      assert_equal(@keys, loaded.keys)
+      assert_equal(mat, loaded)
+    end
+  end
+
   def test_equality_operator_true
     mat1 = SpatialStats::Weights::WeightsMatrix.new(@weights)
     mat2 = SpatialStats::Weights::WeightsMatrix.new(@weights)
@@ -87,6 +118,71 @@ class WeightsMatrixTest < ActiveSupport::TestCase
     assert_equal(expected, standardized_mat.weights)
   end
 
+  def test_standardize_memoized
+    mat = SpatialStats::Weights::WeightsMatrix.new(@weights)
+    standardized_mat = mat.standardize
+
+    assert_same(standardized_mat, mat.standardize)
+    assert_equal([{ id: 2, weight: 1 }, { id: 4, weight: 1 }], mat.weights[1])
+  end
+
+  def test_update
+    mat = SpatialStats::Weights::WeightsMatrix.from_coo(@keys, [1, 1, 2, 3, 4, 4], [2, 4, 1, 4, 1, 3])
+    # 3 is redrawn next to 2 instead of 4
+    mat.pairs_query = lambda do |ids|
+      assert_equal([3], ids)
+      { i_idx: [1, 2].pack('l*'), j_idx: [2, 1].pack('l*') }
+    end
+
+    updated = mat.update([3])
+    expected = {
+      1 => [{ id: 2, weight: 1.0 }, { id: 4, weight: 1.0 }],
+      2 => [{ id: 1, weight: 1.0 }, { id: 3, weight: 1.0 }],
+      3 => [{ id: 2, weight: 1.0 }],
+      4 => [{ id: 1, weight: 1.0 }]
+    }
+    assert_equal(expected, updated.weights)
+    assert_equal(mat.pairs_query, updated.pairs_query)
+    assert_equal(@weights, mat.weights)
+  end
+
+  def test_update_failure
+    mat = SpatialStats::Weights::WeightsMatrix.new(@weights)
+    assert_raises(ArgumentError) { mat.update([1]) }
+  end
+
+  def test_inverse_distance
+    mat = SpatialStats::Weights::WeightsMatrix.from_coo(@keys, [1, 1, 2, 3, 4, 4], [2, 4, 1, 4, 1, 3])
+    mat.distances = SpatialStats::Weights::CSRMatrix.from_coo([0, 0, 1, 2, 3, 3], [1, 3, 0, 3, 0, 2],
+                                                              [0.5, 1, 0.5, 2, 1, 2], 4)
+
+    idw = mat.inverse_distance(2)
+    assert_equal([1.0, 0.25, 1.0, 0.0625, 0.25, 0.0625], idw.sparse.values)
+    assert_equal(mat.distances, idw.distances)
+  end
+
+  def test_kernel
+    mat = SpatialStats::Weights::WeightsMatrix.from_coo(@keys, [1, 1, 2, 3, 4, 4], [2, 4, 1, 4, 1, 3])
+    mat.distances = SpatialStats::Weights::CSRMatrix.from_coo([0, 0, 1, 2, 3, 3], [1, 3, 0, 3, 0, 2],
+                                                              [0.5, 1, 0.5, 2, 1, 2], 4)
+
+    triangular = mat.kernel(:triangular, 2)
+    expected = {
+      1 => [{ id: 2, weight: 0.75 }, { id: 4, weight: 0.5 }],
+      2 => [{ id: 1, weight: 0.75 }],
+      3 => [],
+      4 => [{ id: 1, weight: 0.5 }]
+    }
+    assert_equal(expected, triangular.weights)
+    assert_equal([2, 1, 0, 1], triangular.wc)
+  end
+
+  def test_kernel_failure
+    mat = SpatialStats::Weights::WeightsMatrix.new(@weights)
+    assert_raises(ArgumentError) { mat.kernel(:gaussian, 1) }
+    assert_raises(ArgumentError) { mat.inverse_distance(1) }
+  end
+
   def test_window
     mat = SpatialStats::Weights::WeightsMatrix.new(@weights)
     windowed_mat = mat.window
@@ -153,4 +249,60 @@ class WeightsMatrixTest < ActiveSupport::TestCase
     ]
     assert_equal(expected, dense_mat)
   end
+
+  def test_reorder
+    mat = SpatialStats::Weights::WeightsMatrix.new(@weights)
+    reordered = mat.reorder
+
+    assert_equal([0, 1, 2, 3], reordered.permutation.sort)
+    assert_equal(@keys, reordered.keys)
+    assert_equal(mat, reordered)
+    assert_equal(mat.wc, reordered.wc)
+    assert_equal(mat.standardize, reordered.standardize)
+    assert_equal(mat.window, reordered.window)
+    assert_equal(reordered.permutation, reordered.standardize.permutation)
+    assert_nil(mat.permutation)
+  end
+
+  def test_reorder_permute
+    mat = SpatialStats::Weights::WeightsMatrix.new(@weights).reorder
+    values = [1, 2, 3, 4]
+
+    permuted = mat.permute(values)
+    assert_equal(mat.sparse.mulvec(permuted), mat.permute([6, 1, 4, 4]))
+    assert_equal(values, mat.unpermute(permuted))
+    assert_equal({ stat: values }, mat.unpermute(stat: permuted))
+  end
+
+  def test_reorder_hilbert
+    mat = SpatialStats::Weights::WeightsMatrix.new(@weights)
+    coordinates = { x: [0, 0, 1, 1].pack('d*'), y: [0, 1, 1, 0].pack('d*') }
+    reordered = mat.reorder(:hilbert, coordinates: coordinates)
+
+    assert_equal([0, 1, 2, 3], reordered.permutation)
+    reordered = mat.reorder(:hilbert, coordinates: { x: [1, 0, 0, 1], y: [1, 0, 1, 0] })
+    assert_equal([1, 2, 0, 3], reordered.permutation)
+    assert_equal(mat, reordered)
+  end
+
+  def test_reorder_failure
+    mat = SpatialStats::Weights::WeightsMatrix.new(@weights)
+
+    assert_raises(ArgumentError) { mat.reorder(:hilbert) }
+    assert_raises(ArgumentError) { mat.reorder(:random) }
+  end
+
+  def test_reorder_dump_load
+    mat = SpatialStats::Weights::WeightsMatrix.new(@weights).reorder
+
+    Dir.mktmpdir do |dir|
+      path = File.join(dir, 'rook.weights')
+      mat.dump(path)
+      loaded = SpatialStats::Weights::WeightsMatrix.load(path)
+
+      assert_equal(mat.permutation, loaded.permutation)
+      assert_equal(@keys, loaded.keys)
+      assert_equal(mat, loaded)
+    end
+  end
 end